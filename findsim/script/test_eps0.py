@@ -0,0 +1,47 @@
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# Checks that ijb finds the same neighbors as ij when eps is 0. Column 1 appears in every row,
+# so its IDF is 0, and pairs that only share that column have a similarity of exactly 0.
+# Run from the script directory, after building findsim.
+
+findsim = os.path.abspath('../build/findsim')
+nrows = 400
+k = 20
+modes = ['ijb']
+
+workDir = tempfile.mkdtemp()
+inputFile = os.path.join(workDir, 'eps0.csr')
+random.seed(7)
+with open(inputFile, 'w') as f:
+    for i in range(nrows):
+        cols = {1: random.randint(1, 5)}
+        for c in random.sample(range(2, 300), random.randint(2, 8)):
+            cols[c] = random.randint(1, 5)
+        f.write(' '.join('%d %d' % (c, v) for c, v in sorted(cols.items())) + '\n')
+
+def run(args):
+    return subprocess.check_output([findsim] + args).decode()
+
+def nnz(csrFile):
+    with open(csrFile) as f:
+        return sum(len(line.split()) // 2 for line in f)
+
+trueFile = os.path.join(workDir, 'ij.csr')
+run(['-mode', 'ij', '-k', str(k), '-eps', '0', inputFile, trueFile])
+failed = 0
+for mode in modes:
+    outputFile = os.path.join(workDir, mode + '.csr')
+    run(['-mode', mode, '-k', str(k), '-eps', '0', inputFile, outputFile])
+    #Neighbors with equal similarities may be reported in a different order, which recall allows
+    recall = run(['-mode', 'recall', '-k', str(k), trueFile, outputFile]).split('Recall: ')[1].split()[0]
+    ok = (recall == '1.0000' and nnz(outputFile) == nnz(trueFile) == nrows * k)
+    print (mode + ': ' + str(nnz(outputFile)) + ' neighbors, recall ' + recall + (' OK' if ok else ' FAILED'))
+    failed += not ok
+
+shutil.rmtree(workDir)
+sys.exit(1 if failed else 0)
@@ -0,0 +1,280 @@
+/*!
+ \file  allpairs.c
+ \brief This file contains the All-Pairs-1 and All-Pairs-2 similarity search methods. Both methods
+ index only the suffix of each vector that could still reach eps given the maximum weight of each
+ feature in the collection, and verify the unindexed prefix of each candidate against the forward
+ (rowptr) data. All-Pairs-2 additionally processes vectors in decreasing order of their maximum
+ weight, which allows tighter indexing bounds, a candidate size filter, and remscore pruning during
+ candidate generation.
+
+ Each pair of vectors is compared at most once, and similar pairs are offered to the top-$k$ heaps
+ of both vectors.
+
+ This approach is based on the algorithms in Figures 2 and 3 in the paper
+ R. J. Bayardo, Yiming Ma, Ramakrishnan Srikant. Scaling Up All-Pairs Similarity Search. In Proc. of the 16th Int'l Conf. on World Wide Web, 131-140, 2007
+ */
+
+#include "includes.h"
+
+// forward declarations
+void ap_findMatches(da_csr_t *docs, idx_t rid, char ap2, float eps, val_t *cmax, val_t *rmax,
+        idx_t *plen, val_t *psum, val_t *pmax, ptr_t *colstart, ptr_t *colend, idx_t *colind,
+        val_t *colval, val_t *qvec, da_ivkv_t *cand, idx_t *marker, da_knnheap_t *knng,
+        size_t *ncands, size_t *nverif);
+
+/**
+ * Main entry point to All-Pairs-1 (params->mode == MODE_ALLPAIRS1) and
+ * All-Pairs-2 (params->mode == MODE_ALLPAIRS2).
+ */
+void allpairs(params_t *params)
+{
+    ssize_t i, j, k, rid;
+    size_t nsims, ncands, nverif, nidx;
+    idx_t nrows, ncols, progressInd, pct;
+    char ap2;
+    ptr_t *rowptr, *colptr, *colstart, *colend;
+    idx_t *rowind, *colind, *plen, *marker, *order;
+    val_t *rowval, *colval, *cmax, *rmax, *psum, *pmax, *qvec;
+    double b;
+    da_ivkv_t *cand, *rorder;
+    da_csr_t *docs, *neighbors=NULL;
+    da_knnheap_t *knng;
+
+    docs    = params->docs;
+    ap2     = (params->mode == MODE_ALLPAIRS2);
+    ncands  = 0; // number of candidates that accumulated some similarity
+    nverif  = 0; // number of candidates whose similarity was fully computed
+    nsims   = 0; // number of similar documents found
+
+    /** Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF, normalize **/
+    preprocessInputData(params);
+
+    timer_start(params->timer_3); /* overall knn graph construction time */
+
+    nrows  = docs->nrows;
+    ncols  = docs->ncols;
+    rowptr = docs->rowptr;
+    rowind = docs->rowind;
+    rowval = docs->rowval;
+
+    /* max weight of each feature and of each vector */
+    timer_start(params->timer_7); /* indexing time */
+    cmax = da_vsmalloc(ncols, 0.0, "allpairs: cmax");
+    rmax = da_vsmalloc(nrows, 0.0, "allpairs: rmax");
+    for(i=0; i < nrows; i++){
+        for(j=rowptr[i]; j < rowptr[i+1]; j++){
+            if(rowval[j] > cmax[rowind[j]])
+                cmax[rowind[j]] = rowval[j];
+            if(rowval[j] > rmax[i])
+                rmax[i] = rowval[j];
+        }
+    }
+
+    /* processing order: All-Pairs-2 processes vectors in decreasing max weight order */
+    order = da_imalloc(nrows, "allpairs: order");
+    if(ap2){
+        rorder = da_ivkvmalloc(nrows, "allpairs: rorder");
+        for(i=0; i < nrows; i++){
+            rorder[i].key = i;
+            rorder[i].val = rmax[i];
+        }
+        da_ivkvsortd(nrows, rorder);
+        for(i=0; i < nrows; i++)
+            order[i] = rorder[i].key;
+        da_free((void**)&rorder, LTERM);
+    } else {
+        for(i=0; i < nrows; i++)
+            order[i] = i;
+    }
+
+    /* find the unindexed prefix of each vector, along with its sum and max weight */
+    plen   = da_imalloc(nrows, "allpairs: plen");
+    psum   = da_vsmalloc(nrows, 0.0, "allpairs: psum");
+    pmax   = da_vsmalloc(nrows, 0.0, "allpairs: pmax");
+    colptr = da_pnmalloc(ncols+1, "allpairs: colptr");
+    for(nidx=0, i=0; i < nrows; i++){
+        for(b=0.0, j=rowptr[i]; j < rowptr[i+1]; j++){
+            b += (ap2 ? da_min(cmax[rowind[j]], rmax[i]) : cmax[rowind[j]]) * rowval[j];
+            if(b >= params->epsilon)
+                break;
+            psum[i] += rowval[j];
+            if(rowval[j] > pmax[i])
+                pmax[i] = rowval[j];
+        }
+        plen[i] = j - rowptr[i];
+        for( ; j < rowptr[i+1]; j++)
+            colptr[rowind[j]]++;
+    }
+    CSRMAKE(i, ncols, colptr);
+    nidx = colptr[ncols];
+
+    /* inverted lists are filled incrementally, in processing order */
+    colind   = da_imalloc(nidx, "allpairs: colind");
+    colval   = da_vmalloc(nidx, "allpairs: colval");
+    colstart = da_pmalloc(ncols, "allpairs: colstart");
+    colend   = da_pmalloc(ncols, "allpairs: colend");
+    for(i=0; i < ncols; i++)
+        colstart[i] = colend[i] = colptr[i];
+    timer_stop(params->timer_7); /* indexing time */
+
+    if(params->verbosity > 0)
+        printf("Indexed %zu of " PRNT_PTRTYPE " nnz (%.2f%%).\n", nidx, rowptr[nrows],
+                rowptr[nrows] > 0 ? 100.0 * nidx / rowptr[nrows] : 0.0);
+
+    /* allocate memory for the search */
+    timer_start(params->timer_5); /* memory allocation time */
+    cand   = da_ivkvmalloc(nrows, "allpairs: cand");
+    marker = da_ismalloc(nrows, -1, "allpairs: marker");
+    qvec   = da_vsmalloc(ncols, 0.0, "allpairs: qvec");
+    knng   = da_knnheap_Create(nrows, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nrows, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    /* execute search */
+    for(i=0; i < nrows; i++){
+        rid = order[i];
+
+        ap_findMatches(docs, rid, ap2, params->epsilon, cmax, rmax, plen, psum, pmax,
+                colstart, colend, colind, colval, qvec, cand, marker, knng, &ncands, &nverif);
+
+        /* index the suffix of the vector */
+        for(j=rowptr[rid]+plen[rid]; j < rowptr[rid+1]; j++){
+            k = rowind[j];
+            colind[colend[k]]   = rid;
+            colval[colend[k]++] = rowval[j];
+        }
+
+        /* update progress indicator */
+        if ( params->verbosity > 0 && i % progressInd == 0 ){
+            da_progress_advance_steps(pct, 10);
+        }
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+    neighbors = da_knnheap_ToCsr(knng);
+    nsims = neighbors->rowptr[nrows];
+    timer_stop(params->timer_3); // find neighbors time
+
+    printf("Number of candidates: %zu\n", ncands);
+    printf("Number of computed similarities: %zu\n", nverif);
+    printf("Number of neighbors: %zu\n", nsims);
+
+    /* write ouptut */
+    if(params->oFile){
+        da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
+        printf("Wrote output to %s\n", params->oFile);
+    }
+
+    /* free memory */
+    da_csr_Free(&neighbors);
+    da_knnheap_Free(&knng);
+    da_free((void**)&cmax, &rmax, &order, &plen, &psum, &pmax, &colptr, &colind, &colval,
+            &colstart, &colend, &cand, &marker, &qvec, LTERM);
+}
+
+
+/**
+ * Find the neighbors of a vector among the vectors indexed so far.
+ * \param docs The pre-processed CSR matrix we're searching in
+ * \param rid Row we're looking for neighbors for
+ * \param ap2 Whether All-Pairs-2 pruning should be applied
+ * \param eps Minimum similarity between query and neighbors
+ * \param cmax Max weight of each feature in the collection
+ * \param rmax Max weight of each vector
+ * \param plen Length of the unindexed prefix of each vector
+ * \param psum Sum of the weights in the unindexed prefix of each vector
+ * \param pmax Max weight in the unindexed prefix of each vector
+ * \param colstart Start of the active part of each inverted list
+ * \param colend End of each inverted list
+ * \param colind Row ids in the inverted lists
+ * \param colval Values in the inverted lists
+ * \param qvec Dense array of length docs->ncols of all 0 values, used to scatter the query
+ * \param cand Key-value array of length docs->nrows to accumulate candidate similarities
+ * \param marker Marker array of length docs->nrows, all -1 values, to mark candidates
+ * \param knng Top-k neighbor heaps for all rows
+ * \param ncands Reference to counter of candidates
+ * \param nverif Reference to counter of fully computed similarities
+ */
+void ap_findMatches(da_csr_t *docs, idx_t rid, char ap2, float eps, val_t *cmax, val_t *rmax,
+        idx_t *plen, val_t *psum, val_t *pmax, ptr_t *colstart, ptr_t *colend, idx_t *colind,
+        val_t *colval, val_t *qvec, da_ivkv_t *cand, idx_t *marker, da_knnheap_t *knng,
+        size_t *ncands, size_t *nverif)
+{
+    ssize_t i, ii, j, k, y, qsz, ncand;
+    ptr_t *rowptr;
+    idx_t *rowind, *qind;
+    val_t *rowval, *qval, w;
+    double remscore, minsize, s;
+
+    rowptr = docs->rowptr;
+    rowind = docs->rowind;
+    rowval = docs->rowval;
+    qsz    = rowptr[rid+1] - rowptr[rid]; /* number of values in query row */
+    qind   = rowind + rowptr[rid];        /* where indices for the query row start */
+    qval   = rowval + rowptr[rid];        /* where values for the query row start */
+
+    if(qsz == 0)
+        return;
+
+    /* scatter the query and find its remscore and the minimum size of its candidates */
+    for(remscore=0.0, ii=0; ii < qsz; ii++){
+        qvec[qind[ii]] = qval[ii];
+        remscore += qval[ii] * cmax[qind[ii]];
+    }
+    minsize = (ap2 ? eps / rmax[rid] : 0.0);
+
+    /* generate candidates - query features are processed in reverse indexing order */
+    for(ncand=0, ii=qsz-1; ii >= 0; ii--){
+        i = qind[ii];
+        w = qval[ii];
+        if(ap2){
+            /* vectors in the front of the list are too small for this and all future queries */
+            while(colstart[i] < colend[i] &&
+                    rowptr[colind[colstart[i]]+1] - rowptr[colind[colstart[i]]] < minsize)
+                colstart[i]++;
+        }
+        for(j=colstart[i]; j < colend[i]; j++){
+            y = colind[j];
+            if(marker[y] == -1){
+                if(ap2 && (remscore < eps || rowptr[y+1] - rowptr[y] < minsize))
+                    continue;
+                cand[ncand].key = y;
+                cand[ncand].val = 0.0;
+                marker[y] = ncand++;
+            }
+            cand[marker[y]].val += w * colval[j];
+        }
+        remscore -= w * cmax[i];
+    }
+    *ncands += ncand;
+
+    /* verify candidates against their unindexed prefix */
+    for(k=0; k < ncand; k++){
+        y = cand[k].key;
+        marker[y] = -1;
+        if(ap2){
+            if(cand[k].val + rmax[rid] * psum[y] < eps)
+                continue;
+            if(cand[k].val + da_min(qsz, plen[y]) * rmax[rid] * pmax[y] < eps)
+                continue;
+        }
+        (*nverif)++;
+        for(s=cand[k].val, j=rowptr[y]; j < rowptr[y]+plen[y]; j++)
+            s += qvec[rowind[j]] * rowval[j];
+        if(s >= eps){
+            da_knnheap_Insert(knng, rid, y, s);
+            da_knnheap_Insert(knng, y, rid, s);
+        }
+    }
+
+    /* clear the query */
+    for(ii=0; ii < qsz; ii++)
+        qvec[qind[ii]] = 0.0;
+}
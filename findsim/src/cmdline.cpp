@@ -17,9 +17,23 @@ static struct da_option long_options[] = {
     {"e",                 1,      0,      CMD_EPSILON},
     {"eps",               1,      0,      CMD_EPSILON},
     {"epsion",            1,      0,      CMD_EPSILON},
+    {"nthreads",          1,      0,      CMD_NTHREADS},
     {"verb",              1,      0,      CMD_VERBOSITY},
     {"version",           0,      0,      CMD_VERSION},
     {"v",                 1,      0,      CMD_VERIFY},
+    {"cache",             1,      0,      CMD_CACHE},
+    {"cidx",              0,      0,      CMD_CIDX},
+    {"qbits",             1,      0,      CMD_QBITS},
+    {"memlimit",          1,      0,      CMD_MEMLIMIT},
+    {"nshards",           1,      0,      CMD_NSHARDS},
+    {"queryrange",        1,      0,      CMD_QUERYRANGE},
+    {"indexrange",        1,      0,      CMD_INDEXRANGE},
+    {"query",             1,      0,      CMD_QUERY},
+    {"graph",             1,      0,      CMD_GRAPH},
+    {"append",            1,      0,      CMD_APPEND},
+    {"idfrows",           1,      0,      CMD_IDFROWS},
+    {"rebuild",           1,      0,      CMD_REBUILD},
+    {"socket",            1,      0,      CMD_SOCKET},
     {"stats",             0,      0,      CMD_STATS},
     {"fldelta",           1,      0,      CMD_FLDELTA},
     {"fd",                1,      0,      CMD_FLDELTA},
@@ -55,7 +69,14 @@ PROGRAM_NAME " - Compute the exact Cosine K-Nearest Neighbor graph",
 " ",
 "  -mode:",
 "    ij       Build graph using IdxJoin (full sparse dot-products).",
+"    ijk      Build graph using IdxJoin with a running k-th best similarity threshold.",
+"    ijs      Build graph using symmetric IdxJoin (each pair computed once).",
+"    ijt      Build graph using cache-blocked (tiled) IdxJoin.",
+"    ijb      Build graph using batched multi-query (SpMM-style) IdxJoin.",
 "	 iidx	  Build graph using basic Inverted Index based approach. Default ",
+"    ap1      Build graph using All-Pairs-1 (prefix filtering with max-weight bounds).",
+"    ap2      Build graph using All-Pairs-2 (ap1 with size filter and remscore pruning).",
+"    l2ap     Build graph using L2AP (All-Pairs with prefix L2-norm bounds).",
 " ",
 "  (utility modes):",
 "    info     Get information about the sparse matrix in input-file (output-file ignored).",
@@ -65,6 +86,15 @@ PROGRAM_NAME " - Compute the exact Cosine K-Nearest Neighbor graph",
 "             specified format.",
 "    recall   Compute recall of a knng solution given true values. ",
 "             Usage: findsim recall <true_results> <test_results> ",
+"    shard    Pre-process the matrix in input-file, save it to output-file (binr by",
+"             default, or binc), and split its rows into -nshards ranges, saved to",
+"             <output-file>.shards. Tiles are computed with ij -queryrange -indexrange.",
+"    merge    Merge the partial neighbor graphs listed in input-file (one file per line)",
+"             into the top-k neighbors of each row, saved to output-file.",
+"    update   Add the rows in the -append file to the neighbor graph (-graph) of the rows",
+"             in input-file, saved to output-file. Appended rows follow the input rows.",
+"    serve    Index the matrix in input-file once and answer k-NN queries sent to the",
+"             Unix domain socket -socket until interrupted. See README for the protocol.",
 " ",
 "  -k=int",
 "     Number of neighbors to return for each row in the Min-eps K-Nearest Neighbor Graph.",
@@ -74,12 +104,82 @@ PROGRAM_NAME " - Compute the exact Cosine K-Nearest Neighbor graph",
 "     Minimum similarity for neighbors.",
 "     Default value is 0.5. Must be non-negative.",
 " ",
+"  -nthreads=int",
+"     Number of threads to use in the similarity search (ij* modes only) and when",
+"     reading CSR/CLUTO input files and pre-processing the input matrix.",
+"     Default value is 1.",
+" ",
 "  -v=string",
 "     Verification file containing a true Min-eps K-Nearest Neighbor Graph. Must be in CSR format.",
 "     Default value is NULL (no verification).",
 " ",
+"  -cache=string",
+"     Directory in which to cache preprocessed input matrices (search modes only).",
+"     The cache is keyed by the input file contents and read options, and is",
+"     memory-mapped when found, skipping reading and preprocessing the input.",
+"     Default value is NULL (no caching).",
+" ",
+"  -cidx",
+"     Compress the row ids of the column index (ij mode only). Ids are stored as",
+"     bit-packed gaps and decoded while accumulating similarities, reducing the",
+"     memory footprint and bandwidth of the index.",
+" ",
+"  -qbits=int",
+"     Quantize the values of the column index to 8 or 16 bits (ij mode only).",
+"     Quantized values bound the similarity of each candidate; candidates that may",
+"     be neighbors are re-scored exactly, so results are not affected.",
+"     Default value is 0 (no quantization).",
+" ",
+"  -memlimit=int",
+"     Memory budget in MB for an out-of-core search (ij mode only). Rows are split into",
+"     blocks that are indexed and searched one pair at a time from temporary files in",
+"     $TMPDIR (or /tmp). Only the top-k neighbors of all rows must fit in the budget.",
+"     Default value is 0 (in-memory search).",
+" ",
+"  -nshards=int",
+"     Number of row shards (shard mode only).",
+"     Default value is 2.",
+" ",
+"  -queryrange=start:end",
+"     Only search for the neighbors of rows start to end-1 (ij mode only). The input must",
+"     have been pre-processed by the shard mode (binr or binc). Rows outside the range have no",
+"     neighbors in the output. Default value is all rows.",
+" ",
+"  -indexrange=start:end",
+"     Only index rows start to end-1, i.e., only find neighbors among them (ij mode only).",
+"     The input must have been pre-processed by the shard mode.",
+"     Default value is all rows.",
+" ",
+"  -query=string",
+"     Query matrix file (ij mode only). Instead of the neighbors of each input row",
+"     among the input rows, find the neighbors of each query row among the input rows.",
+"     Queries are scaled by the IDF of the input. Default value is NULL (self-join).",
+" ",
+"  -graph=string",
+"     Neighbor graph of the rows in input-file (update mode only). It must have been",
+"     computed with the same -k and -eps, and the same IDF rows.",
+" ",
+"  -append=string",
+"     Matrix file with the rows to add to the graph (update mode only).",
+" ",
+"  -idfrows=int",
+"     Number of leading rows of input-file the IDF is computed over (update mode only).",
+"     The IDF is frozen: appended rows are scaled by it, and graph similarities stay valid.",
+"     Default value is 0 (all input rows).",
+" ",
+"  -rebuild=float",
+"     Fraction of rows added since the IDF rows beyond which the update mode rebuilds",
+"     the graph with the IDF of all rows, instead of patching it. Default value is 0.05.",
+" ",
+"  -socket=string",
+"     Path of the Unix domain socket to listen on (serve mode only). Queries are",
+"     answered concurrently by -nthreads workers.",
+" ",
 "  -fmtRead=string",
-"     What format is the dataset stored in: clu, csr, ijv.",
+"     What format is the dataset stored in: clu, csr, ijv, binr, binc.",
+"     binr and binc are binary formats that are memory-mapped when read. binc also",
+"     stores the column index. nbr and nbr16 are compact binary neighbor graph formats",
+"     with fp32 and fp16 values, respectively.",
 "     See README for format definitions.",
 "     Default value is 0 (detect from extension).",
 " ",
@@ -92,7 +192,7 @@ PROGRAM_NAME " - Compute the exact Cosine K-Nearest Neighbor graph",
 " ",
 "  -fmtWrite=string",
 "     What format should the output file be written in. See -fmtRead for values.",
-"     Default value is ijv.",
+"     Default value is ijv for io mode, and csr for the neighbor graph in search modes.",
 " ",
 "  -writeZidx",
 "     Column ids start with 0 instead of 1.",
@@ -125,12 +225,29 @@ PROGRAM_NAME " - Compute the exact Cosine K-Nearest Neighbor graph",
 const da_StringMap_t mode_options[] = {
   {"ij",                MODE_IDXJOIN},
   {"idxjoin",           MODE_IDXJOIN},
+  {"ijk",               MODE_IDXJOINK},
+  {"idxjoinknn",        MODE_IDXJOINK},
+  {"ijs",               MODE_IDXJOINSYM},
+  {"idxjoinsym",        MODE_IDXJOINSYM},
+  {"ijt",               MODE_IDXJOINTILE},
+  {"idxjointiled",      MODE_IDXJOINTILE},
+  {"ijb",               MODE_IDXJOINBATCH},
+  {"idxjoinbatch",      MODE_IDXJOINBATCH},
 
   /** Add new modes here if desired. Mode constants are defined in defs.h */
   {"iidx",           	MODE_INVERTED},
   {"invertedidx",       MODE_INVERTED},
+  {"ap1",               MODE_ALLPAIRS1},
+  {"allpairs1",         MODE_ALLPAIRS1},
+  {"ap2",               MODE_ALLPAIRS2},
+  {"allpairs2",         MODE_ALLPAIRS2},
+  {"l2ap",              MODE_L2AP},
 
   {"recall",            MODE_RECALL},
+  {"shard",             MODE_SHARD},
+  {"merge",             MODE_MERGE},
+  {"update",            MODE_UPDATE},
+  {"serve",             MODE_SERVE},
   {"eq",                MODE_TESTEQUAL},
   {"testeq",            MODE_TESTEQUAL},
   {"io",                MODE_IO},
@@ -138,14 +255,6 @@ const da_StringMap_t mode_options[] = {
   {NULL,                 0}
 };
 
-const da_StringMap_t fmt_options[] = {
-  {"clu",               DA_FMT_CLUTO},
-  {"csr",               DA_FMT_CSR},
-  {"met",               DA_FMT_METIS},
-  {"ijv",               DA_FMT_IJV},
-  {NULL,                 0}
-};
-
 
 
 /*************************************************************************/
@@ -167,6 +276,7 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
 	params->mode         = MODE_INVERTED;
     params->k            = 10;
 	params->epsilon      = 0.5;
+	params->nthreads     = 1;
 
 	params->fldelta      = 1e-4;
 
@@ -179,9 +289,28 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
 	params->writeVals    = 1;
 	params->writeNum     = 1;
     params->vFile        = NULL;
+    params->qFile        = NULL;
+    params->gFile        = NULL;
+    params->aFile        = NULL;
+    params->idfrows      = 0;
+    params->rebuild      = 0.05;
+    params->sFile        = NULL;
+    params->cacheDir     = NULL;
+    params->cacheFile    = NULL;
+    params->preprocessed = 0;
+    params->cidx         = 0;
+    params->qbits        = 0;
+    params->memlimit     = 0;
+    params->nshards      = 2;
+    params->ranged       = 0;
+    params->qrange[0]    = params->irange[0] = 0;
+    params->qrange[1]    = params->irange[1] = -1;
 
 	params->filename     = da_cmalloc(1024, "cmdline_parse: filename");
     params->docs         = NULL;
+    params->queries      = NULL;
+    params->colmap       = NULL;
+    params->cscale       = NULL;
 	params->neighbors    = NULL;
 
 	/* timers */
@@ -220,6 +349,19 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
             }
             break;
 
+        case CMD_NTHREADS:
+            if (da_optarg) {
+                if ((params->nthreads = atoi(da_optarg)) < 1)
+                    da_errexit("Invalid -nthreads. Must be greater than 0.\n");
+#ifndef _OPENMP
+                if (params->nthreads > 1) {
+                    printf("Warning: " PROGRAM_NAME " was compiled without OpenMP support. Ignoring -nthreads.\n");
+                    params->nthreads = 1;
+                }
+#endif
+            }
+            break;
+
 
 		case CMD_VERBOSITY:
 			if (da_optarg) {
@@ -231,7 +373,7 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
 		case CMD_FMT_READ:
 			if (da_optarg) {
 				if ((params->fmtRead = da_getStringID(fmt_options, da_optarg)) == -1)
-					da_errexit("Invalid -fmtRead. Options are: clu, csr, met, binr, and binc.\n");
+					da_errexit("Invalid -fmtRead. Options are: clu, csr, met, ijv, binr, binc, nbr, and nbr16.\n");
 			}
 			break;
 
@@ -250,7 +392,7 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
 		case CMD_FMT_WRITE:
 			if (da_optarg) {
 				if ((params->fmtWrite = da_getStringID(fmt_options, da_optarg)) == -1)
-					da_errexit("Invalid -fmtWrite. Options are: clu, csr, met, binr, and binc.\n");
+					da_errexit("Invalid -fmtWrite. Options are: clu, csr, met, ijv, binr, binc, nbr, and nbr16.\n");
 			}
 			break;
 
@@ -288,6 +430,76 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
                 da_errexit("The -v parameter requires a valid verification file. %s is not a file.\n", params->vFile);
             break;
 
+        case CMD_QUERY:
+            params->qFile = da_strdup(da_optarg);
+            if(!da_fexists(params->qFile))
+                da_errexit("The -query parameter requires a valid query file. %s is not a file.\n", params->qFile);
+            break;
+
+        case CMD_CACHE:
+            params->cacheDir = da_strdup(da_optarg);
+            if(!da_dexists(params->cacheDir) || access(params->cacheDir, W_OK) != 0)
+                da_errexit("The -cache parameter requires a writable directory. %s is not one.\n", params->cacheDir);
+            break;
+
+        case CMD_CIDX:
+            params->cidx = 1;
+            break;
+
+        case CMD_QBITS:
+            params->qbits = atoi(da_optarg);
+            if(params->qbits != 0 && params->qbits != 8 && params->qbits != 16)
+                da_errexit("The -qbits parameter must be 0, 8, or 16.\n");
+            break;
+
+        case CMD_GRAPH:
+        case CMD_APPEND:
+            {
+                char **file = (c == CMD_GRAPH ? &params->gFile : &params->aFile);
+                *file = da_strdup(da_optarg);
+                if(!da_fexists(*file))
+                    da_errexit("The -%s parameter requires a valid file. %s is not a file.\n",
+                            (c == CMD_GRAPH ? "graph" : "append"), *file);
+            }
+            break;
+
+        case CMD_SOCKET:
+            params->sFile = da_strdup(da_optarg);
+            break;
+
+        case CMD_IDFROWS:
+            if ((params->idfrows = atoi(da_optarg)) < 0)
+                da_errexit("Invalid -idfrows. Must be non-negative.\n");
+            break;
+
+        case CMD_REBUILD:
+            if ((params->rebuild = atof(da_optarg)) < 0)
+                da_errexit("Invalid -rebuild. Must be non-negative.\n");
+            break;
+
+        case CMD_MEMLIMIT:
+            if(atol(da_optarg) < 0)
+                da_errexit("Invalid -memlimit. Must be non-negative.\n");
+            params->memlimit = (size_t)atol(da_optarg) << 20;
+            break;
+
+        case CMD_NSHARDS:
+            if ((params->nshards = atoi(da_optarg)) < 1)
+                da_errexit("Invalid -nshards. Must be greater than 0.\n");
+            break;
+
+        case CMD_QUERYRANGE:
+        case CMD_INDEXRANGE:
+            {
+                idx_t *range = (c == CMD_QUERYRANGE ? params->qrange : params->irange);
+                if (sscanf(da_optarg, PRNT_IDXTYPE ":" PRNT_IDXTYPE, &range[0], &range[1]) != 2 ||
+                        range[0] < 0 || range[1] < range[0])
+                    da_errexit("Invalid -%s. Must be start:end, with 0 <= start <= end.\n",
+                            (c == CMD_QUERYRANGE ? "queryrange" : "indexrange"));
+                params->ranged = 1;
+            }
+            break;
+
 		case CMD_HELP:
 			for (i=0; strlen(helpstr[i]) > 0; i++)
 				printf("%s\n", helpstr[i]);
@@ -318,9 +530,35 @@ void cmdline_parse(params_t *params, int argc, char *argv[])
         }
 	}
 
+	if(params->qFile && (params->mode != MODE_IDXJOIN || params->ranged || params->memlimit))
+		da_errexit("The -query parameter is only supported by the in-memory ij mode.\n");
+
+	if(params->memlimit && params->mode != MODE_IDXJOIN)
+		da_errexit("The -memlimit parameter is only supported by the ij mode.\n");
+
+	if(params->ranged && (params->mode != MODE_IDXJOIN || params->memlimit))
+		da_errexit("The -queryrange and -indexrange parameters are only supported by the in-memory ij mode.\n");
+
+	if(params->cidx && (params->mode != MODE_IDXJOIN || params->ranged || params->memlimit || params->qFile))
+		da_errexit("The -cidx parameter is only supported by the in-memory ij self-join.\n");
+
+	if(params->qbits && (params->mode != MODE_IDXJOIN || params->ranged || params->memlimit || params->qFile))
+		da_errexit("The -qbits parameter is only supported by the in-memory ij self-join.\n");
+
+	if(params->mode == MODE_UPDATE && (!params->gFile || !params->aFile || !params->oFile))
+		da_errexit("The update mode requires the -graph and -append parameters and an output file.\n");
+
+	if(params->mode == MODE_SERVE && !params->sFile)
+		da_errexit("The serve mode requires the -socket parameter.\n");
+
 	if(!params->oFile && params->mode == MODE_TESTEQUAL)
         da_errexit("Output file required for mode %s!\n", da_getStringKey(mode_options, params->mode));
 
+#ifdef _OPENMP
+	/* threads used by parallel regions that do not set num_threads, e.g., reading input */
+	omp_set_num_threads(params->nthreads);
+#endif
+
 
 	/* print the command line */
 	if(params->verbosity > 0){
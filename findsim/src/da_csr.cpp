@@ -27,6 +27,63 @@ da_csr_t* da_csr_Create(void)
 }
 
 
+/*************************************************************************/
+/*! Frees a variable sized list of the matrix's arrays and sets them to NULL.
+    Arrays that point into a memory-mapped binary file are only set to NULL.
+    Last item in the list must be LTERM.
+    \param mat is the matrix that owns the arrays,
+    \param ptr1 is the first array to be freed,
+    \param ... are additional arrays to be freed.
+ */
+/*************************************************************************/
+void da_csr_FreeArrays(const da_csr_t* const mat, void** ptr1, ...)
+{
+	va_list plist;
+	void **ptr;
+
+	va_start(plist, ptr1);
+	for (ptr=ptr1; ptr != LTERM; ptr=va_arg(plist, void **)) {
+		if (*ptr != NULL && !(mat->mapbase && (char *)*ptr >= mat->mapbase &&
+				(char *)*ptr < mat->mapbase + mat->mapsize))
+			free(*ptr);
+		*ptr = NULL;
+	}
+	va_end(plist);
+}
+
+
+/*************************************************************************/
+/*! Copies the arrays of a matrix that point into a memory-mapped binary file
+    into allocated memory and releases the mapping, such that they can be
+    reallocated.
+    \param mat is the matrix to be detached from its file.
+ */
+/*************************************************************************/
+static void da_csr_Detach(da_csr_t* const mat)
+{
+	char *base;
+
+	if (!mat->mapbase)
+		return;
+	base = mat->mapbase;
+
+#define DA_DETACH(arr, n, PRFX) \
+	if (mat->arr && (char *)mat->arr >= base && (char *)mat->arr < base + mat->mapsize) \
+		mat->arr = PRFX ## copy(n, mat->arr, PRFX ## malloc(n, "da_csr_Detach: " #arr));
+	DA_DETACH(rowptr, mat->nrows+1, da_p)
+	DA_DETACH(rowind, mat->rowptr[mat->nrows], da_i)
+	DA_DETACH(rowval, mat->rowptr[mat->nrows], da_v)
+	DA_DETACH(colptr, mat->ncols+1, da_p)
+	DA_DETACH(colind, mat->colptr[mat->ncols], da_i)
+	DA_DETACH(colval, mat->colptr[mat->ncols], da_v)
+#undef DA_DETACH
+
+	munmap(base, mat->mapsize);
+	mat->mapbase = NULL;
+	mat->mapsize = 0;
+}
+
+
 da_csr_t* da_csr_Alloc(
         da_csr_t* const mat,
         const idx_t nrows,
@@ -39,9 +96,7 @@ da_csr_t* da_csr_Alloc(
     mat->ncols = ncols;
 
     if((what & DA_ROW)){
-        if (mat->rowptr) da_free((void **)&mat->rowptr, LTERM);
-        if (mat->rowind) da_free((void **)&mat->rowind, LTERM);
-        if (mat->rowval) da_free((void **)&mat->rowval, LTERM);
+        da_csr_FreeArrays(mat, (void **)&mat->rowptr, &mat->rowind, &mat->rowval, LTERM);
 
         mat->rowptr = da_pnmalloc_a(nrows+1, "da_csr_CreateIndex: rptr");
         mat->rowind = da_imalloc_a(nnz, "da_csr_CreateIndex: rind");
@@ -49,9 +104,7 @@ da_csr_t* da_csr_Alloc(
     }
 
     if((what & DA_COL)){
-        if (mat->colptr) da_free((void **)&mat->colptr, LTERM);
-        if (mat->colind) da_free((void **)&mat->colind, LTERM);
-        if (mat->colval) da_free((void **)&mat->colval, LTERM);
+        da_csr_FreeArrays(mat, (void **)&mat->colptr, &mat->colind, &mat->colval, LTERM);
 
         mat->colptr = da_pnmalloc_a(ncols+1, "da_csr_CreateIndex: rptr");
         mat->colind = da_imalloc_a(nnz, "da_csr_CreateIndex: rind");
@@ -124,11 +177,11 @@ void da_csr_FreeBase(da_csr_t* const mat, const char type)
 {
 	if(type & DA_ROW)
 		//drop the row index
-		da_free((void **)&mat->rowptr, &mat->rowind, &mat->rowval, LTERM);
+		da_csr_FreeArrays(mat, (void **)&mat->rowptr, &mat->rowind, &mat->rowval, LTERM);
 
 	if(type & DA_COL)
 		//drop the column index
-		da_free((void **)&mat->colptr, &mat->colind, &mat->colval, LTERM);
+		da_csr_FreeArrays(mat, (void **)&mat->colptr, &mat->colind, &mat->colval, LTERM);
 
 }
 
@@ -163,10 +216,14 @@ void da_csr_LoadBases(da_csr_t* const csr)
 /*************************************************************************/
 void da_csr_FreeContents(da_csr_t* const mat)
 {
-	da_free((void *)&mat->rowptr, &mat->rowind, &mat->rowval,
+	da_csr_FreeArrays(mat, (void **)&mat->rowptr, &mat->rowind, &mat->rowval,
 			&mat->colptr, &mat->colind, &mat->colval,
 			&mat->rnorms, &mat->cnorms,
 			LTERM);
+	if (mat->mapbase)
+		munmap(mat->mapbase, mat->mapsize);
+	mat->mapbase = NULL;
+	mat->mapsize = 0;
 }
 
 
@@ -217,6 +274,41 @@ da_csr_t* da_csr_Copy(const da_csr_t* const mat)
 }
 
 
+/*************************************************************************/
+/*! Returns a matrix with the rows of a followed by the rows of b. Only the
+    row structure is created.
+    \param a is the matrix whose rows come first,
+    \param b is the matrix whose rows are appended,
+    \returns the newly created matrix, with as many columns as the wider input.
+ */
+/**************************************************************************/
+da_csr_t* da_csr_AppendRows(const da_csr_t* const a, const da_csr_t* const b)
+{
+	ssize_t i;
+	ptr_t annz, bnnz;
+	da_csr_t *nmat;
+
+	annz = a->rowptr[a->nrows];
+	bnnz = b->rowptr[b->nrows];
+
+	nmat = da_csr_Create();
+	da_csr_Alloc(nmat, a->nrows + b->nrows, da_max(a->ncols, b->ncols), annz + bnnz, DA_ROW,
+			a->rowval && b->rowval);
+
+	da_pcopy(a->nrows+1, a->rowptr, nmat->rowptr);
+	for (i=1; i<=b->nrows; ++i)
+		nmat->rowptr[a->nrows+i] = annz + b->rowptr[i];
+	da_icopy(annz, a->rowind, nmat->rowind);
+	da_icopy(bnnz, b->rowind, nmat->rowind + annz);
+	if (nmat->rowval) {
+		da_vcopy(annz, a->rowval, nmat->rowval);
+		da_vcopy(bnnz, b->rowval, nmat->rowval + annz);
+	}
+
+	return nmat;
+}
+
+
 da_csr_t* da_csr_Copy_a(
         const da_csr_t* const mat)
 {
@@ -263,6 +355,7 @@ void da_csr_Grow_a(
         da_csr_t* const mat,
         const ptr_t newNnz)
 {
+    da_csr_Detach(mat);
     if(mat->rowind){
         mat->rowind = da_irealloc_a(mat->rowind, newNnz, "da_csr_matrixNNzRealloc: mat->rowind");
         if(mat->rowind == NULL)
@@ -289,16 +382,1222 @@ void da_csr_Grow_a(
 
 
 
+/* exact powers of ten used by the fast float parser */
+static const double da_p10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+#define DA_ISSPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\v' || (c) == '\f')
+#define DA_ISDIGIT(c) ((c) >= '0' && (c) <= '9')
+
+
+/*************************************************************************/
+/*! Copies the token starting at p (up to whitespace or e) into a buffer,
+    such that it can be safely parsed with the C library functions.
+ */
+/*************************************************************************/
+static inline void da_copytoken(const char* p, const char* const e, char* const buf)
+{
+    size_t i;
+    for (i=0; i<63 && p+i<e && !DA_ISSPACE(p[i]) && p[i] != '\n'; i++)
+        buf[i] = p[i];
+    buf[i] = '\0';
+}
+
+
+/*************************************************************************/
+/*! Parses an integer with the semantics of strtol(p, &tail, 0), from text
+    that ends at or before e.
+    \returns the end of the parsed text, or p if no integer could be parsed.
+ */
+/*************************************************************************/
+static inline const char* da_parseint(const char* p, const char* const e, long* const r)
+{
+    const char *q = p;
+    char neg = 0, buf[64], *tail;
+    long v;
+
+    if (q < e && (*q == '-' || *q == '+'))
+        neg = (*q++ == '-');
+    /* octal/hex/overlong numbers are left to the C library */
+    if (q+1 < e && q[0] == '0' && (DA_ISDIGIT(q[1]) || q[1] == 'x' || q[1] == 'X'))
+        goto fallback;
+    for (v=0; q < e && DA_ISDIGIT(*q); q++) {
+        if (q - p > 17)
+            goto fallback;
+        v = v*10 + (*q - '0');
+    }
+    if (q == p || !DA_ISDIGIT(q[-1]))
+        return p;
+    *r = (neg ? -v : v);
+    return q;
+
+  fallback:
+    da_copytoken(p, e, buf);
+    *r = strtol(buf, &tail, 0);
+    return p + (tail - buf);
+}
+
+
+/*************************************************************************/
+/*! Parses a float with the semantics of strtof(p, &tail), from text that
+    ends at or before e. Decimal numbers with up to 19 significant digits
+    and small exponents are converted with a single correctly rounded
+    double operation; anything else (including results that land exactly
+    half-way between two floats) is left to the C library.
+    \returns the end of the parsed text, or p if no float could be parsed.
+ */
+/*************************************************************************/
+static inline const char* da_parsefloat(const char* p, const char* const e, float* const r)
+{
+    const char *q = p, *d;
+    char neg = 0, eneg, buf[64], *tail;
+    int nd, e10, x;
+    uint64_t m, bits;
+    double v;
+    float f;
+
+    if (q < e && (*q == '-' || *q == '+'))
+        neg = (*q++ == '-');
+    for (m=0, nd=0, d=q; q < e && DA_ISDIGIT(*q); q++, nd++)
+        m = m*10 + (*q - '0');
+    e10 = 0;
+    if (q < e && *q == '.') {
+        for (q++; q < e && DA_ISDIGIT(*q); q++, nd++, e10--)
+            m = m*10 + (*q - '0');
+    }
+    if (nd == 0)
+        goto fallback;  /* not a decimal number: inf, nan, hex, or no number */
+    if (q < e && (*q == 'e' || *q == 'E')) {
+        d = q + 1;
+        eneg = 0;
+        if (d < e && (*d == '-' || *d == '+'))
+            eneg = (*d++ == '-');
+        if (d < e && DA_ISDIGIT(*d)) {
+            for (x=0; d < e && DA_ISDIGIT(*d) && x < 10000; d++)
+                x = x*10 + (*d - '0');
+            if (d < e && DA_ISDIGIT(*d))
+                goto fallback;
+            e10 += (eneg ? -x : x);
+            q = d;
+        }
+    }
+    if (nd > 19 || m > (1ULL << 53) || e10 < -22 || e10 > 22)
+        goto fallback;
+    if (q < e && (*q == 'x' || *q == 'X' || *q == 'p' || *q == 'P'))
+        goto fallback;
+
+    v = (e10 < 0 ? (double)m / da_p10[-e10] : (double)m * da_p10[e10]);
+    if (v != 0.0 && (v < FLT_MIN || v > FLT_MAX))
+        goto fallback;
+    memcpy(&bits, &v, sizeof(bits));
+    if ((bits & 0x1FFFFFFFULL) == 0x10000000ULL)
+        goto fallback;  /* half-way between two floats - avoid double rounding */
+    f  = (float)v;
+    *r = (neg ? -f : f);
+    return q;
+
+  fallback:
+    da_copytoken(p, e, buf);
+    *r = strtof(buf, &tail);
+    return p + (tail - buf);
+}
+
+
+/**************************************************************************/
+/*! Reads a CSR or CLUTO text matrix. The file is memory-mapped and split at
+    line boundaries into one chunk per thread. Each thread parses its chunk
+    into private buffers in a single pass, after which the row pointers are
+    built with a prefix sum over the per-thread row and non-zero counts and
+    the buffers are copied into place in parallel. The resulting matrix is
+    identical to the one produced by the line-by-line reader.
+    \param filename is the file that stores the data.
+    \param format is either DA_FMT_CSR or DA_FMT_CLUTO.
+    \param readvals is 0, 1, or 2, as in da_csr_Read.
+    \param numbering is either 1 or 0, as in da_csr_Read.
+    \returns the matrix that was read.
+ */
+/**************************************************************************/
+static da_csr_t* da_csr_ReadText(const char* const filename,
+        const char format, char readvals, char numbering)
+{
+    ssize_t i, t, nthreads, hnrows, hncols, hnnz, nrows, nnz;
+    size_t size;
+    char trunc;
+    int fd;
+    struct stat st;
+    const char *data, *p, *e;
+    char line[256];
+    ptr_t **trlen, *tnrows, *tnnz, *tvnnz, *tbnd;
+    idx_t **tind, *tmaxcol;
+    val_t **tval;
+    char *terr;
+    ptr_t *terrnnz;
+    long *terrval;
+    da_csr_t *mat;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        da_errexit("Could not open file %s.\n", filename);
+    size = st.st_size;
+    data = NULL;
+    if (size > 0) {
+        data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            da_errexit("Could not map file %s.\n", filename);
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    p = data;
+    e = data + size;
+    hnrows = hncols = hnnz = 0;
+    if (format == DA_FMT_CLUTO) {
+        /* skip comments and read the header */
+        do {
+            if (p == e)
+                da_errexit( "Premature end of input file: %s\n", filename);
+            for (i=0; p < e && *p != '\n'; p++)
+                if (i < 255)
+                    line[i++] = *p;
+            line[i] = '\0';
+            if (p < e)
+                p++;
+        } while (line[0] == '%');
+        if (sscanf(line, "%zd %zd %zd", &hnrows, &hncols, &hnnz) != 3)
+            da_errexit( "Header line must contain 3 integers.\n");
+        readvals  = 1;
+        numbering = 1;
+    }
+    numbering = (numbering ? -1 : 0);
+
+    nthreads = 1;
+#ifdef _OPENMP
+    if (e - p > 1<<20)
+        nthreads = omp_get_max_threads();
+#endif
+
+    /* split the file into chunks at line boundaries */
+    tbnd = da_pmalloc(nthreads+1, "da_csr_ReadText: tbnd");
+    tbnd[0] = p - data;
+    tbnd[nthreads] = size;
+    for (t=1; t<nthreads; t++) {
+        tbnd[t] = da_max(tbnd[t-1], tbnd[0] + (ptr_t)((e - p) * t / nthreads));
+        while (tbnd[t] < (ptr_t)size && (tbnd[t] == 0 || data[tbnd[t]-1] != '\n'))
+            tbnd[t]++;
+    }
+
+    trlen   = (ptr_t **)da_nmalloc(nthreads * sizeof(ptr_t *), "da_csr_ReadText: trlen");
+    tind    = (idx_t **)da_nmalloc(nthreads * sizeof(idx_t *), "da_csr_ReadText: tind");
+    tval    = (val_t **)da_nmalloc(nthreads * sizeof(val_t *), "da_csr_ReadText: tval");
+    tnrows  = da_pnmalloc(nthreads+1, "da_csr_ReadText: tnrows");
+    tnnz    = da_pnmalloc(nthreads+1, "da_csr_ReadText: tnnz");
+    tvnnz   = da_pnmalloc(nthreads+1, "da_csr_ReadText: tvnnz");
+    tmaxcol = da_inmalloc(nthreads, "da_csr_ReadText: tmaxcol");
+    terr    = da_cnmalloc(nthreads, "da_csr_ReadText: terr");
+    terrnnz = da_pnmalloc(nthreads, "da_csr_ReadText: terrnnz");
+    terrval = (long *)da_nmalloc(nthreads * sizeof(long), "da_csr_ReadText: terrval");
+
+    #pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+    for (t=0; t<nthreads; t++) {
+        const char *q, *qe, *le, *n;
+        size_t rsz, nsz;
+        ptr_t nr, nz, *rlen;
+        idx_t *ind, maxcol;
+        val_t *val;
+        long len;
+        float fval;
+
+        q    = data + tbnd[t];
+        qe   = data + tbnd[t+1];
+        rsz  = 1024;
+        nsz  = da_max(1024, (qe - q) / (readvals == 1 ? 16 : 8));
+        rlen = da_pmalloc(rsz, "da_csr_ReadText: rlen");
+        ind  = da_imalloc(nsz, "da_csr_ReadText: ind");
+        val  = (readvals == 1 ? da_vmalloc(nsz, "da_csr_ReadText: val") : NULL);
+
+        for (maxcol=0, nr=0, nz=0; q < qe; q = le + 1) {
+            le = (const char *)memchr(q, '\n', qe - q);
+            if (le == NULL)
+                le = qe;
+            if (*q == '%')
+                continue;
+            if (le == qe && format != DA_FMT_CLUTO) {
+                /* the line reader ignores a final line that does not end in a newline */
+                for (n=q; n < le && (DA_ISSPACE(*n)); n++) ;
+                if (n < le) {
+                    terr[t]    = 3;
+                    break;
+                }
+                continue;
+            }
+
+            if (nr == (ptr_t)rsz) {
+                rsz *= 2;
+                rlen = da_prealloc(rlen, rsz, "da_csr_ReadText: rlen");
+            }
+            rlen[nr] = nz;
+
+            while (1) {
+                while (q < le && DA_ISSPACE(*q))
+                    q++;
+                if (q == le || (n = da_parseint(q, le, &len)) == q)
+                    break;
+                q = n;
+
+                if (nz == (ptr_t)nsz) {
+                    nsz *= 2;
+                    ind = da_irealloc(ind, nsz, "da_csr_ReadText: ind");
+                    if (val)
+                        val = da_vrealloc(val, nsz, "da_csr_ReadText: val");
+                }
+                if ((ind[nz] = len + numbering) < 0) {
+                    terr[t]    = 1;
+                    terrval[t] = len;
+                    goto chunkdone;
+                }
+                maxcol = da_max(ind[nz], maxcol);
+
+                if (readvals == 1) {
+                    while (q < le && DA_ISSPACE(*q))
+                        q++;
+                    if (q == le || (n = da_parsefloat(q, le, &fval)) == q) {
+                        terr[t]    = 2;
+                            terrnnz[t] = nz;
+                        goto chunkdone;
+                    }
+                    q = n;
+                    val[nz] = fval;
+                }
+                nz++;
+            }
+            rlen[nr] = nz - rlen[nr];
+            nr++;
+        }
+      chunkdone:
+
+        trlen[t]     = rlen;
+        tind[t]      = ind;
+        tval[t]      = val;
+        tnrows[t+1]  = nr;
+        tnnz[t+1]    = nz;
+        tmaxcol[t]   = maxcol;
+    }
+
+    /* the number of rows and non-zeros that precede each chunk */
+    for (trunc=0, t=0; t<nthreads; t++) {
+        tnrows[t+1] += tnrows[t];
+        tnnz[t+1]   += tnnz[t];
+        if (terr[t] == 0)
+            continue;
+        /* report parsing errors in rows that are part of the matrix */
+        if (format != DA_FMT_CLUTO || tnrows[t+1] < hnrows) {
+            if (terr[t] == 1)
+                da_errexit( "Error: Invalid column number %ld at row %zd.\n",
+                        terrval[t], tnrows[t+1]);
+            if (terr[t] == 2)
+                da_errexit( "Value could not be found for column! Row:%zd, NNZ:%zd\n",
+                        tnrows[t+1], tnnz[t] + terrnnz[t]);
+            da_errexit( "da_csr_Read: Something wrong with the number of nonzeros in "
+                    "the input file.\n");
+        }
+        /* an error past the header's last row - the following chunks are not needed */
+        for (trunc=1, i=t+1; i<nthreads; i++) {
+            tnrows[i+1] = tnrows[t+1];
+            tnnz[i+1]   = tnnz[t+1];
+        }
+        break;
+    }
+    nrows = (format == DA_FMT_CLUTO ? hnrows : tnrows[nthreads]);
+
+    /* the non-zeros of rows past the CLUTO header's row count are ignored */
+    for (t=0; t<nthreads; t++) {
+        tvnnz[t+1] = tnnz[t+1] - tnnz[t];
+        if (tnrows[t+1] > nrows)
+            for (i=da_max(nrows, tnrows[t]); i<tnrows[t+1]; i++)
+                tvnnz[t+1] -= trlen[t][i-tnrows[t]];
+        tvnnz[t+1] += tvnnz[t];
+    }
+    nnz = tvnnz[nthreads];
+    if (format == DA_FMT_CLUTO && nnz != hnnz)
+        da_errexit( "da_csr_Read: Something wrong with the number of nonzeros in "
+                "the input file. NNZ=%zd, ActualNNZ=%zd.\n", hnnz, nnz);
+
+    mat = da_csr_Create();
+    mat->nrows  = nrows;
+    mat->ncols  = hncols;
+    mat->rowptr = da_pmalloc(nrows+1, "da_csr_Read: rowptr");
+    mat->rowind = da_imalloc(nnz, "da_csr_Read: rowind");
+    if (readvals != 2)
+        mat->rowval = da_vsmalloc(nnz, 1.0, "da_csr_Read: rowval");
+    mat->rowptr[0] = 0;
+
+    /* build the row pointers and move the parsed values into place */
+    #pragma omp parallel for num_threads(nthreads) private(i) schedule(static, 1)
+    for (t=0; t<nthreads; t++) {
+        ptr_t k, nr;
+        nr = da_min(tnrows[t+1], nrows) - tnrows[t];
+        for (k=tvnnz[t], i=0; i<nr; i++) {
+            k += trlen[t][i];
+            mat->rowptr[tnrows[t]+i+1] = k;
+        }
+        if (nr > 0) {
+            memcpy(mat->rowind + tvnnz[t], tind[t], (tvnnz[t+1] - tvnnz[t]) * sizeof(idx_t));
+            if (readvals == 1)
+                memcpy(mat->rowval + tvnnz[t], tval[t], (tvnnz[t+1] - tvnnz[t]) * sizeof(val_t));
+        }
+        da_free((void **)&trlen[t], &tind[t], &tval[t], LTERM);
+    }
+    /* CLUTO matrices may have fewer rows than their header claims */
+    for (i=tnrows[nthreads]; i<nrows; i++)
+        mat->rowptr[i+1] = nnz;
+
+    if (trunc || tnrows[nthreads] > nrows) {
+        /* only the rows within the CLUTO header's row count determine the columns */
+        for (tmaxcol[0]=0, i=0; i<nnz; i++)
+            tmaxcol[0] = da_max(tmaxcol[0], mat->rowind[i]);
+        mat->ncols = da_max(mat->ncols, tmaxcol[0]+1);
+    } else {
+        for (t=0; t<nthreads; t++)
+            mat->ncols = da_max(mat->ncols, tmaxcol[t]+1);
+    }
+
+    if (data)
+        munmap((void *)data, size);
+    da_free((void **)&trlen, &tind, &tval, &tnrows, &tnnz, &tvnnz, &tmaxcol, &tbnd,
+            &terr, &terrnnz, &terrval, LTERM);
+
+    return mat;
+}
+
+
+/* pairs of decimal digits used by the fast integer formatter */
+static const char da_d2[] = "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+
+/*************************************************************************/
+/*! Formats an integer like "%zd" would.
+    \returns the end of the formatted text in s.
+ */
+/*************************************************************************/
+static inline char* da_fmtint(char* s, const int64_t v)
+{
+    char tmp[24], *t = tmp + 24;
+    uint64_t u = (v < 0 ? 0 - (uint64_t)v : (uint64_t)v);
+    size_t n;
+
+    for (; u >= 100; u /= 100) {
+        t -= 2;
+        memcpy(t, da_d2 + 2*(u%100), 2);
+    }
+    if (u >= 10) {
+        t -= 2;
+        memcpy(t, da_d2 + 2*u, 2);
+    } else
+        *--t = '0' + u;
+    if (v < 0)
+        *--t = '-';
+    n = tmp + 24 - t;
+    memcpy(s, t, n);
+
+    return s + n;
+}
+
+
+/*************************************************************************/
+/*! Formats a value like "%f" would. The float is scaled by 1e6 exactly in
+    double precision (24 + 14 significant bits) and rounded half to even,
+    which is what printf does with the default rounding mode.
+    \returns the end of the formatted text in s.
+ */
+/*************************************************************************/
+static inline char* da_fmtfixed(char* s, const val_t v)
+{
+    uint32_t bits;
+    int64_t m;
+    double a;
+
+    memcpy(&bits, &v, sizeof(bits));
+    a = fabs((double)v);
+    if ((bits & 0x7F800000) == 0x7F800000 || a >= 9e12)
+        return s + sprintf(s, "%f", v);  /* inf, nan, or too large for m */
+    m = (int64_t)nearbyint(a * 1e6);
+    if (bits >> 31)
+        *s++ = '-';
+    s = da_fmtint(s, m / 1000000);
+    *s++ = '.';
+    m %= 1000000;
+    memcpy(s, da_d2 + 2*(m/10000), 2);
+    memcpy(s+2, da_d2 + 2*(m/100%100), 2);
+    memcpy(s+4, da_d2 + 2*(m%100), 2);
+
+    return s + 6;
+}
+
+
+/*************************************************************************/
+/*! Formats a value with the fewest significant digits that read back as
+    the same float, in the style of "%g" (exponent notation for very small
+    or large values). Candidates with p = 1..9 digits are built with one
+    correctly rounded double operation and accepted if they round to v and
+    are not close to half-way between two floats; values outside the range
+    of exact powers of ten are left to the C library.
+    \returns the end of the formatted text in s.
+ */
+/*************************************************************************/
+static inline char* da_fmtshortest(char* s, const val_t v)
+{
+    uint32_t bits;
+    uint64_t d, cbits;
+    int p, k, e, nd, x;
+    char dig[24], buf[32];
+    double a, c;
+
+    memcpy(&bits, &v, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) == 0) {
+        if (bits >> 31)
+            *s++ = '-';
+        *s++ = '0';
+        return s;
+    }
+    a = fabs((double)v);
+    if ((bits & 0x7F800000) == 0x7F800000 || a < 1e-13 || a >= 1e13)
+        goto fallback;
+
+    e = (int)floor(log10(a));
+    for (p=1; p<=9; p++) {
+        k = e - p + 1;
+        d = (uint64_t)llrint(k < 0 ? a * da_p10[-k] : a / da_p10[k]);
+        c = (k < 0 ? (double)d / da_p10[-k] : (double)d * da_p10[k]);
+        memcpy(&cbits, &c, sizeof(cbits));
+        if ((float)c == (float)a && (cbits + 4 - 0x10000000ULL) % (1ULL << 29) > 8)
+            break;
+    }
+    if (p > 9)
+        goto fallback;
+
+    /* digits of d, without trailing zeros */
+    for (; d % 10 == 0; d /= 10)
+        k++;
+    nd = da_fmtint(dig, d) - dig;
+    x  = k + nd - 1;  /* decimal exponent of the leading digit */
+
+    if (bits >> 31)
+        *s++ = '-';
+    if (x < -4 || x >= 16) {
+        *s++ = dig[0];
+        if (nd > 1) {
+            *s++ = '.';
+            memcpy(s, dig+1, nd-1);
+            s += nd-1;
+        }
+        *s++ = 'e';
+        *s++ = (x < 0 ? '-' : '+');
+        x = abs(x);
+        if (x < 10)
+            *s++ = '0';
+        s = da_fmtint(s, x);
+    } else if (k >= 0) {
+        memcpy(s, dig, nd);
+        s += nd;
+        memset(s, '0', k);
+        s += k;
+    } else if (x >= 0) {
+        memcpy(s, dig, x+1);
+        s += x+1;
+        *s++ = '.';
+        memcpy(s, dig+x+1, nd-x-1);
+        s += nd-x-1;
+    } else {
+        *s++ = '0';
+        *s++ = '.';
+        memset(s, '0', -x-1);
+        s += -x-1;
+        memcpy(s, dig, nd);
+        s += nd;
+    }
+    return s;
+
+  fallback:
+    for (p=1; p<9; p++) {
+        snprintf(buf, 32, "%.*g", p, v);
+        if (strtof(buf, NULL) == v)
+            break;
+    }
+    return s + sprintf(s, "%.*g", p, v);
+}
+
+
+/*************************************************************************/
+/*! Writes the rows of a matrix in one of the text formats: CSR, CLUTO
+    (without the header line), or IJV. Rows are formatted in rounds of about
+    DA_WRITENNZ nonzeros per thread, each thread filling its own buffer with
+    a contiguous, nnz-balanced range of rows, and the buffers are then
+    written in row order with large write() calls. The output is the same
+    as the "%d"/"%f" formatting used for CSR/CLUTO; IJV values are written
+    in the shortest form that reads back as the same float.
+    \param mat is the matrix to be written,
+    \param fpout is the output stream; any buffered data is flushed first.
+    \param format is one of DA_FMT_CSR, DA_FMT_CLUTO, or DA_FMT_IJV.
+    \param writevals is either 1 or 0 indicating if the values will be
+           written or not.
+    \param numbering is 1 if ids should start at 1, 0 otherwise.
+ */
+/*************************************************************************/
+static void da_csr_WriteText(const da_csr_t* const mat, FILE* const fpout,
+        const char format, const char writevals, const char numbering)
+{
+    int t, nthreads, fd;
+    ptr_t i, r0, r1, c0, c1, lo, hi, *ptr, *bnd;
+    size_t *bsize, *blen;
+    idx_t *ind, nrows;
+    val_t *val;
+    char **bufs;
+
+    nrows = mat->nrows;
+    ptr   = mat->rowptr;
+    ind   = mat->rowind;
+    val   = mat->rowval;
+
+    nthreads = 1;
+#ifdef _OPENMP
+    if (ptr[nrows] > DA_WRITENNZ)
+        nthreads = omp_get_max_threads();
+#endif
+
+    bnd   = da_pmalloc(nthreads+1, "da_csr_WriteText: bnd");
+    bsize = (size_t *)da_nmalloc(nthreads * sizeof(size_t), "da_csr_WriteText: bsize");
+    blen  = (size_t *)da_nmalloc(nthreads * sizeof(size_t), "da_csr_WriteText: blen");
+    bufs  = (char **)da_nmalloc(nthreads * sizeof(char *), "da_csr_WriteText: bufs");
+
+    fflush(fpout);
+    fd = fileno(fpout);
+
+    /* the cost of a row is its number of nonzeros plus one, so ptr[i]+i is the
+       cost of rows 0..i-1; rounds and thread ranges are balanced by cost */
+    for (r0=0; r0 < nrows; r0=r1) {
+        c0 = ptr[r0] + r0;
+        c1 = c0 + (ptr_t)nthreads * DA_WRITENNZ;
+        if (c1 >= ptr[nrows] + nrows)
+            r1 = nrows;
+        else {
+            for (lo=r0+1, hi=nrows; lo < hi; ) {
+                i = (lo + hi) / 2;
+                if (ptr[i] + i < c1)
+                    lo = i + 1;
+                else
+                    hi = i;
+            }
+            r1 = lo;
+        }
+        c1 = ptr[r1] + r1;
+        bnd[0] = r0;
+        bnd[nthreads] = r1;
+        for (t=1; t<nthreads; t++) {
+            for (lo=bnd[t-1], hi=r1; lo < hi; ) {
+                i = (lo + hi) / 2;
+                if (ptr[i] + i < c0 + (c1 - c0) * t / nthreads)
+                    lo = i + 1;
+                else
+                    hi = i;
+            }
+            bnd[t] = lo;
+        }
+
+        #pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+        for (t=0; t<nthreads; t++) {
+            ptr_t r, j;
+            size_t need;
+            char *s;
+
+            /* at most 64 bytes per nonzero ("%f" of FLT_MAX has 46 characters) and 1 per row */
+            need = 64 * (ptr[bnd[t+1]] - ptr[bnd[t]]) + (bnd[t+1] - bnd[t]);
+            if (need > bsize[t]) {
+                da_free((void **)&bufs[t], LTERM);
+                bsize[t] = need;
+                bufs[t] = da_cmalloc(bsize[t], "da_csr_WriteText: bufs[t]");
+            }
+
+            s = bufs[t];
+            if (format == DA_FMT_IJV) {
+                for (r=bnd[t]; r < bnd[t+1]; r++) {
+                    for (j=ptr[r]; j < ptr[r+1]; j++) {
+                        s = da_fmtint(s, r + numbering);
+                        *s++ = '\t';
+                        s = da_fmtint(s, ind[j] + numbering);
+                        if (writevals) {
+                            *s++ = '\t';
+                            s = da_fmtshortest(s, val[j]);
+                        }
+                        *s++ = '\n';
+                    }
+                }
+            } else {
+                for (r=bnd[t]; r < bnd[t+1]; r++) {
+                    for (j=ptr[r]; j < ptr[r+1]; j++) {
+                        *s++ = ' ';
+                        s = da_fmtint(s, ind[j] + numbering);
+                        if (writevals) {
+                            *s++ = ' ';
+                            s = da_fmtfixed(s, val[j]);
+                        }
+                    }
+                    *s++ = '\n';
+                }
+            }
+            blen[t] = (bnd[t+1] > bnd[t] ? s - bufs[t] : 0);
+        }
+
+        for (t=0; t<nthreads; t++)
+            if (da_write(fd, bufs[t], blen[t]) != (ssize_t)blen[t])
+                da_errexit("da_csr_WriteText: Could not write the output file.\n");
+    }
+
+    for (t=0; t<nthreads; t++)
+        da_free((void **)&bufs[t], LTERM);
+    da_free((void **)&bnd, &bsize, &blen, &bufs, LTERM);
+}
+
+
+/**************************************************************************/
+/*! Reads a matrix stored in the binary CSR format written by da_csr_Write.
+    The file is memory-mapped privately and the matrix arrays point directly
+    into the mapping, such that no data is copied or parsed. Pages are only
+    copied if the matrix is modified in place.
+    \param filename is the file that stores the data.
+    \param readvals is 2 if values should be ignored. Otherwise, values are
+           read if present in the file, and set to 1.0 if not.
+    \returns the matrix that was read.
+ */
+/**************************************************************************/
+static da_csr_t* da_csr_ReadBin(const char* const filename, const char readvals)
+{
+    int fd, i;
+    struct stat st;
+    size_t size, len[6];
+    char *base;
+    da_csrbin_t hdr;
+    da_csr_t *mat;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        da_errexit("Could not open file %s.\n", filename);
+    size = st.st_size;
+    if (size < offsetof(da_csrbin_t, flags))
+        da_errexit("File %s is not a binary CSR file.\n", filename);
+    base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        da_errexit("Could not map file %s.\n", filename);
+    close(fd);
+
+    /* version 1 headers have no flags */
+    memset(&hdr, 0, sizeof(da_csrbin_t));
+    memcpy(&hdr, base, offsetof(da_csrbin_t, flags));
+    if (memcmp(hdr.magic, DA_BIN_MAGIC, 8) != 0)
+        da_errexit("File %s is not a binary CSR file.\n", filename);
+    if (hdr.version > DA_BIN_VERSION)
+        da_errexit("Binary CSR file %s has version %u, but only versions up to %d are supported.\n",
+                filename, hdr.version, DA_BIN_VERSION);
+    if (hdr.version > 1) {
+        if (size < sizeof(da_csrbin_t))
+            da_errexit("Binary CSR file %s is corrupt.\n", filename);
+        memcpy(&hdr, base, sizeof(da_csrbin_t));
+    }
+    if (hdr.idxsize != sizeof(idx_t) || hdr.ptrsize != sizeof(ptr_t) || hdr.valsize != sizeof(val_t))
+        da_errexit("Binary CSR file %s was written with different idx_t/ptr_t/val_t sizes.\n", filename);
+    if (hdr.size != size || hdr.nrows < 0 || hdr.ncols < 0 || hdr.nnz < 0)
+        da_errexit("Binary CSR file %s is corrupt.\n", filename);
+
+    len[0] = (hdr.nrows+1) * sizeof(ptr_t);
+    len[1] = hdr.nnz * sizeof(idx_t);
+    len[2] = hdr.nnz * sizeof(val_t);
+    len[3] = (hdr.ncols+1) * sizeof(ptr_t);
+    len[4] = hdr.nnz * sizeof(idx_t);
+    len[5] = hdr.nnz * sizeof(val_t);
+    for (i=0; i<6; i++)
+        if (hdr.offset[i] && (hdr.offset[i] % DA_BIN_ALIGN || hdr.offset[i] + len[i] > size))
+            da_errexit("Binary CSR file %s is corrupt.\n", filename);
+    if ((!hdr.offset[0] || !hdr.offset[1]) && (!hdr.offset[3] || !hdr.offset[4]))
+        da_errexit("Binary CSR file %s has no matrix structure.\n", filename);
+
+    mat = da_csr_Create();
+    mat->nrows   = hdr.nrows;
+    mat->ncols   = hdr.ncols;
+    mat->mapbase = base;
+    mat->mapsize = size;
+    mat->preprocessed = ((hdr.flags & DA_BIN_PREPROCESSED) != 0);
+    if (hdr.offset[0] && hdr.offset[1]) {
+        mat->rowptr = (ptr_t *)(base + hdr.offset[0]);
+        mat->rowind = (idx_t *)(base + hdr.offset[1]);
+        if (readvals != 2)
+            mat->rowval = (hdr.offset[2] ? (val_t *)(base + hdr.offset[2]) :
+                    da_vsmalloc(hdr.nnz, 1.0, "da_csr_ReadBin: rowval"));
+    }
+    if (hdr.offset[3] && hdr.offset[4]) {
+        mat->colptr = (ptr_t *)(base + hdr.offset[3]);
+        mat->colind = (idx_t *)(base + hdr.offset[4]);
+        if (readvals != 2)
+            mat->colval = (hdr.offset[5] ? (val_t *)(base + hdr.offset[5]) :
+                    da_vsmalloc(hdr.nnz, 1.0, "da_csr_ReadBin: colval"));
+    }
+
+    return mat;
+}
+
+
+/**************************************************************************/
+/*! Writes a matrix in the binary CSR format: a da_csrbin_t header followed
+    by the rowptr, rowind, and rowval arrays and, for DA_FMT_BINCOL, the
+    colptr, colind, and colval arrays of the column index. Each array starts
+    at a multiple of DA_BIN_ALIGN bytes. Preprocessed matrices are flagged
+    as such (DA_BIN_PREPROCESSED).
+    \param mat is the matrix to be written,
+    \param filename is the name of the output file.
+    \param format is DA_FMT_BINROW or DA_FMT_BINCOL.
+    \param writevals is either 1 or 0 indicating if the values will be
+           written or not.
+ */
+/**************************************************************************/
+static void da_csr_WriteBin(const da_csr_t* const mat, const char* const filename,
+        const char format, const char writevals)
+{
+    int i;
+    size_t off, len[6];
+    const void *arr[6];
+    char pad[DA_BIN_ALIGN];
+    da_csrbin_t hdr;
+    da_csr_t *tmp = NULL;
+    const da_csr_t *m = mat;
+    FILE *fpout;
+
+    if (format == DA_FMT_BINCOL && !mat->colptr) {
+        tmp = da_csr_Copy(mat);
+        da_csr_CreateIndex(tmp, DA_COL);
+        m = tmp;
+    }
+
+    memset(&hdr, 0, sizeof(da_csrbin_t));
+    memset(pad, 0, DA_BIN_ALIGN);
+    memcpy(hdr.magic, DA_BIN_MAGIC, 8);
+    hdr.version = DA_BIN_VERSION;
+    hdr.idxsize = sizeof(idx_t);
+    hdr.ptrsize = sizeof(ptr_t);
+    hdr.valsize = sizeof(val_t);
+    hdr.nrows   = m->nrows;
+    hdr.ncols   = m->ncols;
+    hdr.nnz     = m->rowptr[m->nrows];
+    hdr.flags   = (mat->preprocessed ? DA_BIN_PREPROCESSED : 0);
+
+    arr[0] = m->rowptr;
+    arr[1] = m->rowind;
+    arr[2] = (writevals ? m->rowval : NULL);
+    arr[3] = (format == DA_FMT_BINCOL ? m->colptr : NULL);
+    arr[4] = (format == DA_FMT_BINCOL ? m->colind : NULL);
+    arr[5] = (format == DA_FMT_BINCOL && writevals ? m->colval : NULL);
+    len[0] = (hdr.nrows+1) * sizeof(ptr_t);
+    len[1] = hdr.nnz * sizeof(idx_t);
+    len[2] = hdr.nnz * sizeof(val_t);
+    len[3] = (hdr.ncols+1) * sizeof(ptr_t);
+    len[4] = hdr.nnz * sizeof(idx_t);
+    len[5] = hdr.nnz * sizeof(val_t);
+
+    off = sizeof(da_csrbin_t);
+    for (i=0; i<6; i++) {
+        if (!arr[i])
+            continue;
+        off = (off + DA_BIN_ALIGN - 1) / DA_BIN_ALIGN * DA_BIN_ALIGN;
+        hdr.offset[i] = off;
+        off += len[i];
+    }
+    hdr.size = off;
+
+    fpout = (filename ? da_fopen(filename, "w", "da_csr_WriteBin: fpout") : stdout);
+    off = fwrite(&hdr, sizeof(da_csrbin_t), 1, fpout) * sizeof(da_csrbin_t);
+    for (i=0; i<6; i++) {
+        if (!arr[i])
+            continue;
+        off += fwrite(pad, 1, hdr.offset[i] - off, fpout);
+        off += fwrite(arr[i], 1, len[i], fpout);
+    }
+    if (off != hdr.size)
+        da_errexit("Could not write binary CSR file %s.\n", filename ? filename : "stdout");
+    if (filename)
+        da_fclose(fpout);
+
+    da_csr_Free(&tmp);
+}
+
+
+/**************************************************************************/
+/*! Converts a float to an IEEE half-precision number, rounding to nearest
+    even. Values too large for half precision become infinite. */
+/**************************************************************************/
+static inline uint16_t da_f2h(const float f)
+{
+    uint32_t x, sign, h, rem, half;
+    int s;
+
+    memcpy(&x, &f, sizeof(x));
+    sign = (x >> 16) & 0x8000;
+    x &= 0x7FFFFFFF;
+    if (x >= 0x7F800000)  /* inf or nan */
+        return sign | 0x7C00 | (x > 0x7F800000 ? 0x200 : 0);
+    if (x >= 0x477FF000)  /* rounds to more than 65504 */
+        return sign | 0x7C00;
+    if (x < 0x38800000) {  /* subnormal half or zero */
+        if (x < 0x33000000)
+            return sign;
+        s    = 126 - (x >> 23);
+        x    = (x & 0x7FFFFF) | 0x800000;
+        h    = x >> s;
+        rem  = x & ((1U << s) - 1);
+        half = 1U << (s - 1);
+    } else {  /* re-bias the exponent; a carry out of the mantissa is correct */
+        h    = (x >> 13) - (112 << 10);
+        rem  = x & 0x1FFF;
+        half = 0x1000;
+    }
+    if (rem > half || (rem == half && (h & 1)))
+        h++;
+
+    return sign | h;
+}
+
+
+/**************************************************************************/
+/*! Converts an IEEE half-precision number to a float. */
+/**************************************************************************/
+static inline float da_h2f(const uint16_t h)
+{
+    uint32_t sign, exp, mant, x;
+    float f;
+
+    sign = (uint32_t)(h & 0x8000) << 16;
+    exp  = (h >> 10) & 0x1F;
+    mant = h & 0x3FF;
+    if (exp == 0x1F)
+        x = sign | 0x7F800000 | (mant << 13);
+    else if (exp > 0)
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    else if (mant > 0) {  /* subnormal half: normalize */
+        for (exp=113; !(mant & 0x400); exp--)
+            mant <<= 1;
+        x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+    } else
+        x = sign;
+    memcpy(&f, &x, sizeof(f));
+
+    return f;
+}
+
+
+/* LEB128 varints used by the binary neighbor graph format */
+static inline size_t da_varintlen(uint64_t v)
+{
+    size_t n;
+    for (n=1; v >= 128; n++)
+        v >>= 7;
+    return n;
+}
+
+static inline unsigned char* da_putvarint(unsigned char* s, uint64_t v)
+{
+    for (; v >= 128; v >>= 7)
+        *s++ = (unsigned char)(v | 128);
+    *s++ = (unsigned char)v;
+    return s;
+}
+
+/* returns NULL if the varint is longer than 10 bytes or extends past e */
+static inline const unsigned char* da_getvarint(const unsigned char* s,
+        const unsigned char* const e, uint64_t* const v)
+{
+    int sh;
+    for (*v=0, sh=0; s < e && sh < 64; sh += 7) {
+        *v |= (uint64_t)(*s & 127) << sh;
+        if (!(*s++ & 128))
+            return s;
+    }
+    return NULL;
+}
+
+
+/**************************************************************************/
+/*! Writes a matrix, typically a neighbor graph, in the compact binary
+    neighbor format (see da_nbrbin_t). The ids of each row are stored in
+    increasing order as varint-coded gaps, and the values in the same order
+    as fp32 or fp16 numbers. If all rows were sorted in decreasing value
+    order, as findsim's neighbor graphs are, the file is flagged so that
+    da_csr_ReadNbr restores that order. The order of neighbors with equal
+    values is not stored; they are restored in decreasing id order, as
+    da_knnheap_ToCsr orders them. Rows are encoded in parallel.
+    \param mat is the matrix to be written,
+    \param filename is the name of the output file.
+    \param format is DA_FMT_BINNBR (fp32 values) or DA_FMT_BINNBR16 (fp16).
+    \param writevals is either 1 or 0 indicating if the values will be
+           written or not.
+ */
+/**************************************************************************/
+static void da_csr_WriteNbr(const da_csr_t* const mat, const char* const filename,
+        const char format, const char writevals)
+{
+    ssize_t i;
+    int inorder;
+    idx_t nrows, maxlen;
+    ptr_t *ptr;
+    idx_t *ind;
+    val_t *val;
+    uint64_t *roff, tsize;
+    unsigned char *data;
+    da_ivkv_t *pairs;
+    da_nbrbin_t hdr;
+    FILE *fpout;
+
+    nrows = mat->nrows;
+    ptr   = mat->rowptr;
+    ind   = mat->rowind;
+    val   = mat->rowval;
+
+    memset(&hdr, 0, sizeof(da_nbrbin_t));
+    memcpy(hdr.magic, DA_NBR_MAGIC, 8);
+    hdr.version = DA_NBR_VERSION;
+    hdr.valsize = (writevals ? (format == DA_FMT_BINNBR16 ? 2 : 4) : 0);
+    hdr.nrows   = nrows;
+    hdr.ncols   = mat->ncols;
+    hdr.nnz     = ptr[nrows];
+
+    for (maxlen=0, i=0; i<nrows; i++)
+        maxlen = da_max(maxlen, ptr[i+1] - ptr[i]);
+
+    /* sort each row by id and find the size of its encoding */
+    roff  = (uint64_t *)da_malloc((nrows+1) * sizeof(uint64_t), "da_csr_WriteNbr: roff");
+    pairs = da_ivkvmalloc(ptr[nrows], "da_csr_WriteNbr: pairs");
+    inorder = 1;
+    #pragma omp parallel for private(i) reduction(&:inorder) schedule(dynamic, 1024)
+    for (i=0; i<nrows; i++) {
+        ptr_t j;
+        idx_t prev;
+        uint64_t sz;
+        da_ivkv_t *row = pairs + ptr[i];
+
+        for (j=ptr[i]; j<ptr[i+1]; j++) {
+            row[j-ptr[i]].key = ind[j];
+            row[j-ptr[i]].val = (val ? val[j] : 1.0);
+            if (val && j > ptr[i] && val[j] > val[j-1])
+                inorder = 0;
+        }
+        da_ivkvsortik(ptr[i+1] - ptr[i], row);
+        sz = da_varintlen(ptr[i+1] - ptr[i]) + (ptr[i+1] - ptr[i]) * hdr.valsize;
+        for (prev=0, j=0; j<ptr[i+1]-ptr[i]; j++) {
+            sz  += da_varintlen(row[j].key - prev);
+            prev = row[j].key;
+        }
+        roff[i+1] = sz;
+    }
+    if (inorder && hdr.valsize > 0)
+        hdr.flags |= DA_NBR_VALORDER;
+
+    roff[0] = sizeof(da_nbrbin_t) + (nrows+1) * sizeof(uint64_t);
+    for (i=0; i<nrows; i++)
+        roff[i+1] += roff[i];
+    hdr.size = roff[nrows];
+    tsize    = roff[0];
+
+    /* encode the rows */
+    data = (unsigned char *)da_malloc(da_max(hdr.size - tsize, (uint64_t)1), "da_csr_WriteNbr: data");
+    #pragma omp parallel for private(i) schedule(dynamic, 1024)
+    for (i=0; i<nrows; i++) {
+        ptr_t j, n = ptr[i+1] - ptr[i];
+        idx_t prev;
+        uint16_t h;
+        unsigned char *s = data + (roff[i] - tsize);
+        da_ivkv_t *row = pairs + ptr[i];
+
+        s = da_putvarint(s, n);
+        for (prev=0, j=0; j<n; j++) {
+            s    = da_putvarint(s, row[j].key - prev);
+            prev = row[j].key;
+        }
+        if (hdr.valsize == 4) {
+            for (j=0; j<n; j++, s+=4)
+                memcpy(s, &row[j].val, 4);
+        } else if (hdr.valsize == 2) {
+            for (j=0; j<n; j++, s+=2) {
+                h = da_f2h(row[j].val);
+                memcpy(s, &h, 2);
+            }
+        }
+    }
+
+    fpout = (filename ? da_fopen(filename, "w", "da_csr_WriteNbr: fpout") : stdout);
+    if (fwrite(&hdr, sizeof(da_nbrbin_t), 1, fpout) != 1 ||
+            fwrite(roff, sizeof(uint64_t), nrows+1, fpout) != (size_t)nrows+1 ||
+            fwrite(data, 1, hdr.size - tsize, fpout) != hdr.size - tsize)
+        da_errexit("Could not write binary neighbor file %s.\n", filename ? filename : "stdout");
+    if (filename)
+        da_fclose(fpout);
+
+    da_free((void **)&roff, &pairs, &data, LTERM);
+}
+
+
+/**************************************************************************/
+/*! Reads a matrix stored in the binary neighbor format written by
+    da_csr_WriteNbr. Rows are decoded in parallel directly from the
+    memory-mapped file, using the row offset table.
+    \param filename is the file that stores the data.
+    \param readvals is 2 if values should be ignored. Otherwise, values are
+           read if present in the file, and set to 1.0 if not.
+    \returns the matrix that was read.
+ */
+/**************************************************************************/
+static da_csr_t* da_csr_ReadNbr(const char* const filename, const char readvals)
+{
+    ssize_t i, err;
+    int fd;
+    idx_t maxlen;
+    size_t size;
+    struct stat st;
+    const unsigned char *base;
+    const uint64_t *roff;
+    da_nbrbin_t hdr;
+    da_csr_t *mat;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        da_errexit("Could not open file %s.\n", filename);
+    size = st.st_size;
+    if (size < sizeof(da_nbrbin_t))
+        da_errexit("File %s is not a binary neighbor file.\n", filename);
+    base = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        da_errexit("Could not map file %s.\n", filename);
+    close(fd);
+
+    memcpy(&hdr, base, sizeof(da_nbrbin_t));
+    if (memcmp(hdr.magic, DA_NBR_MAGIC, 8) != 0)
+        da_errexit("File %s is not a binary neighbor file.\n", filename);
+    if (hdr.version > DA_NBR_VERSION)
+        da_errexit("Binary neighbor file %s has version %u, but only versions up to %d are supported.\n",
+                filename, hdr.version, DA_NBR_VERSION);
+    if (hdr.size != size || hdr.nrows < 0 || hdr.nrows > IDX_MAX || hdr.ncols < 0 ||
+            hdr.ncols > IDX_MAX || hdr.nnz < 0 || (hdr.valsize != 0 && hdr.valsize != 2 &&
+            hdr.valsize != 4) || (size - sizeof(da_nbrbin_t)) / sizeof(uint64_t) <= (uint64_t)hdr.nrows)
+        da_errexit("Binary neighbor file %s is corrupt.\n", filename);
+    roff = (const uint64_t *)(base + sizeof(da_nbrbin_t));
+    if (roff[0] != sizeof(da_nbrbin_t) + (hdr.nrows+1) * sizeof(uint64_t) || roff[hdr.nrows] != size)
+        da_errexit("Binary neighbor file %s is corrupt.\n", filename);
+
+    mat = da_csr_Create();
+    mat->nrows  = hdr.nrows;
+    mat->ncols  = hdr.ncols;
+    mat->rowptr = da_pmalloc(hdr.nrows+1, "da_csr_ReadNbr: rowptr");
+
+    /* row lengths */
+    err = 0;
+    #pragma omp parallel for private(i) reduction(max:err) schedule(static)
+    for (i=0; i<hdr.nrows; i++) {
+        uint64_t n;
+        if (roff[i+1] < roff[i] || roff[i+1] > size ||
+                !da_getvarint(base + roff[i], base + roff[i+1], &n) || n > roff[i+1] - roff[i]) {
+            err = i+1;
+            n   = 0;
+        }
+        mat->rowptr[i] = n;
+    }
+    if (err)
+        da_errexit("Binary neighbor file %s is corrupt at row %zd.\n", filename, err);
+    for (maxlen=0, i=0; i<hdr.nrows; i++)
+        maxlen = da_max(maxlen, mat->rowptr[i]);
+    CSRMAKE(i, hdr.nrows, mat->rowptr);
+    if (mat->rowptr[hdr.nrows] != hdr.nnz)
+        da_errexit("Binary neighbor file %s is corrupt.\n", filename);
+
+    mat->rowind = da_imalloc(hdr.nnz, "da_csr_ReadNbr: rowind");
+    if (readvals != 2)
+        mat->rowval = da_vmalloc(hdr.nnz, "da_csr_ReadNbr: rowval");
+
+    /* decode the rows */
+    #pragma omp parallel private(i)
+    {
+        ptr_t j, n, k;
+        uint64_t g, id;
+        uint16_t h;
+        const unsigned char *s, *e;
+        idx_t *rind;
+        val_t *rval;
+        da_ivkv_t *row = NULL;
+
+        if (mat->rowval && (hdr.flags & DA_NBR_VALORDER))
+            row = da_ivkvmalloc(da_max(maxlen, 1), "da_csr_ReadNbr: row");
+
+        #pragma omp for reduction(max:err) schedule(dynamic, 1024)
+        for (i=0; i<hdr.nrows; i++) {
+            k    = mat->rowptr[i];
+            n    = mat->rowptr[i+1] - k;
+            rind = mat->rowind + k;
+            rval = (mat->rowval ? mat->rowval + k : NULL);
+            e    = base + roff[i+1];
+            s    = da_getvarint(base + roff[i], e, &g);
+            for (id=0, j=0; j<n && s; j++) {
+                s  = da_getvarint(s, e, &g);
+                id += g;
+                rind[j] = (idx_t)id;
+                if (id >= (uint64_t)hdr.ncols)
+                    s = NULL;
+            }
+            if (!s || e - s != n * (ptr_t)hdr.valsize) {
+                err = i+1;
+                continue;
+            }
+            if (!rval)
+                continue;
+            if (hdr.valsize == 4)
+                memcpy(rval, s, n * 4);
+            else if (hdr.valsize == 2) {
+                for (j=0; j<n; j++, s+=2) {
+                    memcpy(&h, s, 2);
+                    rval[j] = da_h2f(h);
+                }
+            } else
+                for (j=0; j<n; j++)
+                    rval[j] = 1.0;
+
+            /* restore the decreasing value order of the rows */
+            if (row) {
+                for (j=0; j<n; j++) {
+                    row[j].key = rind[j];
+                    row[j].val = rval[j];
+                }
+                da_ivkvsortdk(n, row);
+                for (j=0; j<n; j++) {
+                    rind[j] = row[j].key;
+                    rval[j] = row[j].val;
+                }
+            }
+        }
+
+        da_free((void **)&row, LTERM);
+    }
+    if (err)
+        da_errexit("Binary neighbor file %s is corrupt at row %zd.\n", filename, err);
+
+    munmap((void *)base, size);
+
+    return mat;
+}
+
+
 /**************************************************************************/
 /*! Reads a CSR matrix from the supplied file and stores it the matrix's
     forward structure.
     \param filename is the file that stores the data.
     \param format is either DA_FMT_METIS, DA_FMT_CLUTO,
-           DA_FMT_CSR, DA_FMT_BINROW, DA_FMT_BINCOL
-           specifying the type of the input format.
+           DA_FMT_CSR, DA_FMT_BINROW, DA_FMT_BINCOL, DA_FMT_BINNBR,
+           DA_FMT_BINNBR16 specifying the type of the input format.
            The DA_FMT_CSR does not contain a header
-           line, whereas the DA_FMT_BINROW is a binary format written
-           by da_csr_Write() using the same format specifier.
+           line, whereas the DA_FMT_BINROW and DA_FMT_BINCOL are binary
+           formats written by da_csr_Write(), which are memory-mapped
+           rather than copied (see da_csr_ReadBin). DA_FMT_BINNBR and
+           DA_FMT_BINNBR16 are compact binary neighbor graph formats
+           (see da_csr_ReadNbr).
     \param readvals is either 1 or 0, indicating if the CSR file contains
            values or it does not. It only applies when DA_FMT_CSR is
            used.
@@ -329,6 +1628,13 @@ da_csr_t* da_csr_Read(const char* const filename,
 	if (!da_fexists(filename))
 		da_errexit( "File %s does not exist!\n", filename);
 
+	if (format == DA_FMT_CSR || format == DA_FMT_CLUTO)
+		return da_csr_ReadText(filename, format, readvals, numbering);
+	if (format == DA_FMT_BINROW || format == DA_FMT_BINCOL)
+		return da_csr_ReadBin(filename, readvals);
+	if (format == DA_FMT_BINNBR || format == DA_FMT_BINNBR16)
+		return da_csr_ReadNbr(filename, readvals);
+
 	if (format == DA_FMT_IJV) {
 		da_getfilestats(filename, &nrows, &nnz, NULL, NULL);
 
@@ -397,20 +1703,7 @@ da_csr_t* da_csr_Read(const char* const filename,
 		return mat;
 	}
 
-	if (format == DA_FMT_CLUTO) {
-		fpin = da_fopen(filename, "r", "da_csr_Read: fpin");
-		do {
-			if (da_getline(&line, &lnlen, fpin) <= 0)
-				da_errexit( "Premature end of input file: %s\n", filename);
-		} while (line[0] == '%');
-
-		if (sscanf(line, "%zu %zu %zu", &nrows, &ncols, &nnz) != 3)
-			da_errexit( "Header line must contain 3 integers.\n");
-
-		readvals  = 1;
-		numbering = 1;
-	}
-	else if (format == DA_FMT_METIS) {
+	if (format == DA_FMT_METIS) {
 		fpin = da_fopen(filename, "r", "da_csr_Read: fpin");
 		do {
 			if (da_getline(&line, &lnlen, fpin) <= 0)
@@ -526,28 +1819,22 @@ da_csr_t* da_csr_Read(const char* const filename,
 /*! Writes the row-based structure of a matrix into a file.
     \param mat is the matrix to be written,
     \param filename is the name of the output file.
-    \param format is one of: DA_FMT_CLUTO, DA_FMT_CSR,
-           DA_FMT_BINROW, DA_FMT_BINCOL.
+    \param format is one of: DA_FMT_CLUTO, DA_FMT_CSR, DA_FMT_IJV,
+           DA_FMT_BINROW, DA_FMT_BINCOL, DA_FMT_BINNBR, DA_FMT_BINNBR16.
     \param writevals is either 1 or 0 indicating if the values will be
            written or not. This is only applicable when DA_FMT_CSR
            is used.
     \param numbering is either 1 or 0 indicating if the internal 0-based
            numbering will be shifted by one or not during output. This
            is only applicable when DA_FMT_CSR is used.
+    Text formats are formatted in parallel by da_csr_WriteText.
  */
 /**************************************************************************/
 void da_csr_Write(const da_csr_t* const mat, const char* const filename,
 		const char format, char writevals, char numbering)
 {
-	ssize_t i, j;
 	size_t nnz;
-	idx_t len;
-	idx_t *ind;
-	ptr_t *ptr;
-	val_t *val;
-	int32_t nr, nc, vId;
-	int32_t edge[2];
-	da_csr_t *tmp = NULL;
+	int32_t nr, nc;
 	FILE *fpout = NULL;
 
 	if (!mat->rowval)
@@ -556,10 +1843,6 @@ void da_csr_Write(const da_csr_t* const mat, const char* const filename,
 	nr  = mat->nrows;
 	nc  = mat->ncols;
 	nnz = mat->rowptr[mat->nrows];
-	ptr = mat->rowptr;
-	ind = mat->rowind;
-	val = mat->rowval;
-
 
 
 	assert(mat->nrows <= INT32_MAX);
@@ -569,29 +1852,21 @@ void da_csr_Write(const da_csr_t* const mat, const char* const filename,
 	if (format == DA_FMT_METIS)
 		da_errexit( "METIS output format is not supported.\n");
 
+	if (format == DA_FMT_BINROW || format == DA_FMT_BINCOL) {
+		da_csr_WriteBin(mat, filename, format, writevals);
+		return;
+	}
+
+	if (format == DA_FMT_BINNBR || format == DA_FMT_BINNBR16) {
+		da_csr_WriteNbr(mat, filename, format, writevals);
+		return;
+	}
+
 	if (filename)
 		fpout = da_fopen(filename, "w", "da_csr_Write: fpout");
 	else
 		fpout = stdout;
 
-	if (format == DA_FMT_IJV) {
-		numbering = (numbering ? 1 : 0);
-		for (i = 0; i < mat->nrows; ++i) {
-			for (j = ptr[i]; j < ptr[i+1]; ++j) {
-				if (writevals)
-					fprintf(fpout, "%zd\t%d\t%.19g\n", i + numbering,
-							ind[j] + numbering, val[j]);
-				else
-					fprintf(fpout, "%zd\t%d\n", i + numbering,
-							ind[j] + numbering);
-			}
-		}
-
-		if (fpout)
-			da_fclose(fpout);
-		return;
-	}
-
 	if (format == DA_FMT_CLUTO) {
 		fprintf(fpout, "%d %d %zu\n",
 				nr, nc, nnz);
@@ -600,15 +1875,7 @@ void da_csr_Write(const da_csr_t* const mat, const char* const filename,
 		numbering = 1;
 	}
 
-	for (i = 0; i < nr; ++i) {
-		for (j = ptr[i]; j < ptr[i+1]; ++j) {
-			fprintf(fpout, " %d",
-					ind[j] + (numbering ? 1 : 0));
-			if (writevals)
-				fprintf(fpout, " %f", val[j]);
-		}
-		fprintf(fpout, "\n");
-	}
+	da_csr_WriteText(mat, fpout, format, writevals, (numbering ? 1 : 0));
 
     if (fpout){
         da_fclose(fpout);
@@ -654,24 +1921,164 @@ void da_csr_PrintInfo(
     \param mat is the matrix to be printed.
 */
 /**************************************************************************/
-void da_csr_Print(const da_csr_t* const mat)
+void da_csr_Print(const da_csr_t* const mat)
+{
+	da_csr_Write(mat, NULL, DA_FMT_CLUTO, 1, 1);
+}
+
+
+/*************************************************************************/
+/*! Check if a text (non-binary) text file containing a csr is in CLUTO or CSR format.
+    \param file is the matrix file to be checked.
+    \return the CSR format: MV_FMT_CLUTO or MV_FMT_CSR
+ */
+/*************************************************************************/
+char da_csr_isClutoOrCsr(const char* const file)
+{
+	size_t nrows, nnz;
+
+	da_getfilestats(file, &nrows, &nnz, NULL, NULL);
+	return (nnz%2 == 1) ? DA_FMT_CLUTO : DA_FMT_CSR;
+}
+
+
+/*************************************************************************/
+/*! Returns the number of threads to use for a step that processes the
+    given number of nonzeros. Small matrices are processed serially.
+ */
+/**************************************************************************/
+static int da_csr_NThreads(const ptr_t nnz)
+{
+#ifdef _OPENMP
+	if (nnz > DA_PARNNZ)
+		return omp_get_max_threads();
+#endif
+	return 1;
+}
+
+
+/*************************************************************************/
+/*! Adds the number of occurrences of each column id in an array to counts.
+    Threads count the ids of contiguous parts of the array in their own
+    histograms, which are then summed.
+    \param ind the column ids,
+    \param nnz the number of column ids,
+    \param ncols the number of columns,
+    \param counts the count of each column.
+ */
+/**************************************************************************/
+static void da_csr_CountColumns(const idx_t* const ind, const ptr_t nnz,
+		const idx_t ncols, idx_t* const counts)
 {
-	da_csr_Write(mat, NULL, DA_FMT_CLUTO, 1, 1);
+	ssize_t i;
+	int nthreads;
+	idx_t *tcnt;
+
+	/* histograms may not take more space than the ids they count */
+	nthreads = da_max(1, da_min(da_csr_NThreads(nnz), nnz / da_max(ncols, 1)));
+	if (nthreads == 1) {
+		for (i=0; i<nnz; ++i)
+			counts[ind[i]]++;
+		return;
+	}
+
+	tcnt = da_inmalloc((size_t)nthreads * ncols, "da_csr_CountColumns: tcnt");
+	#pragma omp parallel num_threads(nthreads) private(i)
+	{
+		idx_t *cnt = tcnt;
+		int t;
+
+#ifdef _OPENMP
+		cnt += (size_t)ncols * omp_get_thread_num();
+#endif
+		#pragma omp for schedule(static)
+		for (i=0; i<nnz; ++i)
+			cnt[ind[i]]++;
+
+		#pragma omp for schedule(static)
+		for (i=0; i<ncols; ++i)
+			for (t=0; t<nthreads; ++t)
+				counts[i] += tcnt[(size_t)t * ncols + i];
+	}
+	da_free((void **)&tcnt, LTERM);
 }
 
 
 /*************************************************************************/
-/*! Check if a text (non-binary) text file containing a csr is in CLUTO or CSR format.
-    \param file is the matrix file to be checked.
-    \return the CSR format: MV_FMT_CLUTO or MV_FMT_CSR
+/*! Creates the reverse (e.g., column) index of a forward (e.g., row) index
+    with several threads. The forward rows are split into one contiguous range
+    per thread. The threads count the entries of each reverse row in their
+    range, the counts give each thread the start of its part of every reverse
+    row, and the threads then place their entries. Since ranges are placed in
+    order, each reverse row lists the forward rows in increasing order, as in
+    the serial version.
+    \param nthreads the number of threads,
+    \param nf the number of forward rows,
+    \param fptr, find, fval the forward index; fval may be NULL,
+    \param nr the number of reverse rows,
+    \param rptr, rind, rval the reverse index, with rptr zeroed.
  */
-/*************************************************************************/
-char da_csr_isClutoOrCsr(const char* const file)
+/**************************************************************************/
+static void da_csr_ParTranspose(const int nthreads, const ssize_t nf, const ptr_t* const fptr,
+		const idx_t* const find, const val_t* const fval, const ssize_t nr, ptr_t* const rptr,
+		idx_t* const rind, val_t* const rval)
 {
-	size_t nrows, nnz;
+	ssize_t i;
+	ptr_t *toff;
 
-	da_getfilestats(file, &nrows, &nnz, NULL, NULL);
-	return (nnz%2 == 1) ? DA_FMT_CLUTO : DA_FMT_CSR;
+	toff = da_pnmalloc((size_t)nthreads * nr, "da_csr_ParTranspose: toff");
+
+	#pragma omp parallel num_threads(nthreads) private(i)
+	{
+		ssize_t j, f0, f1;
+		ptr_t off, cnt, *tptr;
+		int t;
+
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#else
+		t = 0;
+#endif
+		tptr = toff + (size_t)t * nr;
+		f0   = nf * t / nthreads;
+		f1   = nf * (t+1) / nthreads;
+
+		for (i=f0; i<f1; ++i)
+			for (j=fptr[i]; j<fptr[i+1]; ++j)
+				tptr[find[j]]++;
+		#pragma omp barrier
+
+		/* sizes of the reverse rows */
+		#pragma omp for schedule(static)
+		for (i=0; i<nr; ++i)
+			for (j=0; j<nthreads; ++j)
+				rptr[i+1] += toff[(size_t)j * nr + i];
+
+		#pragma omp single
+		for (i=0; i<nr; ++i)
+			rptr[i+1] += rptr[i];
+
+		/* start of the part of each thread in each reverse row */
+		#pragma omp for schedule(static)
+		for (i=0; i<nr; ++i) {
+			for (off=rptr[i], j=0; j<nthreads; ++j) {
+				cnt = toff[(size_t)j * nr + i];
+				toff[(size_t)j * nr + i] = off;
+				off += cnt;
+			}
+		}
+
+		for (i=f0; i<f1; ++i) {
+			for (j=fptr[i]; j<fptr[i+1]; ++j) {
+				off = tptr[find[j]]++;
+				rind[off] = i;
+				if (rval)
+					rval[off] = fval[j];
+			}
+		}
+	}
+
+	da_free((void **)&toff, LTERM);
 }
 
 
@@ -685,9 +2092,15 @@ char da_csr_isClutoOrCsr(const char* const file)
     The new columns are ordered in decreasing frequency.
 
     \param mat the matrix whose empty columns will be removed.
+    \param r_colmap if not NULL, receives the new id of each old column, or -1
+           if the column was removed. The array has the old number of columns.
+    \param r_idf if not NULL, receives the IDF of each new column, as returned
+           by da_csr_GetIdf, computed from the column counts of the compaction.
+    The output arrays are set as soon as they are allocated, so a caller that
+    recovers from da_errexit (see da_errjmp) can free them.
  */
 /**************************************************************************/
-void da_csr_CompactColumns(da_csr_t* const mat)
+void da_csr_CompactColumns(da_csr_t* const mat, idx_t** const r_colmap, double** const r_idf)
 {
 	ssize_t i;
 	idx_t nrows, ncols, nncols;
@@ -700,16 +2113,20 @@ void da_csr_CompactColumns(da_csr_t* const mat)
 	rowptr = mat->rowptr;
 	rowind = mat->rowind;
 
-	colmap = da_imalloc(ncols, "da_csr_CompactColumns: colmap");
+	/* colmap holds the column counts until it is filled */
+	colmap = da_inmalloc(ncols, "da_csr_CompactColumns: colmap");
+	if (r_colmap)
+		*r_colmap = colmap;
+	if (r_idf)
+		*r_idf = da_dmalloc(da_max(ncols, 1), "da_csr_CompactColumns: idf");
+	da_csr_CountColumns(rowind, rowptr[nrows], ncols, colmap);
 
 	clens = da_iikvmalloc(ncols, "da_csr_CompactColumns: clens");
 	for (i=0; i<ncols; ++i) {
 		clens[i].key = i;
-		clens[i].val = 0;
+		clens[i].val = colmap[i];
+		colmap[i]    = -1;
 	}
-
-	for (i=0; i<rowptr[nrows]; ++i)
-		clens[rowind[i]].val++;
 	da_iikvsortd(ncols, clens);
 
 	for (nncols=0, i=0; i<ncols; ++i) {
@@ -719,12 +2136,62 @@ void da_csr_CompactColumns(da_csr_t* const mat)
 			break;
 	}
 
+	#pragma omp parallel for private(i) schedule(static) if(rowptr[nrows] > DA_PARNNZ)
 	for (i=0; i<rowptr[nrows]; ++i)
 		rowind[i] = colmap[rowind[i]];
 
 	mat->ncols = nncols;
 
-	da_free((void **)&colmap, &clens, LTERM);
+	if (r_idf) {
+		for (i=0; i<nncols; ++i)
+			(*r_idf)[i] = log(1.0*nrows/clens[i].val);
+	}
+
+	if (!r_colmap)
+		da_free((void **)&colmap, LTERM);
+	da_free((void **)&clens, LTERM);
+}
+
+
+/*************************************************************************/
+/*! Renumbers the columns of a matrix given a column mapping, e.g., the one
+    obtained when compacting the columns of another matrix, such that both
+    matrices share the same column space. Entries in columns that have no
+    mapping are removed. Only the row-based representation is changed.
+
+    \param mat the matrix whose columns will be renumbered.
+    \param colmap the new id of each column, or -1 for columns to be removed.
+    \param ncols the number of columns in colmap.
+    \param nncols the number of columns after the mapping.
+ */
+/**************************************************************************/
+void da_csr_MapColumns(da_csr_t* const mat, const idx_t* const colmap,
+        const idx_t ncols, const idx_t nncols)
+{
+	ssize_t i, j, nnz;
+	ptr_t *rowptr;
+	idx_t *rowind;
+	val_t *rowval;
+
+	if (mat->colptr)
+		da_csr_FreeBase(mat, DA_COL);
+	rowptr = mat->rowptr;
+	rowind = mat->rowind;
+	rowval = mat->rowval;
+
+	for (nnz=0, j=0, i=0; i<mat->nrows; ++i) {
+		for (; j<rowptr[i+1]; ++j) {
+			if (rowind[j] < ncols && colmap[rowind[j]] >= 0) {
+				rowind[nnz] = colmap[rowind[j]];
+				if (rowval)
+					rowval[nnz] = rowval[j];
+				nnz++;
+			}
+		}
+		rowptr[i+1] = nnz;
+	}
+
+	mat->ncols = nncols;
 }
 
 /*************************************************************************/
@@ -753,6 +2220,7 @@ void da_csr_CompactRows(da_csr_t* const mat)
 
     rowptr[j+1] = rowptr[nrows];
     mat->nrows = j;
+    da_csr_Detach(mat);
     mat->rowptr = da_prealloc(mat->rowptr, j+1, "da_csr_CompactRows: mat->rowptr realloc");
 }
 
@@ -797,55 +2265,76 @@ void da_csr_SortIndices(da_csr_t* const mat, const char what)
 		return;
 	}
 
-    ssize_t i, j, k;
-    da_pikv_t *cand;
-    val_t *tval = NULL;
+    ssize_t i;
+    int nthreads;
+    da_pikv_t *tcand;
+    val_t *ttval = NULL;
 
     for (i=0; i<n; ++i)
         nn = da_max(nn, ptr[i+1]-ptr[i]);
 
-    cand = da_pikvmalloc(nn, "da_csr_SortIndices: cand");
-    if(val){
-        tval = da_vmalloc(nn, "da_csr_SortIndices: tval");
+    /* rows are sorted independently; each thread has its own sort space. The keys and values
+       share one allocation, so a failed allocation leaves nothing to free. */
+    nthreads = da_csr_NThreads(ptr[n]);
+    tcand = (da_pikv_t *)da_malloc((size_t)nthreads * nn * (sizeof(da_pikv_t) +
+            (val ? sizeof(val_t) : 0)), "da_csr_SortIndices: cand");
+    if (val)
+        ttval = (val_t *)(tcand + (size_t)nthreads * nn);
+
+    #pragma omp parallel num_threads(nthreads) private(i)
+    {
+        ssize_t j, k;
+        da_pikv_t *cand = tcand;
+        val_t *tval = ttval;
+
+#ifdef _OPENMP
+        cand += (size_t)nn * omp_get_thread_num();
+        if (tval)
+            tval += (size_t)nn * omp_get_thread_num();
+#endif
 
-        for (i=0; i<n; ++i) {
-            for (k=0, j=ptr[i]; j<ptr[i+1]; ++j) {
-                if (j > ptr[i] && ind[j] < ind[j-1]){
-                    k = 1; /* an inversion */
+        if (val) {
+            #pragma omp for schedule(dynamic, 1024)
+            for (i=0; i<n; ++i) {
+                for (k=0, j=ptr[i]; j<ptr[i+1]; ++j) {
+                    if (j > ptr[i] && ind[j] < ind[j-1]){
+                        k = 1; /* an inversion */
+                    }
+                    cand[j-ptr[i]].key = j-ptr[i];
+                    cand[j-ptr[i]].val = ind[j];
+                    tval[j-ptr[i]]     = val[j];
                 }
-                cand[j-ptr[i]].key = j-ptr[i];
-                cand[j-ptr[i]].val = ind[j];
-                tval[j-ptr[i]]     = val[j];
-            }
-            if (k) {
-                da_pikvsorti(ptr[i+1]-ptr[i], cand);
-                for (j=ptr[i]; j<ptr[i+1]; ++j) {
-                    ind[j] = cand[j-ptr[i]].val;
-                    val[j] = tval[cand[j-ptr[i]].key];
+                if (k) {
+                    da_pikvsorti(ptr[i+1]-ptr[i], cand);
+                    for (j=ptr[i]; j<ptr[i+1]; ++j) {
+                        ind[j] = cand[j-ptr[i]].val;
+                        val[j] = tval[cand[j-ptr[i]].key];
+                    }
                 }
             }
-        }
 
-    } else {
+        } else {
 
-        for (i=0; i<n; ++i) {
-            for (k=0, j=ptr[i]; j<ptr[i+1]; ++j) {
-                if (j > ptr[i] && ind[j] < ind[j-1]){
-                    k = 1; /* an inversion */
+            #pragma omp for schedule(dynamic, 1024)
+            for (i=0; i<n; ++i) {
+                for (k=0, j=ptr[i]; j<ptr[i+1]; ++j) {
+                    if (j > ptr[i] && ind[j] < ind[j-1]){
+                        k = 1; /* an inversion */
+                    }
+                    cand[j-ptr[i]].key = j-ptr[i];
+                    cand[j-ptr[i]].val = ind[j];
                 }
-                cand[j-ptr[i]].key = j-ptr[i];
-                cand[j-ptr[i]].val = ind[j];
-            }
-            if (k) {
-                da_pikvsorti(ptr[i+1]-ptr[i], cand);
-                for (j=ptr[i]; j<ptr[i+1]; ++j){
-                    ind[j] = cand[j-ptr[i]].val;
+                if (k) {
+                    da_pikvsorti(ptr[i+1]-ptr[i], cand);
+                    for (j=ptr[i]; j<ptr[i+1]; ++j){
+                        ind[j] = cand[j-ptr[i]].val;
+                    }
                 }
             }
-        }
 
+        }
     }
-    da_free((void **)&cand, &tval, LTERM);
+    da_free((void **)&tcand, LTERM);
 
 
 }
@@ -1051,6 +2540,7 @@ void da_csr_CreateIndex(da_csr_t* const mat, const char what)
 {
 	/* 'f' stands for forward, 'r' stands for reverse */
 	ssize_t i, j, k, nf, nr;
+	int nthreads;
 	ptr_t *fptr, *rptr;
 	idx_t *find, *rind;
 	val_t *fval, *rval;
@@ -1062,9 +2552,7 @@ void da_csr_CreateIndex(da_csr_t* const mat, const char what)
 		find = mat->rowind;
 		fval = mat->rowval;
 
-		if (mat->colptr) da_free((void **)&mat->colptr, LTERM);
-		if (mat->colind) da_free((void **)&mat->colind, LTERM);
-		if (mat->colval) da_free((void **)&mat->colval, LTERM);
+		da_csr_FreeArrays(mat, (void **)&mat->colptr, &mat->colind, &mat->colval, LTERM);
 
 		nr   = mat->ncols;
 		rptr = mat->colptr = da_pnmalloc(nr+1, "da_csr_CreateIndex: rptr");
@@ -1077,9 +2565,7 @@ void da_csr_CreateIndex(da_csr_t* const mat, const char what)
 		find = mat->colind;
 		fval = mat->colval;
 
-		if (mat->rowptr) da_free((void **)&mat->rowptr, LTERM);
-		if (mat->rowind) da_free((void **)&mat->rowind, LTERM);
-		if (mat->rowval) da_free((void **)&mat->rowval, LTERM);
+		da_csr_FreeArrays(mat, (void **)&mat->rowptr, &mat->rowind, &mat->rowval, LTERM);
 
 		nr   = mat->nrows;
 		rptr = mat->rowptr = da_pnmalloc(nr+1, "da_csr_CreateIndex: rptr");
@@ -1091,6 +2577,12 @@ void da_csr_CreateIndex(da_csr_t* const mat, const char what)
 		return;
 	}
 
+	/* per-thread offsets may not take more space than the ids they place */
+	nthreads = da_max(1, da_min(da_csr_NThreads(fptr[nf]), fptr[nf] / da_max(2*nr, 1)));
+	if (nthreads > 1) {
+		da_csr_ParTranspose(nthreads, nf, fptr, find, fval, nr, rptr, rind, rval);
+		return;
+	}
 
 	for (i=0; i<nf; ++i) {
 		for (j=fptr[i]; j<fptr[i+1]; ++j)
@@ -1157,9 +2649,7 @@ void da_csr_CreateIndex_a(da_csr_t* const mat, const char what)
         find = mat->rowind;
         fval = mat->rowval;
 
-        if (mat->colptr) da_free((void **)&mat->colptr, LTERM);
-        if (mat->colind) da_free((void **)&mat->colind, LTERM);
-        if (mat->colval) da_free((void **)&mat->colval, LTERM);
+        da_csr_FreeArrays(mat, (void **)&mat->colptr, &mat->colind, &mat->colval, LTERM);
 
         nr   = mat->ncols;
         rptr = mat->colptr = da_pnmalloc_a(nr+1, "da_csr_CreateIndex: rptr");
@@ -1172,9 +2662,7 @@ void da_csr_CreateIndex_a(da_csr_t* const mat, const char what)
         find = mat->colind;
         fval = mat->colval;
 
-        if (mat->rowptr) da_free((void **)&mat->rowptr, LTERM);
-        if (mat->rowind) da_free((void **)&mat->rowind, LTERM);
-        if (mat->rowval) da_free((void **)&mat->rowval, LTERM);
+        da_csr_FreeArrays(mat, (void **)&mat->rowptr, &mat->rowind, &mat->rowval, LTERM);
 
         nr   = mat->nrows;
         rptr = mat->rowptr = da_pnmalloc_a(nr+1, "da_csr_CreateIndex: rptr");
@@ -1239,6 +2727,7 @@ void da_csr_Normalize(da_csr_t* const mat, const char what, const char norm)
 		ptr = mat->rowptr;
 		val = mat->rowval;
 
+        #pragma omp parallel for private(i, j, sum) schedule(dynamic, 1024) if(ptr[n] > DA_PARNNZ)
         for (i=0; i<n; ++i) {
             for (sum=0.0, j=ptr[i]; j<ptr[i+1]; ++j){
                 if (norm == 2)
@@ -1263,6 +2752,7 @@ void da_csr_Normalize(da_csr_t* const mat, const char what, const char norm)
 		ptr = mat->colptr;
 		val = mat->colval;
 
+		#pragma omp parallel for private(i, j, sum) schedule(dynamic, 1024) if(ptr[n] > DA_PARNNZ)
 		for (i=0; i<n; ++i) {
 			for (sum=0.0, j=ptr[i]; j<ptr[i+1]; ++j)
 				if (norm == 2)
@@ -1289,121 +2779,493 @@ void da_csr_Normalize(da_csr_t* const mat, const char what, const char norm)
  */
 /**************************************************************************/
 void da_csr_Scale(da_csr_t* const mat)
+{
+	double *cscale;
+
+    cscale = da_csr_GetIdf(mat);
+    da_csr_ScaleColumns(mat, cscale);
+    da_free((void **)&cscale, LTERM);
+
+}
+
+
+/*************************************************************************/
+/*! Computes the IDF of the columns of a matrix
+    \param mat the matrix itself,
+    \returns the IDF of each column, 0 for empty columns.
+ */
+/**************************************************************************/
+double* da_csr_GetIdf(const da_csr_t* const mat)
 {
 	ssize_t i, j;
-	idx_t nrows, ncols, nnzcols, bgfreq;
+	idx_t nrows, ncols;
 	ptr_t *rowptr;
 	idx_t *rowind, *collen;
-	val_t *rowval;
-	double *cscale, maxtf;
+	double *cscale;
 
 	nrows  = mat->nrows;
     ncols  = mat->ncols;
 	rowptr = mat->rowptr;
 	rowind = mat->rowind;
-	rowval = mat->rowval;
 
-    cscale = da_dmalloc(ncols, "da_csr_Scale: cscale");
-    collen = da_inmalloc(ncols, "da_csr_Scale: collen");
+    cscale = da_dmalloc(ncols, "da_csr_GetIdf: cscale");
+    collen = da_inmalloc(ncols, "da_csr_GetIdf: collen");
 
-    for (i=0; i<nrows; ++i) {
-        for (j=rowptr[i]; j<rowptr[i+1]; ++j)
-            collen[rowind[j]]++;
-    }
+    da_csr_CountColumns(rowind, rowptr[nrows], ncols, collen);
 
     for (i=0; i<ncols; ++i)
         cscale[i] = (collen[i] > 0 ? log(1.0*nrows/collen[i]) : 0.0);
 
-    for (i=0; i<nrows; ++i) {
+    da_free((void **)&collen, LTERM);
+
+    return cscale;
+}
+
+
+/*************************************************************************/
+/*! Scales the values of each column of a matrix
+    \param mat the matrix itself,
+    \param cscale the scaling factor of each column, e.g., its IDF,
+ */
+/**************************************************************************/
+void da_csr_ScaleColumns(da_csr_t* const mat, const double* const cscale)
+{
+	ssize_t i, j;
+	ptr_t *rowptr;
+	idx_t *rowind;
+	val_t *rowval;
+
+	rowptr = mat->rowptr;
+	rowind = mat->rowind;
+	rowval = mat->rowval;
+
+    #pragma omp parallel for private(i, j) schedule(dynamic, 1024) if(rowptr[mat->nrows] > DA_PARNNZ)
+    for (i=0; i<mat->nrows; ++i) {
         for (j=rowptr[i]; j<rowptr[i+1]; ++j)
             rowval[j] *= cscale[rowind[j]];
     }
+}
+
+
+/*************************************************************************/
+/*! Scales the values of each column of a matrix and normalizes its rows to
+    unit 2-norm, with the same result as da_csr_ScaleColumns followed by
+    da_csr_Normalize. Each row is scaled and normalized while it is in cache,
+    so rowval is read and written once instead of twice each.
+    \param mat the matrix itself,
+    \param cscale the scaling factor of each column, e.g., its IDF,
+ */
+/**************************************************************************/
+void da_csr_ScaleNormalize(da_csr_t* const mat, const double* const cscale)
+{
+	ssize_t i, j;
+	ptr_t *rowptr;
+	idx_t *rowind;
+	val_t *rowval, v;
+	double sum;
 
-    da_free((void **)&cscale, &collen, LTERM);
+	rowptr = mat->rowptr;
+	rowind = mat->rowind;
+	rowval = mat->rowval;
 
+    #pragma omp parallel for private(i, j, v, sum) schedule(dynamic, 1024) if(rowptr[mat->nrows] > DA_PARNNZ)
+    for (i=0; i<mat->nrows; ++i) {
+        /* scaled values are rounded to val_t before use, as when they are stored */
+        for (sum=0.0, j=rowptr[i]; j<rowptr[i+1]; ++j) {
+            v = rowval[j] * cscale[rowind[j]];
+            sum += v*v;
+        }
+        sum = (sum > 0 ? 1.0/sqrt(sum) : 1.0);
+        for (j=rowptr[i]; j<rowptr[i+1]; ++j) {
+            v = rowval[j] * cscale[rowind[j]];
+            rowval[j] = v * sum;
+        }
+    }
 }
 
 
 
 /*************************************************************************/
-/*! Computes the cosine similarity between two rows/columns
+/*! Encodes a block of n increasing row ids (see da_cidx_t). The bit width
+    of the gaps is the one that minimizes the size of the block, counting
+    5 bytes for each exception.
+    \param ids are the row ids of the block.
+    \param n is the number of ids, between 1 and DA_CIDX_BLOCK.
+    \param s is where the block is written, or NULL to only compute its size.
+    \returns the size of the block, in bytes.
+ */
+/**************************************************************************/
+static size_t da_cidx_EncodeBlock(const idx_t* const ids, const idx_t n, unsigned char* s)
+{
+    idx_t i, m, b, bl, best, nexc, cnt[33];
+    size_t sz, bestsz;
+    uint32_t g, h;
+    uint64_t acc;
+    unsigned char *pos, *exc;
+    int nb;
+
+    /* histogram of the bit lengths of the gaps */
+    m = n - 1;
+    memset(cnt, 0, sizeof(cnt));
+    for (i=0; i<m; i++) {
+        g = ids[i+1] - ids[i] - 1;
+        for (bl=0; g; g>>=1)
+            bl++;
+        cnt[bl]++;
+    }
+    for (best=32, bestsz=SIZE_MAX, nexc=0, b=32; b>=0; nexc+=cnt[b], b--) {
+        sz = (m*(size_t)b + 7) / 8 + 5*(size_t)nexc;
+        if (sz <= bestsz) {
+            best   = b;
+            bestsz = sz;
+        }
+    }
+    if (!s)
+        return 6 + bestsz;
+
+    b = best;
+    for (nexc=0, bl=b+1; bl<=32; bl++)
+        nexc += cnt[bl];
+    memcpy(s, &ids[0], 4);
+    s[4] = (unsigned char)b;
+    s[5] = (unsigned char)nexc;
+    pos  = s + 6;
+    exc  = pos + nexc;
+    s    = exc + 4*nexc;
+    for (acc=0, nb=0, i=0; i<m; i++) {
+        g = ids[i+1] - ids[i] - 1;
+        if (b < 32 && (g >> b)) {
+            h = g >> b;
+            *pos++ = (unsigned char)i;
+            memcpy(exc, &h, 4);
+            exc += 4;
+        }
+        acc |= (uint64_t)(g & (uint32_t)((1ULL << b) - 1)) << nb;
+        for (nb += b; nb >= 8; nb -= 8, acc >>= 8)
+            *s++ = (unsigned char)acc;
+    }
+    if (nb > 0)
+        *s++ = (unsigned char)acc;
 
-    \param mat the matrix itself. The routine assumes that the indices
-           are sorted in increasing order.
-    \param r1 is the first row/column,
-    \param r2 is the second row/column,
-    \param what is either DA_ROW or DA_COL indicating the type of
-           objects between the similarity will be computed,
-    \returns the similarity between the two rows/columns.
+    return 6 + bestsz;
+}
+
+
+/*************************************************************************/
+/*! Creates a compressed copy of the row ids of the column index of a
+    matrix (see da_cidx_t). The ids must be in increasing order within each
+    column, as da_csr_CreateIndex leaves them. Columns are encoded in
+    parallel.
+    \param mat is the matrix, which must have a column index.
+    \returns the compressed ids.
  */
 /**************************************************************************/
-val_t da_csr_ComputeSimilarity(const da_csr_t* const mat,
-		const idx_t rc1, const idx_t rc2, const char what)
+da_cidx_t* da_cidx_Create(const da_csr_t* const mat)
 {
-	idx_t nind1, nind2, i1, i2;
-	idx_t *ind1, *ind2;
-	val_t *val1, *val2, stat1, stat2, sim;
+    ssize_t i;
+    idx_t ncols;
+    ptr_t *colptr;
+    idx_t *colind;
+    da_cidx_t *cidx;
+
+    if (!mat->colptr)
+        da_errexit("da_cidx_Create: The matrix has no column index.\n");
+    ncols  = mat->ncols;
+    colptr = mat->colptr;
+    colind = mat->colind;
+
+    cidx = (da_cidx_t *)da_malloc(sizeof(da_cidx_t), "da_cidx_Create: cidx");
+    cidx->ncols = ncols;
+    cidx->cbyte = (size_t *)da_malloc((ncols+1) * sizeof(size_t), "da_cidx_Create: cbyte");
+
+    /* sizes of the columns */
+    #pragma omp parallel for private(i) schedule(dynamic, 256)
+    for (i=0; i<ncols; i++) {
+        ptr_t j;
+        size_t sz;
+        for (sz=0, j=colptr[i]; j<colptr[i+1]; j+=DA_CIDX_BLOCK)
+            sz += da_cidx_EncodeBlock(colind+j, da_min(DA_CIDX_BLOCK, colptr[i+1]-j), NULL);
+        cidx->cbyte[i+1] = sz;
+    }
+    cidx->cbyte[0] = 0;
+    for (i=0; i<ncols; i++)
+        cidx->cbyte[i+1] += cidx->cbyte[i];
+    cidx->size = cidx->cbyte[ncols];
+
+    /* blocks; the padding allows decoders to read 8 bytes at any position */
+    cidx->data = (unsigned char *)da_malloc(cidx->size + 8, "da_cidx_Create: data");
+    memset(cidx->data + cidx->size, 0, 8);
+    #pragma omp parallel for private(i) schedule(dynamic, 256)
+    for (i=0; i<ncols; i++) {
+        ptr_t j;
+        unsigned char *s = cidx->data + cidx->cbyte[i];
+        for (j=colptr[i]; j<colptr[i+1]; j+=DA_CIDX_BLOCK)
+            s += da_cidx_EncodeBlock(colind+j, da_min(DA_CIDX_BLOCK, colptr[i+1]-j), s);
+    }
 
-	switch (what) {
-	case DA_ROW:
-		if (!mat->rowptr)
-			da_errexit( "Row-based view of the matrix does not exists.\n");
-		nind1 = mat->rowptr[rc1+1]-mat->rowptr[rc1];
-		nind2 = mat->rowptr[rc2+1]-mat->rowptr[rc2];
-		ind1  = mat->rowind + mat->rowptr[rc1];
-		ind2  = mat->rowind + mat->rowptr[rc2];
-		val1  = mat->rowval + mat->rowptr[rc1];
-		val2  = mat->rowval + mat->rowptr[rc2];
-		break;
+    return cidx;
+}
 
-	case DA_COL:
-		if (!mat->colptr)
-			da_errexit( "Column-based view of the matrix does not exists.\n");
-		nind1 = mat->colptr[rc1+1]-mat->colptr[rc1];
-		nind2 = mat->colptr[rc2+1]-mat->colptr[rc2];
-		ind1  = mat->colind + mat->colptr[rc1];
-		ind2  = mat->colind + mat->colptr[rc2];
-		val1  = mat->colval + mat->colptr[rc1];
-		val2  = mat->colval + mat->colptr[rc2];
-		break;
 
-	default:
-		da_errexit( "Invalid index type of %d.\n", what);
-		return 0.0;
-	}
+/*************************************************************************/
+/*! Frees a compressed column index and sets the pointer to NULL. */
+/**************************************************************************/
+void da_cidx_Free(da_cidx_t** const cidx)
+{
+    if (*cidx == NULL)
+        return;
+    da_free((void **)&(*cidx)->cbyte, &(*cidx)->data, LTERM);
+    da_free((void **)cidx, LTERM);
+}
 
 
-    sim = stat1 = stat2 = 0.0;
-    i1 = i2 = 0;
-    while (i1<nind1 && i2<nind2) {
-        if (i1 == nind1) {
-            stat2 += val2[i2]*val2[i2];
-            i2++;
-        }
-        else if (i2 == nind2) {
-            stat1 += val1[i1]*val1[i1];
-            i1++;
-        }
-        else if (ind1[i1] < ind2[i2]) {
-            stat1 += val1[i1]*val1[i1];
-            i1++;
+/*************************************************************************/
+/*! Decodes a block of row ids of a compressed column index (see da_cidx_t).
+    \param s is the start of the block.
+    \param n is the number of ids in the block.
+    \param ids is an array of at least n elements that will hold the ids.
+    \returns the start of the next block.
+ */
+/**************************************************************************/
+const unsigned char* da_cidx_Decode(const unsigned char* s, const idx_t n, idx_t* const ids)
+{
+    idx_t l;
+    uint32_t id, b, nexc, e, h;
+    uint64_t w, mask, bit;
+    const unsigned char *pos, *exc;
+
+    memcpy(&id, s, 4);
+    b     = s[4];
+    nexc  = s[5];
+    pos   = s + 6;
+    exc   = pos + nexc;
+    s     = exc + 4*nexc;
+    mask  = (1ULL << b) - 1;
+
+    /* unpack the gaps; the padding of the data allows reading 8 bytes at any position */
+    for (bit=0, l=1; l<n; l++, bit+=b) {
+        memcpy(&w, s + (bit >> 3), 8);
+        ids[l] = (idx_t)((w >> (bit & 7)) & mask);
+    }
+    /* patch exceptions and sum up the gaps */
+    for (e=0; e<nexc; e++) {
+        memcpy(&h, exc + 4*e, 4);
+        ids[pos[e]+1] += (idx_t)(h << b);
+    }
+    ids[0] = id;
+    for (l=1; l<n; l++)
+        ids[l] += ids[l-1] + 1;
+
+    return s + ((n-1)*(size_t)b + 7) / 8;
+}
+
+
+/*************************************************************************/
+/*! Creates quantized copies of the values of the column index of a matrix
+    (see da_qidx_t). The step of each column is its largest value divided by
+    the largest nbits integer, and each value is rounded to the nearest step.
+    \param mat is the matrix, which must have a column index with values.
+    \param nbits is the number of bits of each quantized value, 8 or 16.
+    \returns the quantized values.
+ */
+/**************************************************************************/
+da_qidx_t* da_qidx_Create(const da_csr_t* const mat, const char nbits)
+{
+    ssize_t i;
+    idx_t ncols;
+    ptr_t nnz, *colptr;
+    val_t *colval;
+    da_qidx_t *qidx;
+
+    if (!mat->colptr || !mat->colval)
+        da_errexit("da_qidx_Create: The matrix has no column index values.\n");
+    if (nbits != 8 && nbits != 16)
+        da_errexit("da_qidx_Create: Invalid number of bits %d.\n", nbits);
+    ncols  = mat->ncols;
+    colptr = mat->colptr;
+    colval = mat->colval;
+    nnz    = colptr[ncols];
+
+    qidx = (da_qidx_t *)da_malloc(sizeof(da_qidx_t), "da_qidx_Create: qidx");
+    qidx->ncols = ncols;
+    qidx->nbits = nbits;
+    qidx->cstep = da_vmalloc(ncols, "da_qidx_Create: cstep");
+    qidx->val8  = (nbits == 8 ? (uint8_t *)da_malloc(nnz+1, "da_qidx_Create: val8") : NULL);
+    qidx->val16 = (nbits == 16 ? (uint16_t *)da_malloc((nnz+1) * sizeof(uint16_t), "da_qidx_Create: val16") : NULL);
+
+    #pragma omp parallel for private(i) schedule(dynamic, 256)
+    for (i=0; i<ncols; i++) {
+        ptr_t j;
+        val_t max, step, q;
+        for (max=0.0, j=colptr[i]; j<colptr[i+1]; j++)
+            if (colval[j] > max)
+                max = colval[j];
+        step = max / ((1 << nbits) - 1);
+        qidx->cstep[i] = step;
+        for (j=colptr[i]; j<colptr[i+1]; j++) {
+            q = (step > 0.0 ? nearbyintf(colval[j] / step) : 0.0);
+            q = da_max(q, 0.0);
+            q = da_min(q, (val_t)((1 << nbits) - 1));
+            if (nbits == 8)
+                qidx->val8[j] = (uint8_t)q;
+            else
+                qidx->val16[j] = (uint16_t)q;
         }
-        else if (ind1[i1] > ind2[i2]) {
-            stat2 += val2[i2]*val2[i2];
-            i2++;
+    }
+
+    return qidx;
+}
+
+
+/*************************************************************************/
+/*! Frees quantized column index values and sets the pointer to NULL. */
+/**************************************************************************/
+void da_qidx_Free(da_qidx_t** const qidx)
+{
+    if (*qidx == NULL)
+        return;
+    da_free((void **)&(*qidx)->cstep, &(*qidx)->val8, &(*qidx)->val16, LTERM);
+    da_free((void **)qidx, LTERM);
+}
+
+
+/*************************************************************************/
+/*! Computes the dot product of two sparse vectors with sorted indices.
+    When compiled with SSE4.1, AVX2, or AVX-512 support, blocks of 4, 8, or 16
+    indices of the first vector are compared at once against each index in an
+    equally sized block of the second vector, and the block whose last index is
+    smallest is skipped. The remainder of the lists is merged serially.
+
+    \param n1 is the number of non-zeros in the first vector,
+    \param ind1 are the sorted indices of the first vector,
+    \param val1 are the values of the first vector,
+    \param n2 is the number of non-zeros in the second vector,
+    \param ind2 are the sorted indices of the second vector,
+    \param val2 are the values of the second vector,
+    \returns the dot product of the two vectors.
+ */
+/**************************************************************************/
+val_t da_sdot(const idx_t n1, const idx_t* const ind1, const val_t* const val1,
+        const idx_t n2, const idx_t* const ind2, const val_t* const val2)
+{
+    idx_t i1, i2;
+    val_t sim;
+
+    sim = 0.0;
+    i1 = i2 = 0;
+
+#if defined(DA_SDOT_WIDTH)
+    {
+        idx_t j, a, b;
+        unsigned int m;
+        DA_SDOT_VEC va;
+
+        while (i1+DA_SDOT_WIDTH <= n1 && i2+DA_SDOT_WIDTH <= n2) {
+            va = DA_SDOT_LOAD(ind1+i1);
+            b  = ind2[i2+DA_SDOT_WIDTH-1];
+            a  = ind1[i1+DA_SDOT_WIDTH-1];
+            for (j=0; j<DA_SDOT_WIDTH; j++) {
+                if (ind2[i2+j] > a)
+                    break;
+                if ((m = DA_SDOT_CMPEQ(va, ind2[i2+j])) != 0)
+                    sim += val1[i1+__builtin_ctz(m)]*val2[i2+j];
+            }
+            if (a <= b)
+                i1 += DA_SDOT_WIDTH;
+            if (b <= a)
+                i2 += DA_SDOT_WIDTH;
         }
-        else {
-            sim   += val1[i1]*val2[i2];
-            stat1 += val1[i1]*val1[i1];
-            stat2 += val2[i2]*val2[i2];
+    }
+#endif
+
+    while (i1<n1 && i2<n2) {
+        if (ind1[i1] < ind2[i2])
             i1++;
+        else if (ind1[i1] > ind2[i2])
             i2++;
-        }
+        else
+            sim += val1[i1++]*val2[i2++];
+    }
+
+    return sim;
+}
+
+
+/*************************************************************************/
+/*! Computes the dot product between two rows/columns. For matrices whose
+    rows/columns have been normalized (see da_csr_Normalize), this is their
+    cosine similarity, computed without any norm work. This is the primitive
+    search methods should use to verify candidates.
+
+    \param mat the matrix itself. The routine assumes that the indices
+           are sorted in increasing order.
+    \param rc1 is the first row/column,
+    \param rc2 is the second row/column,
+    \param what is either DA_ROW or DA_COL indicating the type of
+           objects between the dot product will be computed,
+    \returns the dot product of the two rows/columns.
+ */
+/**************************************************************************/
+val_t da_csr_ComputeDot(const da_csr_t* const mat,
+        const idx_t rc1, const idx_t rc2, const char what)
+{
+    switch (what) {
+    case DA_ROW:
+        if (!mat->rowptr)
+            da_errexit( "Row-based view of the matrix does not exists.\n");
+        return da_sdot(mat->rowptr[rc1+1]-mat->rowptr[rc1],
+                mat->rowind + mat->rowptr[rc1], mat->rowval + mat->rowptr[rc1],
+                mat->rowptr[rc2+1]-mat->rowptr[rc2],
+                mat->rowind + mat->rowptr[rc2], mat->rowval + mat->rowptr[rc2]);
+
+    case DA_COL:
+        if (!mat->colptr)
+            da_errexit( "Column-based view of the matrix does not exists.\n");
+        return da_sdot(mat->colptr[rc1+1]-mat->colptr[rc1],
+                mat->colind + mat->colptr[rc1], mat->colval + mat->colptr[rc1],
+                mat->colptr[rc2+1]-mat->colptr[rc2],
+                mat->colind + mat->colptr[rc2], mat->colval + mat->colptr[rc2]);
+
+    default:
+        da_errexit( "Invalid index type of %d.\n", what);
     }
-    sim = (stat1*stat2 > 0.0 ? sim/sqrt(stat1*stat2) : 0.0);
 
-	return sim;
+    return 0.0;
+}
+
+
+/*************************************************************************/
+/*! Computes the cosine similarity between two rows/columns
+
+    \param mat the matrix itself. The routine assumes that the indices
+           are sorted in increasing order.
+    \param rc1 is the first row/column,
+    \param rc2 is the second row/column,
+    \param what is either DA_ROW or DA_COL indicating the type of
+           objects between the similarity will be computed,
+    \param normalized indicates that rows/columns have unit length, in which
+           case the norm computation is skipped,
+    \returns the similarity between the two rows/columns.
+ */
+/**************************************************************************/
+val_t da_csr_ComputeSimilarity(const da_csr_t* const mat,
+		const idx_t rc1, const idx_t rc2, const char what, const char normalized)
+{
+	ptr_t j, *ptr;
+	val_t *val, stat1, stat2, sim;
+
+	sim = da_csr_ComputeDot(mat, rc1, rc2, what);
+	if (normalized)
+		return sim;
+
+	ptr = (what == DA_ROW ? mat->rowptr : mat->colptr);
+	val = (what == DA_ROW ? mat->rowval : mat->colval);
+	for (stat1=0.0, j=ptr[rc1]; j<ptr[rc1+1]; j++)
+		stat1 += val[j]*val[j];
+	for (stat2=0.0, j=ptr[rc2]; j<ptr[rc2+1]; j++)
+		stat2 += val[j]*val[j];
 
+	return (stat1*stat2 > 0.0 ? sim/sqrt(stat1*stat2) : 0.0);
 }
 
 
@@ -1499,6 +3361,7 @@ char da_csr_Compare(const da_csr_t* const a, const da_csr_t* const b, const doub
  */
 void da_csr_Grow(da_csr_t* const mat, const ptr_t newNnz)
 {
+	da_csr_Detach(mat);
 	if(mat->rowind){
 		mat->rowind = da_irealloc(mat->rowind, newNnz, "da_csr_matrixNNzRealloc: mat->rowind");
 		if(mat->rowind == NULL)
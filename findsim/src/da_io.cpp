@@ -146,6 +146,52 @@ char* da_getpathname(const char* const path)
 
 
 
+/*************************************************************************/
+/*! Computes a 64-bit FNV-1a hash of the contents of a file, processed in
+    8-byte words for speed.
+    \param fname is the name of the file
+    \param seed is the initial hash value; 0 selects the FNV offset basis.
+           Callers can pass the hash of some other data to combine the two.
+    \returns the hash value. Exits if the file cannot be read.
+ */
+/*************************************************************************/
+uint64_t da_fhash(const char* const fname, uint64_t const seed)
+{
+    int fd;
+    size_t i, n;
+    uint64_t h, w;
+    struct stat st;
+    unsigned char *data;
+
+    h = (seed ? seed : 14695981039346656037ULL);
+
+    if ((fd = open(fname, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        da_errexit("da_fhash: Could not open file %s.\n", fname);
+    n = st.st_size;
+    if (n == 0) {
+        close(fd);
+        return h;
+    }
+    data = (unsigned char *)mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        da_errexit("da_fhash: Could not map file %s.\n", fname);
+    madvise(data, n, MADV_SEQUENTIAL);
+
+    for (i=0; i+8 <= n; i+=8) {
+        memcpy(&w, data+i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i<n; i++)
+        h = (h ^ data[i]) * 1099511628211ULL;
+    h = (h ^ n) * 1099511628211ULL;
+
+    munmap(data, n);
+
+    return h;
+}
+
+
 /*************************************************************************
  * This function creates a path
  **************************************************************************/
@@ -296,6 +342,33 @@ ssize_t da_read(const int fd, void* vbuf, const size_t count)
 
 
 
+/*************************************************************************/
+/*! This function is a wrapper around the write() function that ensures
+    that all data is written, by issuing multiple write requests.
+    \returns count, or -1 if an error occurred.
+ */
+/*************************************************************************/
+ssize_t da_write(const int fd, const void* vbuf, const size_t count)
+{
+    const char *buf = (const char *)vbuf;
+    ssize_t wsize;
+    size_t tsize=count;
+
+    while (tsize > 0) {
+        if ((wsize = write(fd, buf, tsize)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf   += wsize;
+        tsize -= wsize;
+    }
+
+    return count;
+}
+
+
+
 /*************************************************************************/
 /*! This function is the GKlib implementation of glibc's getline()
     function.
@@ -15,7 +15,14 @@
 #define VER_COMMENT         "initial version"
 
 /** General parameter definitions **/
-
+#define IJ_BLOCKSIZE        256  /* number of query rows a thread processes at a time in threaded IdxJoin */
+#define IJ_NLOCKS           1024 /* number of lock stripes guarding the top-k heaps in symmetric IdxJoin (power of 2) */
+#define IJ_TILEROWS         8192 /* number of candidate rows in a tile of tiled IdxJoin (accumulators stay L2-resident) */
+#define IJ_BATCHSIZE        16   /* number of queries whose posting lists are traversed together in batched IdxJoin */
+#define DA_CIDX_BLOCK       128  /* number of row ids in a block of the compressed column index */
+#define DA_QIDX_TOL         1e-5 /* slack added to quantized similarity bounds for float rounding */
+#define DA_WRITENNZ         (1<<18) /* nonzeros each thread formats per round when writing text matrices */
+#define DA_PARNNZ           (1<<16) /* minimum nonzeros for a preprocessing step to use several threads */
 
 
 
@@ -40,6 +47,7 @@ typedef unsigned int uint;
 #define CMD_MODE                10
 #define CMD_K                   22
 #define CMD_EPSILON             23
+#define CMD_NTHREADS            24
 #define CMD_FMT_WRITE           32
 #define CMD_FMT_WRITE_NUM       33
 #define CMD_WRITE_VALS          34
@@ -49,8 +57,21 @@ typedef unsigned int uint;
 #define CMD_READ_VALS           38
 #define CMD_READ_NUMBERING      39
 #define CMD_VERIFY              40
+#define CMD_CACHE               41
+#define CMD_CIDX                42
+#define CMD_QBITS               43
+#define CMD_MEMLIMIT            44
 #define CMD_STATS               45
+#define CMD_NSHARDS             46
+#define CMD_QUERYRANGE          47
+#define CMD_INDEXRANGE          48
+#define CMD_QUERY               49
 #define CMD_FLDELTA             50
+#define CMD_GRAPH               51
+#define CMD_APPEND              52
+#define CMD_IDFROWS             53
+#define CMD_REBUILD             54
+#define CMD_SOCKET              55
 #define CMD_VERBOSITY           105
 #define CMD_VERSION             109
 #define CMD_HELP                110
@@ -66,8 +87,19 @@ typedef unsigned int uint;
 #define MODE_IO                 98  /* Transform a matrix from some format into another */
 #define MODE_INFO               97  /* Find information about a matrix */
 #define MODE_RECALL             96  /* Compute recall given true solution */
+#define MODE_SHARD              95  /* Pre-process a matrix and split its rows into shards */
+#define MODE_MERGE              94  /* Merge partial neighbor graphs */
+#define MODE_UPDATE             93  /* Update a neighbor graph with appended rows */
+#define MODE_SERVE              92  /* Answer k-NN queries over a Unix domain socket */
 #define MODE_IDXJOIN            1   /* IdxJoin */
 #define MODE_INVERTED			2	/* Basic Inverted Index Approach */
+#define MODE_ALLPAIRS1          3   /* All-Pairs-1 (prefix filtering with max-weight bounds) */
+#define MODE_ALLPAIRS2          4   /* All-Pairs-2 (All-Pairs-1 with size filter and remscore pruning) */
+#define MODE_L2AP               5   /* L2AP (All-Pairs with prefix L2-norm bounds) */
+#define MODE_IDXJOINK           6   /* IdxJoin with k-NN-aware dynamic threshold raising */
+#define MODE_IDXJOINSYM         7   /* Symmetric IdxJoin (each pair computed once) */
+#define MODE_IDXJOINTILE        8   /* Cache-blocked (tiled) IdxJoin */
+#define MODE_IDXJOINBATCH       9   /* Batched multi-query (SpMM-style) IdxJoin */
 
 
 /* CSR structure components */
@@ -84,5 +116,27 @@ typedef unsigned int uint;
 #define DA_FMT_METIS        3
 #define DA_FMT_CLUTO        1
 #define DA_FMT_IJV          6
+#define DA_FMT_BINROW       4   /* binary, row structure */
+#define DA_FMT_BINCOL       5   /* binary, row structure and column index */
+#define DA_FMT_BINNBR       7   /* binary neighbor graph, fp32 values */
+#define DA_FMT_BINNBR16     8   /* binary neighbor graph, fp16 values */
+
+/* binary CSR format */
+#define DA_BIN_MAGIC        "DACSRBIN"
+#define DA_BIN_VERSION      2
+#define DA_BIN_ALIGN        64  /* alignment of the arrays in the file */
+#define DA_BIN_PREPROCESSED 1   /* flag: rows were scaled by IDF and normalized by preprocessInputData */
+
+/* binary neighbor graph format */
+#define DA_NBR_MAGIC        "DANBRBIN"
+#define DA_NBR_VERSION      1
+#define DA_NBR_VALORDER     1   /* flag: rows were in decreasing value order when written */
+
+/* serve mode response status codes */
+#define DA_SRV_OK           0
+#define DA_SRV_EINVAL       1   /* invalid query header or repeated column id; the connection is closed */
+
+/* preprocessed input cache */
+#define DA_CACHE_VERSION    1   /* change whenever preprocessInputData changes what it computes */
 
 #endif
@@ -0,0 +1,99 @@
+/*!
+ \file  findsim.h
+ \brief This file contains the public interface of libfindsim, which embeds the IdxJoin search
+ in other programs.
+
+ A context holds a matrix preprocessed as by the findsim program (empty columns removed, values
+ scaled by IDF, rows normalized) and its column index. It is created once by fs_build and is only
+ read by the search calls, so any number of threads may search the same context concurrently.
+ Each thread calling fs_search_row needs its own workspace. Results are written to buffers
+ provided by the caller. Functions report errors via their return code, never print, and never
+ terminate the process.
+
+ Row and column ids start at 0. Column ids refer to the columns of the matrix given to fs_build.
+ */
+#ifndef _FINDSIM_H_
+#define _FINDSIM_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Entry points; the library is built with hidden visibility, so they are its only exports */
+#if defined(__GNUC__)
+#define FS_API              __attribute__((visibility("default")))
+#else
+#define FS_API
+#endif
+
+/* Return codes */
+#define FS_OK               0
+#define FS_EINVAL           1   /* invalid argument */
+#define FS_ENOMEM           2   /* memory allocation failed */
+
+typedef struct fs_ctx_t fs_ctx_t;   /* preprocessed matrix and its column index */
+typedef struct fs_ws_t fs_ws_t;     /* search space of a thread */
+
+/**
+ * Create a context for a matrix in CSR format, which is copied.
+ * \param ctx Set to the new context
+ * \param nrows Number of rows
+ * \param ncols Number of columns
+ * \param rowptr Start of each row in rowind and rowval, nrows+1 values
+ * \param rowind Column ids of the non-zeros, in [0, ncols) and at most once in a row; otherwise
+ *      FS_EINVAL is returned
+ * \param rowval Values of the non-zeros, e.g., term frequencies
+ * \param nthreads Number of threads used by fs_search_all
+ */
+FS_API int fs_build(fs_ctx_t **ctx, int32_t nrows, int32_t ncols, const int64_t *rowptr,
+        const int32_t *rowind, const float *rowval, int32_t nthreads);
+
+/**
+ * Free a context and set it to NULL.
+ */
+FS_API void fs_free(fs_ctx_t **ctx);
+
+/**
+ * Create a workspace for searching a context, to be used by one thread at a time.
+ */
+FS_API int fs_ws_create(const fs_ctx_t *ctx, fs_ws_t **ws);
+
+/**
+ * Free a workspace and set it to NULL.
+ */
+FS_API void fs_ws_free(fs_ws_t **ws);
+
+/**
+ * Find the top-k rows of the context with at least eps similarity to a sparse vector, which is
+ * scaled by the IDF of the context and normalized. Columns no row has are ignored. Column ids
+ * must be valid and appear at most once; otherwise FS_EINVAL is returned.
+ * \param ids Set to the ids of the neighbors, in decreasing similarity order (k values)
+ * \param sims Set to the similarities of the neighbors (k values)
+ * \param n Set to the number of neighbors
+ */
+FS_API int fs_search_row(const fs_ctx_t *ctx, fs_ws_t *ws, int32_t nnz, const int32_t *ind,
+        const float *val, int32_t k, float eps, int32_t *ids, float *sims, int32_t *n);
+
+/**
+ * Find the top-k other rows with at least eps similarity to each row of the context, i.e.,
+ * the Min-eps K-Nearest Neighbor graph.
+ * \param ids Set to the ids of the neighbors of row i, in decreasing similarity order, starting
+ *      at ids[i*k] (nrows*k values)
+ * \param sims Set to the similarities of the neighbors, starting at sims[i*k] (nrows*k values)
+ * \param n Set to the number of neighbors of each row (nrows values)
+ */
+FS_API int fs_search_all(const fs_ctx_t *ctx, int32_t k, float eps, int32_t *ids, float *sims,
+        int32_t *n);
+
+/**
+ * Describe a return code.
+ */
+FS_API const char *fs_strerror(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,6 +6,27 @@
  sorting the results and retaining only results that should be part of the output (top-$k$ results
  with at least $\epsilon$ similarity).
 
+ In the k-NN-aware variant (MODE_IDXJOINK), query features are processed in decreasing weight
+ order while the $k$-th best partial similarity is tracked as a lower bound on the $k$-th best
+ final similarity. Once the remaining query features can no longer lift a new candidate to
+ max($\epsilon$, $k$-th best), no new candidates are admitted, and the surviving candidates are
+ completed in decreasing upper-bound order with exact dot products until their bound drops
+ below the running threshold.
+
+ In the symmetric variant (MODE_IDXJOINSYM), each query is only compared against rows with a
+ larger id, and each similar pair is offered to the top-$k$ heaps of both rows, such that every
+ dot product is computed once.
+
+ In the tiled variant (MODE_IDXJOINTILE), blocks of query rows are compared against tiles of
+ IJ_TILEROWS candidate rows at a time, such that the candidate accumulators and the posting list
+ slices of the tile stay cache-resident. Partial results from each tile are merged into the
+ per-row top-$k$ heaps.
+
+ In the batched variant (MODE_IDXJOINBATCH), IJ_BATCHSIZE queries are processed together. Their
+ features are grouped, and the posting list of each feature is traversed once, scattering into
+ the accumulators of all queries in the batch that contain the feature (a sparse matrix-matrix
+ product rather than many sparse matrix-vector products).
+
  \author David C. Anastasiu
  */
 
@@ -13,7 +34,19 @@
 
 // forward declarations
 idx_t da_getSimilarRows(da_csr_t *mat, idx_t rid, idx_t nsim, float eps,
-        da_ivkv_t *hits, da_ivkv_t *i_cand, idx_t *i_marker, idx_t *ncands);
+        da_ivkv_t *hits, da_ivkv_t *i_cand, idx_t *i_marker, idx_t *ncands, const da_cidx_t *cidx,
+        const da_qidx_t *qidx);
+idx_t da_getSimilarRowsKnn(da_csr_t *mat, idx_t rid, idx_t nsim, float eps, val_t *cmax,
+        da_ivkv_t *hits, da_ivkv_t *cand, idx_t *marker, val_t *qvec, da_ivkv_t *qord,
+        double *qrem, da_knnheap_t *qheap, idx_t *ncands, idx_t *nverif);
+da_csr_t *idxjoin_symmetric(params_t *params, da_csr_t *docs, size_t *ncands);
+da_csr_t *idxjoin_tiled(params_t *params, da_csr_t *docs, size_t *ncands);
+da_csr_t *idxjoin_batched(params_t *params, da_csr_t *docs, size_t *ncands);
+da_csr_t *idxjoin_queries(params_t *params, da_csr_t *docs, size_t *ncands);
+#ifdef _OPENMP
+size_t idxjoin_threaded(params_t *params, da_csr_t *docs, val_t *cmax, da_cidx_t *cidx,
+        da_qidx_t *qidx, da_csr_t *neighbors, size_t *nverif);
+#endif
 
 /**
  * Main entry point to IdxJoin.
@@ -22,50 +55,98 @@ void idxjoin(params_t *params)
 {
 
 	ssize_t i, j, k, nneighbs;
-	size_t rid, nsims, ncands, nnz;
-	idx_t nrows, ncand, progressInd, pct;
+	size_t rid, nsims, ncands, nverif, nnz;
+	idx_t nrows, ncand, nver, progressInd, pct;
 	idx_t *marker=NULL;
-	da_ivkv_t *hits=NULL, *cand=NULL;
+	val_t *cmax=NULL, *qvec=NULL;
+	double *qrem=NULL;
+	da_ivkv_t *hits=NULL, *cand=NULL, *qord=NULL;
 	da_csr_t *docs, *neighbors=NULL;
+	da_knnheap_t *qheap=NULL;
+	da_cidx_t *cidx=NULL;
+	da_qidx_t *qidx=NULL;
 
 	docs    = params->docs;
 	nrows   = docs->nrows;  // num rows
 	ncands  = 0; // number of considered candidates (computed similarities)
+	nverif  = 0; // number of candidates whose similarity was fully computed (ijk mode)
 	nsims   = 0; // number of similar documents found
 
-	/** Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF **/
-
-    /* compact the column space */
-    da_csr_CompactColumns(docs);
-    if(params->verbosity > 0)
-        printf("Docs matrix: " PRNT_IDXTYPE " rows, " PRNT_IDXTYPE " cols, "
-            PRNT_PTRTYPE " nnz\n", docs->nrows, docs->ncols, docs->rowptr[docs->nrows]);
-
-    /* sort the column space */
-    da_csr_SortIndices(docs, DA_ROW);
+	/* search one tile of a sharded matrix */
+	if(params->ranged && params->mode == MODE_IDXJOIN){
+	    idxjoin_range(params);
+	    return;
+	}
 
-    /* scale term values */
-    if(params->verbosity > 0)
-        printf("   Scaling input matrix.\n");
-    da_csr_Scale(docs);
+	/* search out of core when given a memory budget */
+	if(params->memlimit){
+	    idxjoin_ooc(params);
+	    return;
+	}
 
+	/** Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF, normalize **/
+	preprocessInputData(params);
 
 	timer_start(params->timer_3); /* overall knn graph construction time */
 
-    /* normalize docs rows */
-    da_csr_Normalize(docs, DA_ROW, 2);
-
     /* create inverted index - column version of the matrix */
 	timer_start(params->timer_7); /* indexing time */
-	da_csr_CreateIndex(docs, DA_COL);
+	if(!docs->colptr) /* may have been loaded from the cache */
+	    da_csr_CreateIndex(docs, DA_COL);
+	if(params->mode == MODE_IDXJOINK){
+	    /* max weight of each feature, used to bound the similarity of unseen candidates */
+	    cmax = da_vsmalloc(docs->ncols, 0.0, "idxjoin: cmax");
+	    for(i=0; i < docs->ncols; i++)
+	        for(j=docs->colptr[i]; j < docs->colptr[i+1]; j++)
+	            if(docs->colval[j] > cmax[i])
+	                cmax[i] = docs->colval[j];
+	}
+	if(params->cidx){
+	    /* replace the row ids of the column index with their compressed version */
+	    cidx = da_cidx_Create(docs);
+	    da_csr_FreeArrays(docs, (void**)&docs->colind, LTERM);
+	    if(params->verbosity > 0)
+	        printf("Compressed column index: %zu bytes, %.2f bits per id (raw: %zu bytes).\n",
+	                cidx->size, docs->colptr[docs->ncols] ? 8.0 * cidx->size / docs->colptr[docs->ncols] : 0.0,
+	                (size_t)docs->colptr[docs->ncols] * sizeof(idx_t));
+	}
+	if(params->qbits){
+	    /* replace the values of the column index with their quantized version */
+	    qidx = da_qidx_Create(docs, params->qbits);
+	    da_csr_FreeArrays(docs, (void**)&docs->colval, LTERM);
+	}
 	timer_stop(params->timer_7); /* indexing time */
 
+    /* execute query search */
+    if(params->queries){
+        neighbors = idxjoin_queries(params, docs, &ncands);
+        nsims     = neighbors->rowptr[neighbors->nrows];
+        goto finish;
+    }
+
+    /* execute symmetric search */
+    if(params->mode == MODE_IDXJOINSYM){
+        neighbors = idxjoin_symmetric(params, docs, &ncands);
+        nsims     = neighbors->rowptr[nrows];
+        goto finish;
+    }
+
+    /* execute tiled search */
+    if(params->mode == MODE_IDXJOINTILE){
+        neighbors = idxjoin_tiled(params, docs, &ncands);
+        nsims     = neighbors->rowptr[nrows];
+        goto finish;
+    }
+
+    /* execute batched search */
+    if(params->mode == MODE_IDXJOINBATCH){
+        neighbors = idxjoin_batched(params, docs, &ncands);
+        nsims     = neighbors->rowptr[nrows];
+        goto finish;
+    }
+
 	/* allocate memory for the search */
     timer_start(params->timer_5); /* memory allocation time */
-    hits   = da_ivkvsmalloc(nrows, (da_ivkv_t) {0, 0.0}, "findNeighbors: hits"); /* empty list of key-value structures */
-    cand   = da_ivkvsmalloc(nrows, (da_ivkv_t) {0, 0.0}, "findNeighbors: cand"); /* empty list of key-value structures */
-    marker = da_ismalloc(nrows, -1, "findNeighbors: marker");  /* array of all -1 values */
-
     neighbors = da_csr_Create();
     neighbors->nrows = neighbors->ncols = nrows;
     nnz = params->k * docs->nrows; /* max number of neighbors */
@@ -75,6 +156,27 @@ void idxjoin(params_t *params)
     neighbors->rowptr[0] = 0;
     timer_stop(params->timer_5); /* memory allocation time */
 
+#ifdef _OPENMP
+    /* execute threaded search */
+    if(params->nthreads > 1){
+        ncands = idxjoin_threaded(params, docs, cmax, cidx, qidx, neighbors, &nverif);
+        nsims  = neighbors->rowptr[nrows];
+        goto finish;
+    }
+#endif
+
+    timer_start(params->timer_5); /* memory allocation time */
+    hits   = da_ivkvsmalloc(nrows, (da_ivkv_t) {0, 0.0}, "findNeighbors: hits"); /* empty list of key-value structures */
+    cand   = da_ivkvsmalloc(nrows, (da_ivkv_t) {0, 0.0}, "findNeighbors: cand"); /* empty list of key-value structures */
+    marker = da_ismalloc(nrows, -1, "findNeighbors: marker");  /* array of all -1 values */
+    if(params->mode == MODE_IDXJOINK){
+        qvec  = da_vsmalloc(docs->ncols, 0.0, "findNeighbors: qvec");
+        qord  = da_ivkvmalloc(docs->ncols, "findNeighbors: qord");
+        qrem  = da_dmalloc(docs->ncols+1, "findNeighbors: qrem");
+        qheap = da_knnheap_Create(1, params->k);
+    }
+    timer_stop(params->timer_5); /* memory allocation time */
+
     /* set up progress indicator */
     da_progress_init_steps(pct, progressInd, nrows, 10);
 	if(params->verbosity > 0)
@@ -82,7 +184,12 @@ void idxjoin(params_t *params)
 
 	/* execute search */
 	for(nsims=0, i=0; i < nrows; i++){
-		k = da_getSimilarRows(docs, i, params->k, params->epsilon, hits, cand, marker, &ncand);
+		if(params->mode == MODE_IDXJOINK){
+		    k = da_getSimilarRowsKnn(docs, i, params->k, params->epsilon, cmax, hits, cand,
+		            marker, qvec, qord, qrem, qheap, &ncand, &nver);
+		    nverif += nver;
+		} else
+		    k = da_getSimilarRows(docs, i, params->k, params->epsilon, hits, cand, marker, &ncand, cidx, qidx);
 		ncands += ncand;
 
 		/* transfer candidates to output structure */
@@ -102,23 +209,667 @@ void idxjoin(params_t *params)
             da_progress_finalize_steps(pct, 10);
 	    printf("\n");
 	}
+
+	finish:
 	timer_stop(params->timer_3); // find neighbors time
 
-    printf("Number of computed similarities: %zu\n", ncands);
+    if(params->mode == MODE_IDXJOINK){
+        printf("Number of candidates: %zu\n", ncands);
+        printf("Number of computed similarities: %zu\n", nverif);
+    } else
+        printf("Number of computed similarities: %zu\n", ncands);
     printf("Number of neighbors: %zu\n", nsims);
 
 	/* write ouptut */
 	if(params->oFile){
-	    da_csr_Write(neighbors, params->oFile, DA_FMT_CSR, 1, 1);
+	    da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
 	    printf("Wrote output to %s\n", params->oFile);
 	}
 
 	/* free memory */
 	da_csr_Free(&neighbors);
-	da_free((void**)&hits, &cand, &marker, LTERM);
+	da_knnheap_Free(&qheap);
+	da_cidx_Free(&cidx);
+	da_qidx_Free(&qidx);
+	da_free((void**)&hits, &cand, &marker, &cmax, &qvec, &qord, &qrem, LTERM);
+}
+
+
+/**
+ * Query version of the IdxJoin search (R-S join). Each row of params->queries, pre-processed
+ * in the column space of docs, is compared against the rows of docs via their column index,
+ * and its top-k neighbors among the rows of docs are kept in a bounded heap.
+ * \param params Program parameters
+ * \param docs Pre-processed input matrix, with a column index
+ * \param ncands Reference to counter of computed similarities
+ *
+ * \return The neighbors matrix, with a row for each query and a column for each row of docs
+ */
+da_csr_t *idxjoin_queries(params_t *params, da_csr_t *docs, size_t *ncands)
+{
+    da_csr_t *neighbors;
+    da_knnheap_t *knng;
+
+    timer_start(params->timer_5); /* memory allocation time */
+    knng = da_knnheap_Create(params->queries->nrows, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* query ids follow those of docs, so no query is mistaken for a row of docs */
+    *ncands = ooc_searchBlock(params, params->queries, docs->nrows, docs, 0, knng, docs->nrows);
+
+    neighbors = da_knnheap_ToCsr(knng);
+    neighbors->ncols = docs->nrows;
+    da_knnheap_Free(&knng);
+
+    return neighbors;
+}
+
+
+/**
+ * Symmetric version of the IdxJoin search. Query row i is only compared against rows j > i,
+ * which are found at the end of each (row-ordered) inverted list. Each similar pair is then
+ * offered to the top-k heaps of both rows, halving the number of dot products. When multiple
+ * threads are used, blocks of IJ_BLOCKSIZE query rows are dynamically assigned to threads,
+ * which balances the triangular workload, and heap updates are guarded by IJ_NLOCKS striped
+ * locks. Since neighbors are ordered by (similarity, id), the output does not depend on the
+ * order in which pairs are offered to the heaps.
+ * \param params Program parameters
+ * \param docs Pre-processed input matrix, with a column index
+ * \param ncands Reference to counter of computed similarities
+ *
+ * \return The neighbors matrix
+ */
+da_csr_t *idxjoin_symmetric(params_t *params, da_csr_t *docs, size_t *ncands)
+{
+    ssize_t b, i, j, nblocks, ndone;
+    size_t ncandt;
+    idx_t nrows, nthreads, progressInd, pct, nadv;
+    da_csr_t *neighbors;
+    da_knnheap_t *knng;
+#ifdef _OPENMP
+    omp_lock_t *locks;
+#endif
+
+    nrows    = docs->nrows;
+    nthreads = params->nthreads;
+    nblocks  = (nrows + IJ_BLOCKSIZE - 1) / IJ_BLOCKSIZE;
+    ncandt   = 0;
+    ndone    = 0;
+    nadv     = 0;
+
+    timer_start(params->timer_5); /* memory allocation time */
+    knng = da_knnheap_Create(nrows, params->k);
+#ifdef _OPENMP
+    locks = (omp_lock_t *)da_malloc(IJ_NLOCKS * sizeof(omp_lock_t), "idxjoin_symmetric: locks");
+    for(i=0; i < IJ_NLOCKS; i++)
+        omp_init_lock(&locks[i]);
+#endif
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nrows, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    #pragma omp parallel num_threads(nthreads) private(b, i, j) reduction(+:ncandt)
+    {
+        ssize_t ii, k, y, lo, hi;
+        idx_t tid, ncand, nsim;
+        idx_t *marker, *qind;
+        ptr_t ndoneloc, *colptr;
+        idx_t *colind;
+        val_t *colval, *qval;
+        da_ivkv_t *cand;
+
+        tid    = 0;
+#ifdef _OPENMP
+        tid    = omp_get_thread_num();
+#endif
+        colptr = docs->colptr;
+        colind = docs->colind;
+        colval = docs->colval;
+        cand   = da_ivkvmalloc(nrows, "idxjoin_symmetric: cand");
+        marker = da_ismalloc(nrows, -1, "idxjoin_symmetric: marker");
+
+        #pragma omp for schedule(dynamic, 1)
+        for(b=0; b < nblocks; b++){
+            for(i=b*IJ_BLOCKSIZE; i < nrows && i < (b+1)*IJ_BLOCKSIZE; i++){
+                qind = docs->rowind + docs->rowptr[i];
+                qval = docs->rowval + docs->rowptr[i];
+
+                /* accumulate similarities with rows j > i */
+                for(ncand=0, ii=0; ii < docs->rowptr[i+1] - docs->rowptr[i]; ii++){
+                    k = qind[ii];
+                    /* find the first entry past row i in the inverted list */
+                    for(lo=colptr[k], hi=colptr[k+1]; lo < hi; ){
+                        j = lo + ((hi - lo) >> 1);
+                        if(colind[j] <= i)
+                            lo = j + 1;
+                        else
+                            hi = j;
+                    }
+                    for(j=lo; j < colptr[k+1]; j++){
+                        y = colind[j];
+                        if(marker[y] == -1){
+                            cand[ncand].key = y;
+                            cand[ncand].val = 0;
+                            marker[y]       = ncand++;
+                        }
+                        cand[marker[y]].val += colval[j] * qval[ii];
+                    }
+                }
+                ncandt += ncand;
+
+                /* offer each pair to the heap of the candidate */
+                for(k=0, j=0; j < ncand; j++){
+                    marker[cand[j].key] = -1;
+                    if(cand[j].val < params->epsilon)
+                        continue;
+#ifdef _OPENMP
+                    omp_set_lock(&locks[cand[j].key & (IJ_NLOCKS-1)]);
+#endif
+                    da_knnheap_Insert(knng, cand[j].key, i, cand[j].val);
+#ifdef _OPENMP
+                    omp_unset_lock(&locks[cand[j].key & (IJ_NLOCKS-1)]);
+#endif
+                    cand[k++] = cand[j];
+                }
+
+                /* and only the query's own top-k pairs to the heap of the query */
+                nsim = da_ivkvkselectd(k, params->k, cand);
+#ifdef _OPENMP
+                omp_set_lock(&locks[i & (IJ_NLOCKS-1)]);
+#endif
+                for(j=0; j < nsim; j++)
+                    da_knnheap_Insert(knng, i, cand[j].key, cand[j].val);
+#ifdef _OPENMP
+                omp_unset_lock(&locks[i & (IJ_NLOCKS-1)]);
+#endif
+            }
+
+            /* update progress indicator */
+            if(params->verbosity > 0){
+                #pragma omp atomic capture
+                ndoneloc = ndone += i - b*IJ_BLOCKSIZE;
+                if(tid == 0){
+                    while(nadv * (ptr_t)progressInd <= ndoneloc && pct < 100){
+                        da_progress_advance_steps(pct, 10);
+                        nadv++;
+                    }
+                }
+            }
+        }
+
+        da_free((void**)&cand, &marker, LTERM);
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+#ifdef _OPENMP
+    for(i=0; i < IJ_NLOCKS; i++)
+        omp_destroy_lock(&locks[i]);
+    da_free((void**)&locks, LTERM);
+#endif
+
+    neighbors = da_knnheap_ToCsr(knng);
+    da_knnheap_Free(&knng);
+
+    *ncands = ncandt;
+    return neighbors;
+}
+
+
+/**
+ * Cache-blocked (tiled) version of the IdxJoin search. Query rows are split into blocks of
+ * IJ_BLOCKSIZE rows, which are dynamically assigned to threads. Each query block is compared
+ * against consecutive tiles of IJ_TILEROWS candidate rows. Since inverted lists are sorted by
+ * row id, the slice of each list that falls within a tile is found by advancing a cursor kept
+ * for each (query, feature) pair. Within a tile, candidate similarities are accumulated in
+ * marker/cand arrays of size IJ_TILEROWS, and the slices of the tile's posting lists are reused
+ * by all queries in the block. Partial results of each tile are merged into the top-k heaps
+ * of the query rows.
+ * \param params Program parameters
+ * \param docs Pre-processed input matrix, with a column index
+ * \param ncands Reference to counter of computed similarities
+ *
+ * \return The neighbors matrix
+ */
+da_csr_t *idxjoin_tiled(params_t *params, da_csr_t *docs, size_t *ncands)
+{
+    ssize_t b, i, nblocks, ndone, maxbnnz;
+    size_t ncandt;
+    idx_t nrows, nthreads, progressInd, pct, nadv;
+    da_csr_t *neighbors;
+    da_knnheap_t *knng;
+
+    nrows    = docs->nrows;
+    nthreads = params->nthreads;
+    nblocks  = (nrows + IJ_BLOCKSIZE - 1) / IJ_BLOCKSIZE;
+    ncandt   = 0;
+    ndone    = 0;
+    nadv     = 0;
+
+    /* max number of non-zeros in a query block */
+    for(maxbnnz=0, b=0; b < nblocks; b++){
+        i = da_min((b+1)*IJ_BLOCKSIZE, nrows);
+        maxbnnz = da_max(maxbnnz, docs->rowptr[i] - docs->rowptr[b*IJ_BLOCKSIZE]);
+    }
+
+    timer_start(params->timer_5); /* memory allocation time */
+    knng = da_knnheap_Create(nrows, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nrows, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    #pragma omp parallel num_threads(nthreads) private(b, i) reduction(+:ncandt)
+    {
+        ssize_t ii, j, k, y, q, qs, qe, ts, te;
+        idx_t tid, ncand;
+        idx_t *marker, *rowind, *colind;
+        ptr_t ndoneloc, *rowptr, *colptr, *cur;
+        val_t *rowval, *colval;
+        da_ivkv_t *cand;
+
+        tid    = 0;
+#ifdef _OPENMP
+        tid    = omp_get_thread_num();
+#endif
+        rowptr = docs->rowptr;
+        rowind = docs->rowind;
+        rowval = docs->rowval;
+        colptr = docs->colptr;
+        colind = docs->colind;
+        colval = docs->colval;
+        cand   = da_ivkvmalloc(IJ_TILEROWS, "idxjoin_tiled: cand");
+        marker = da_ismalloc(IJ_TILEROWS, -1, "idxjoin_tiled: marker");
+        cur    = da_pmalloc(maxbnnz, "idxjoin_tiled: cur");
+
+        #pragma omp for schedule(dynamic, 1)
+        for(b=0; b < nblocks; b++){
+            qs = b*IJ_BLOCKSIZE;
+            qe = da_min(qs + IJ_BLOCKSIZE, nrows);
+
+            /* cursors start at the beginning of each query feature's inverted list */
+            for(j=rowptr[qs]; j < rowptr[qe]; j++)
+                cur[j-rowptr[qs]] = colptr[rowind[j]];
+
+            for(ts=0; ts < nrows; ts+=IJ_TILEROWS){
+                te = da_min(ts + IJ_TILEROWS, nrows);
+                for(q=qs; q < qe; q++){
+                    /* accumulate similarities with candidates in the tile */
+                    for(ncand=0, ii=rowptr[q]; ii < rowptr[q+1]; ii++){
+                        k = rowind[ii];
+                        for(j=cur[ii-rowptr[qs]]; j < colptr[k+1] && colind[j] < te; j++){
+                            y = colind[j] - ts;
+                            if(marker[y] == -1){
+                                cand[ncand].key = y;
+                                cand[ncand].val = 0;
+                                marker[y]       = ncand++;
+                            }
+                            cand[marker[y]].val += colval[j] * rowval[ii];
+                        }
+                        cur[ii-rowptr[qs]] = j;
+                    }
+
+                    /* merge tile results into the query's top-k heap */
+                    for(j=0; j < ncand; j++){
+                        y = cand[j].key;
+                        marker[y] = -1;
+                        if(y + ts == q)
+                            continue;
+                        ncandt++;
+                        if(cand[j].val >= params->epsilon)
+                            da_knnheap_Insert(knng, q, y + ts, cand[j].val);
+                    }
+                }
+            }
+
+            /* update progress indicator */
+            if(params->verbosity > 0){
+                #pragma omp atomic capture
+                ndoneloc = ndone += qe - qs;
+                if(tid == 0){
+                    while(nadv * (ptr_t)progressInd <= ndoneloc && pct < 100){
+                        da_progress_advance_steps(pct, 10);
+                        nadv++;
+                    }
+                }
+            }
+        }
+
+        da_free((void**)&cand, &marker, &cur, LTERM);
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+    neighbors = da_knnheap_ToCsr(knng);
+    da_knnheap_Free(&knng);
+
+    *ncands = ncandt;
+    return neighbors;
 }
 
 
+/**
+ * Batched (SpMM-style) version of the IdxJoin search. Query rows are split into batches of
+ * IJ_BATCHSIZE rows, which are dynamically assigned to threads. The features of a batch are
+ * grouped, such that each feature's inverted list is traversed once, scattering into the
+ * accumulators of all queries in the batch that contain it. Each candidate gets a vector of
+ * IJ_BATCHSIZE accumulators, one per query in the batch, which are addressed through a single
+ * marker array, and a bit mask of the queries it shares a feature with, such that candidates with
+ * a similarity of 0 are kept when eps is 0. Once all features are processed, each query's results
+ * are added to its top-k heap.
+ * \param params Program parameters
+ * \param docs Pre-processed input matrix, with a column index
+ * \param ncands Reference to counter of computed similarities
+ *
+ * \return The neighbors matrix
+ */
+#if IJ_BATCHSIZE > 32
+#error "IJ_BATCHSIZE must fit the uint query masks of idxjoin_batched"
+#endif
+da_csr_t *idxjoin_batched(params_t *params, da_csr_t *docs, size_t *ncands)
+{
+    ssize_t b, i, nbatches, ndone, maxbnnz;
+    size_t ncandt;
+    idx_t nrows, ncols, nthreads, progressInd, pct, nadv;
+    da_csr_t *neighbors;
+    da_knnheap_t *knng;
+
+    nrows    = docs->nrows;
+    ncols    = docs->ncols;
+    nthreads = params->nthreads;
+    nbatches = (nrows + IJ_BATCHSIZE - 1) / IJ_BATCHSIZE;
+    ncandt   = 0;
+    ndone    = 0;
+    nadv     = 0;
+
+    /* max number of non-zeros in a batch */
+    for(maxbnnz=0, b=0; b < nbatches; b++){
+        i = da_min((b+1)*IJ_BATCHSIZE, nrows);
+        maxbnnz = da_max(maxbnnz, docs->rowptr[i] - docs->rowptr[b*IJ_BATCHSIZE]);
+    }
+
+    timer_start(params->timer_5); /* memory allocation time */
+    knng = da_knnheap_Create(nrows, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nrows, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    #pragma omp parallel num_threads(nthreads) private(b, i) reduction(+:ncandt)
+    {
+        ssize_t ii, j, jj, k, y, s, qs, qe, nf, nacc;
+        idx_t tid, ncand;
+        idx_t *marker, *fmark, *flist, *fslot, *candl, *rowind, *colind;
+        uint *fbits, *amask;
+        ptr_t ndoneloc, *fptr, *rowptr, *colptr;
+        val_t *rowval, *colval, *fwgt, *acc, *a, v;
+
+        tid    = 0;
+#ifdef _OPENMP
+        tid    = omp_get_thread_num();
+#endif
+        rowptr = docs->rowptr;
+        rowind = docs->rowind;
+        rowval = docs->rowval;
+        colptr = docs->colptr;
+        colind = docs->colind;
+        colval = docs->colval;
+        marker = da_ismalloc(nrows, -1, "idxjoin_batched: marker");
+        candl  = da_imalloc(nrows, "idxjoin_batched: candl");
+        fmark  = da_ismalloc(ncols, -1, "idxjoin_batched: fmark");
+        flist  = da_imalloc(maxbnnz, "idxjoin_batched: flist");
+        fptr   = da_pmalloc(maxbnnz+1, "idxjoin_batched: fptr");
+        fslot  = da_imalloc(maxbnnz, "idxjoin_batched: fslot");
+        fwgt   = da_vmalloc(maxbnnz, "idxjoin_batched: fwgt");
+        fbits  = da_umalloc(maxbnnz, "idxjoin_batched: fbits");
+        nacc   = da_min(nrows, IJ_TILEROWS);
+        acc    = da_vmalloc(nacc * IJ_BATCHSIZE, "idxjoin_batched: acc");
+        amask  = da_umalloc(nacc, "idxjoin_batched: amask");
+
+        #pragma omp for schedule(dynamic, 1)
+        for(b=0; b < nbatches; b++){
+            qs = b*IJ_BATCHSIZE;
+            qe = da_min(qs + IJ_BATCHSIZE, nrows);
+
+            /* group the batch's features - (slot, weight) lists for each distinct feature */
+            for(nf=0, j=rowptr[qs]; j < rowptr[qe]; j++){
+                k = rowind[j];
+                if(fmark[k] == -1){
+                    fmark[k]  = nf;
+                    flist[nf] = k;
+                    fptr[nf]  = 0;
+                    fbits[nf] = 0;
+                    nf++;
+                }
+                fptr[fmark[k]]++;
+            }
+            CSRMAKE(i, nf, fptr);
+            for(i=qs; i < qe; i++){
+                for(j=rowptr[i]; j < rowptr[i+1]; j++){
+                    k = fmark[rowind[j]];
+                    fbits[k] |= 1u << (i - qs);
+                    fslot[fptr[k]]  = i - qs;
+                    fwgt[fptr[k]++] = rowval[j];
+                }
+            }
+            CSRSHIFT(i, nf, fptr);
+
+            /* traverse each feature's inverted list once for the whole batch */
+            for(ncand=0, ii=0; ii < nf; ii++){
+                k = flist[ii];
+                fmark[k] = -1;
+                for(j=colptr[k]; j < colptr[k+1]; j++){
+                    y = colind[j];
+                    if(marker[y] == -1){
+                        if(ncand == nacc){
+                            nacc = da_min(2*nacc, nrows);
+                            acc  = da_vrealloc(acc, nacc * IJ_BATCHSIZE, "idxjoin_batched: acc");
+                            amask = da_urealloc(amask, nacc, "idxjoin_batched: amask");
+                        }
+                        candl[ncand] = y;
+                        memset(acc + (size_t)ncand * IJ_BATCHSIZE, 0, IJ_BATCHSIZE * sizeof(val_t));
+                        amask[ncand] = 0;
+                        marker[y] = ncand++;
+                    }
+                    amask[marker[y]] |= fbits[ii];
+                    a = acc + (size_t)marker[y] * IJ_BATCHSIZE;
+                    v = colval[j];
+                    for(jj=fptr[ii]; jj < fptr[ii+1]; jj++)
+                        a[fslot[jj]] += fwgt[jj] * v;
+                }
+            }
+
+            /* add each query's results to its top-k heap */
+            for(j=0; j < ncand; j++){
+                y = candl[j];
+                marker[y] = -1;
+                a = acc + (size_t)j * IJ_BATCHSIZE;
+                for(s=0; s < qe - qs; s++){
+                    /* skip queries that share no feature with y, whose similarity may also be 0 */
+                    if(!(amask[j] & (1u << s)) || y == qs + s)
+                        continue;
+                    ncandt++;
+                    if(a[s] >= params->epsilon)
+                        da_knnheap_Insert(knng, qs + s, y, a[s]);
+                }
+            }
+
+            /* update progress indicator */
+            if(params->verbosity > 0){
+                #pragma omp atomic capture
+                ndoneloc = ndone += qe - qs;
+                if(tid == 0){
+                    while(nadv * (ptr_t)progressInd <= ndoneloc && pct < 100){
+                        da_progress_advance_steps(pct, 10);
+                        nadv++;
+                    }
+                }
+            }
+        }
+
+        da_free((void**)&marker, &candl, &fmark, &flist, &fptr, &fslot, &fwgt, &fbits, &acc, &amask, LTERM);
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+    neighbors = da_knnheap_ToCsr(knng);
+    da_knnheap_Free(&knng);
+
+    *ncands = ncandt;
+    return neighbors;
+}
+
+
+#ifdef _OPENMP
+/**
+ * Threaded version of the IdxJoin search loop. Query rows are split into blocks of
+ * IJ_BLOCKSIZE rows that are dynamically assigned to threads. Each thread owns its own
+ * hits/cand/marker arrays and appends the neighbors it finds to a private buffer. Once
+ * all blocks are processed, the per-thread buffers are stitched into the neighbors
+ * matrix in row order, such that the output is identical to that of the serial search.
+ * \param params Program parameters
+ * \param docs Pre-processed input matrix, with a column index
+ * \param cmax Max weight of each feature (ijk mode only)
+ * \param cidx Compressed row ids of the column index, or NULL to use docs->colind
+ * \param qidx Quantized values of the column index, or NULL to use docs->colval
+ * \param neighbors Output matrix, with allocated rowptr, rowind, and rowval arrays
+ * \param nverif Reference to counter of fully computed similarities (ijk mode only)
+ *
+ * \return Number of computed similarities (candidates in ijk mode)
+ */
+size_t idxjoin_threaded(params_t *params, da_csr_t *docs, val_t *cmax, da_cidx_t *cidx,
+        da_qidx_t *qidx, da_csr_t *neighbors, size_t *nverif)
+{
+    ssize_t b, i, j, nblocks, ndone;
+    size_t ncands, nverifs;
+    idx_t nrows, nthreads, progressInd, pct, nadv;
+    idx_t *bthread;
+    ptr_t *bstart, *rowptr;
+    da_ivkv_t **tbufs;
+
+    nrows    = docs->nrows;
+    nthreads = params->nthreads;
+    nblocks  = (nrows + IJ_BLOCKSIZE - 1) / IJ_BLOCKSIZE;
+    rowptr   = neighbors->rowptr;
+    ncands   = 0;
+    nverifs  = 0;
+    ndone    = 0;
+    nadv     = 0;
+
+    bthread  = da_imalloc(nblocks, "idxjoin_threaded: bthread");  /* thread that processed each block */
+    bstart   = da_pmalloc(nblocks, "idxjoin_threaded: bstart");   /* where block results start in the thread's buffer */
+    tbufs    = (da_ivkv_t **)da_nmalloc(nthreads * sizeof(da_ivkv_t *), "idxjoin_threaded: tbufs");
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nrows, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    #pragma omp parallel num_threads(nthreads) private(b, i, j) reduction(+:ncands,nverifs)
+    {
+        idx_t tid, k, ncand, nver;
+        idx_t *marker;
+        size_t nbuf, bufsz;
+        ptr_t ndoneloc;
+        val_t *qvec=NULL;
+        double *qrem=NULL;
+        da_ivkv_t *hits, *cand, *buf, *qord=NULL;
+        da_knnheap_t *qheap=NULL;
+
+        tid    = omp_get_thread_num();
+        hits   = da_ivkvsmalloc(nrows, (da_ivkv_t) {0, 0.0}, "idxjoin_threaded: hits");
+        cand   = da_ivkvsmalloc(nrows, (da_ivkv_t) {0, 0.0}, "idxjoin_threaded: cand");
+        marker = da_ismalloc(nrows, -1, "idxjoin_threaded: marker");
+        if(params->mode == MODE_IDXJOINK){
+            qvec  = da_vsmalloc(docs->ncols, 0.0, "idxjoin_threaded: qvec");
+            qord  = da_ivkvmalloc(docs->ncols, "idxjoin_threaded: qord");
+            qrem  = da_dmalloc(docs->ncols+1, "idxjoin_threaded: qrem");
+            qheap = da_knnheap_Create(1, params->k);
+        }
+        bufsz  = (size_t)params->k * IJ_BLOCKSIZE;
+        buf    = da_ivkvmalloc(bufsz, "idxjoin_threaded: buf");
+        nbuf   = 0;
+
+        #pragma omp for schedule(dynamic, 1)
+        for(b=0; b < nblocks; b++){
+            bthread[b] = tid;
+            bstart[b]  = nbuf;
+            for(i=b*IJ_BLOCKSIZE; i < nrows && i < (b+1)*IJ_BLOCKSIZE; i++){
+                if(nbuf + params->k > bufsz){
+                    bufsz *= 2;
+                    buf = da_ivkvrealloc(buf, bufsz, "idxjoin_threaded: buf");
+                }
+                if(params->mode == MODE_IDXJOINK){
+                    k = da_getSimilarRowsKnn(docs, i, params->k, params->epsilon, cmax, hits,
+                            cand, marker, qvec, qord, qrem, qheap, &ncand, &nver);
+                    nverifs += nver;
+                } else
+                    k = da_getSimilarRows(docs, i, params->k, params->epsilon, hits, cand, marker, &ncand, cidx, qidx);
+                ncands += ncand;
+                for(j=0; j < k; j++)
+                    buf[nbuf++] = hits[j];
+                rowptr[i+1] = k;
+            }
+
+            /* update progress indicator */
+            if(params->verbosity > 0){
+                #pragma omp atomic capture
+                ndoneloc = ndone += i - b*IJ_BLOCKSIZE;
+                if(tid == 0){
+                    while(nadv * (ptr_t)progressInd <= ndoneloc && pct < 100){
+                        da_progress_advance_steps(pct, 10);
+                        nadv++;
+                    }
+                }
+            }
+        }
+        tbufs[tid] = buf;
+
+        da_knnheap_Free(&qheap);
+        da_free((void**)&hits, &cand, &marker, &qvec, &qord, &qrem, LTERM);
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+    /* stitch per-thread results into the output structure */
+    for(rowptr[0]=0, i=0; i < nrows; i++)
+        rowptr[i+1] += rowptr[i];
+
+    #pragma omp parallel for num_threads(nthreads) private(i, j) schedule(dynamic, 16)
+    for(b=0; b < nblocks; b++){
+        da_ivkv_t *src = tbufs[bthread[b]] + bstart[b];
+        i = da_min((b+1)*IJ_BLOCKSIZE, nrows);
+        for(j=rowptr[b*IJ_BLOCKSIZE]; j < rowptr[i]; j++, src++){
+            neighbors->rowind[j] = src->key;
+            neighbors->rowval[j] = src->val;
+        }
+    }
+
+    for(i=0; i < nthreads; i++)
+        da_free((void**)&tbufs[i], LTERM);
+    da_free((void**)&tbufs, &bthread, &bstart, LTERM);
+
+    *nverif = nverifs;
+    return ncands;
+}
+#endif
+
+
 /**
  * Find similar rows in the matrix -  this version of the function reports
  * the number of candidates/dot products that were considered in the search.
@@ -130,17 +881,23 @@ void idxjoin(params_t *params)
  * \param i_cand Optional key-value array of length mat->nrows to store and sort candidates
  * \param i_marker Optional marker array of length mat->nrows to mark candidates
  * \param ncands Reference to int variable to hold number of candidates
+ * \param cidx Optional compressed row ids of the column index, decoded block by block
+ *      while accumulating, in which case mat->colind is not used
+ * \param qidx Optional quantized values of the column index, used instead of mat->colval to
+ *      bound similarities; candidates that may be neighbors are then re-scored exactly
  *
  * \return Number of similar pairs found
  */
 idx_t da_getSimilarRows(da_csr_t *mat, idx_t rid, idx_t nsim, float eps,
-        da_ivkv_t *hits, da_ivkv_t *i_cand, idx_t *i_marker, idx_t *ncands)
+        da_ivkv_t *hits, da_ivkv_t *i_cand, idx_t *i_marker, idx_t *ncands, const da_cidx_t *cidx,
+        const da_qidx_t *qidx)
 {
-	ssize_t i, ii, j, k, qsz;
+	ssize_t i, ii, j, k, l, n, qsz;
 	idx_t nrows, ncols, ncand;
 	ptr_t *colptr;
-	idx_t *colind, *qind, *marker;
-	val_t *colval, *qval;
+	idx_t *colind, *qind, *marker, *bind, bids[DA_CIDX_BLOCK];
+	val_t *colval, *qval, qs, slack, thresh, bval[DA_CIDX_BLOCK];
+	const unsigned char *s;
 	da_ivkv_t *cand;
 
 	nrows  = mat->nrows;   /* number of rows */
@@ -159,19 +916,71 @@ idx_t da_getSimilarRows(da_csr_t *mat, idx_t rid, idx_t nsim, float eps,
 	marker = (i_marker ? i_marker : da_ismalloc(nrows, -1, "da_csr_GetSimilarSmallerRows: marker"));
 	cand   = (i_cand   ? i_cand   : da_ivkvmalloc(nrows, "da_csr_GetSimilarSmallerRows: cand"));
 
-    for (ncand=0, ii=0; ii<qsz; ii++) {
-        i = qind[ii];
-        if (i < ncols) {
-            for (j=colptr[i]; j<colptr[i+1]; j++) {
-                k = colind[j];
-                if(k == rid)
+    if (cidx || qidx) {
+        /* process posting lists in blocks: decode the ids and weigh the quantized values of each
+           block, then accumulate them. Exact values are weighed while accumulating, as in the
+           uncompressed search, such that both round the similarities the same way. */
+        for (ncand=0, ii=0; ii<qsz; ii++) {
+            i = qind[ii];
+            if (i >= ncols)
+                continue;
+            s  = (cidx ? cidx->data + cidx->cbyte[i] : NULL);
+            qs = (qidx ? qval[ii] * qidx->cstep[i] : qval[ii]);
+            for (j=colptr[i]; j<colptr[i+1]; j+=n) {
+                n = da_min(DA_CIDX_BLOCK, colptr[i+1]-j);
+                if (cidx) {
+                    s    = da_cidx_Decode(s, n, bids);
+                    bind = bids;
+                } else
+                    bind = colind + j;
+                if (!qidx) {
+                    for (l=0; l<n; l++) {
+                        k = bind[l];
+                        if(k == rid)
+                            continue;
+                        if (marker[k] == -1) {
+                            cand[ncand].key = k;
+                            cand[ncand].val = 0;
+                            marker[k]       = ncand++;
+                        }
+                        cand[marker[k]].val += colval[j+l] * qs;
+                    }
                     continue;
-                if (marker[k] == -1) {
-                    cand[ncand].key = k;
-                    cand[ncand].val = 0;
-                    marker[k]       = ncand++;
                 }
-                cand[marker[k]].val += colval[j] * qval[ii];
+                if (qidx->val8)
+                    for (l=0; l<n; l++)
+                        bval[l] = qidx->val8[j+l] * qs;
+                else
+                    for (l=0; l<n; l++)
+                        bval[l] = qidx->val16[j+l] * qs;
+                for (l=0; l<n; l++) {
+                    k = bind[l];
+                    if(k == rid)
+                        continue;
+                    if (marker[k] == -1) {
+                        cand[ncand].key = k;
+                        cand[ncand].val = 0;
+                        marker[k]       = ncand++;
+                    }
+                    cand[marker[k]].val += bval[l];
+                }
+            }
+        }
+    } else {
+        for (ncand=0, ii=0; ii<qsz; ii++) {
+            i = qind[ii];
+            if (i < ncols) {
+                for (j=colptr[i]; j<colptr[i+1]; j++) {
+                    k = colind[j];
+                    if(k == rid)
+                        continue;
+                    if (marker[k] == -1) {
+                        cand[ncand].key = k;
+                        cand[ncand].val = 0;
+                        marker[k]       = ncand++;
+                    }
+                    cand[marker[k]].val += colval[j] * qval[ii];
+                }
             }
         }
     }
@@ -182,6 +991,33 @@ idx_t da_getSimilarRows(da_csr_t *mat, idx_t rid, idx_t nsim, float eps,
 	for (j=0, i=0; i<ncand; i++)
         marker[cand[i].key] = -1;
 
+    if (qidx) {
+        /* the quantized similarities are within slack of the true ones; discard the candidates
+           that cannot reach eps or the lower bound of the k-th best similarity, and compute
+           the similarities of the others exactly from the rows */
+        for (slack=0.0, ii=0; ii<qsz; ii++)
+            if (qind[ii] < ncols)
+                slack += qval[ii] * qidx->cstep[qind[ii]];
+        slack  = 0.5 * slack + DA_QIDX_TOL;
+        thresh = eps;
+        if (nsim > 0 && nsim < ncand) {
+            da_ivkvkselectd(ncand, nsim, cand);
+            for (thresh=cand[0].val, i=1; i<nsim; i++)
+                thresh = da_min(thresh, cand[i].val);
+            thresh = da_max(eps, thresh - slack);
+        }
+        for (n=0, i=0; i<ncand; i++) {
+            if (cand[i].val + slack < thresh)
+                continue;
+            k = cand[i].key;
+            cand[n].key = k;
+            cand[n].val = da_sdot(qsz, qind, qval, mat->rowptr[k+1] - mat->rowptr[k],
+                    mat->rowind + mat->rowptr[k], mat->rowval + mat->rowptr[k]);
+            n++;
+        }
+        ncand = n;
+    }
+
 	if (nsim == -1 || nsim >= ncand) {
 		nsim = ncand;
 	}
@@ -210,3 +1046,172 @@ idx_t da_getSimilarRows(da_csr_t *mat, idx_t rid, idx_t nsim, float eps,
 }
 
 
+
+
+/**
+ * Find the k-th largest similarity among a set of candidates.
+ * \param cand Candidate key-value array
+ * \param ncand Number of candidates, at least nsim
+ * \param nsim Number of similar pairs to get
+ * \param tmp Scratch array of length at least ncand
+ *
+ * \return The nsim-th largest candidate value
+ */
+static val_t ij_kthBest(da_ivkv_t *cand, idx_t ncand, idx_t nsim, da_ivkv_t *tmp)
+{
+    idx_t i;
+    val_t v;
+
+    for(i=0; i < ncand; i++)
+        tmp[i] = cand[i];
+    da_ivkvkselectd(ncand, nsim, tmp);
+    for(v=tmp[0].val, i=1; i < nsim; i++)
+        if(tmp[i].val < v)
+            v = tmp[i].val;
+
+    return v;
+}
+
+
+/**
+ * Find the top-k similar rows in the matrix using a running k-th best similarity threshold.
+ * Query features are processed in decreasing weight order. Since all weights are non-negative,
+ * the k-th best partial similarity is a lower bound for the k-th best final similarity, and
+ * min(sum q_j cmax_j, ||q_j..||) bounds what the remaining features can add to any candidate.
+ * New candidates are admitted only while that bound can reach max(eps, k-th best). Surviving
+ * candidates are then completed with exact dot products against the remaining query features,
+ * in decreasing order of their partial similarity, until no candidate can enter the top-k.
+ * \param mat The CSR matrix we're searching in, with a column index
+ * \param rid Row we're looking for neighbors for
+ * \param nsim Number of similar pairs to get
+ * \param eps Minimum similarity between query and neighbors
+ * \param cmax Max weight of each feature in the collection
+ * \param hits Array or length mat->nrows to hold the result
+ * \param cand Key-value array of length mat->nrows to accumulate candidate similarities
+ * \param marker Marker array of length mat->nrows, all -1 values, to mark candidates
+ * \param qvec Dense array of length mat->ncols of all 0 values, used to scatter the query
+ * \param qord Key-value array of length mat->ncols to order the query features
+ * \param qrem Array of length mat->ncols+1 to hold the remaining similarity bounds
+ * \param qheap Single-row top-k heap with capacity nsim
+ * \param ncands Reference to int variable to hold number of candidates
+ * \param nverif Reference to int variable to hold number of fully computed similarities
+ *
+ * \return Number of similar pairs found
+ */
+idx_t da_getSimilarRowsKnn(da_csr_t *mat, idx_t rid, idx_t nsim, float eps, val_t *cmax,
+        da_ivkv_t *hits, da_ivkv_t *cand, idx_t *marker, val_t *qvec, da_ivkv_t *qord,
+        double *qrem, da_knnheap_t *qheap, idx_t *ncands, idx_t *nverif)
+{
+    ssize_t i, ii, j, k, y, qsz, nleft;
+    idx_t ncand, nver;
+    ptr_t *rowptr, *colptr;
+    idx_t *rowind, *colind, *qind;
+    val_t *rowval, *colval, *qval, w;
+    double b1, b2, thr, rem, lastrem, s;
+
+    rowptr = mat->rowptr;
+    rowind = mat->rowind;
+    rowval = mat->rowval;
+    colptr = mat->colptr;
+    colind = mat->colind;
+    colval = mat->colval;
+    qsz    = rowptr[rid+1] - rowptr[rid]; /* number of values in query row */
+    qind   = rowind + rowptr[rid];        /* where indices for the query row start */
+    qval   = rowval + rowptr[rid];        /* where values for the query row start */
+
+    *ncands = *nverif = 0;
+    if (qsz == 0)
+        return 0;
+
+    /* order query features by decreasing weight */
+    for(ii=0; ii < qsz; ii++){
+        qord[ii].key = qind[ii];
+        qord[ii].val = qval[ii];
+    }
+    da_ivkvsortd(qsz, qord);
+
+    /* bound on the similarity any row can gather from query features ii..qsz-1 */
+    for(b1=b2=0.0, ii=qsz-1; ii >= 0; ii--){
+        b1 += qord[ii].val * cmax[qord[ii].key];
+        b2 += qord[ii].val * qord[ii].val;
+        qrem[ii] = da_min(b1, sqrt(b2));
+    }
+    qrem[qsz] = 0.0;
+
+    /* generate candidates while unseen rows could still reach the threshold */
+    thr     = eps;
+    lastrem = qrem[0];
+    for(ncand=0, ii=0; ii < qsz; ii++){
+        if(qrem[ii] < thr)
+            break;
+        i = qord[ii].key;
+        w = qord[ii].val;
+        for(j=colptr[i]; j < colptr[i+1]; j++){
+            y = colind[j];
+            if(y == rid)
+                continue;
+            if(marker[y] == -1){
+                cand[ncand].key = y;
+                cand[ncand].val = 0;
+                marker[y]       = ncand++;
+            }
+            cand[marker[y]].val += w * colval[j];
+        }
+        /* raise the threshold each time the remaining bound drops by a quarter */
+        if(ncand >= nsim && qrem[ii+1] >= thr && qrem[ii+1] <= 0.75 * lastrem){
+            thr     = da_max(thr, ij_kthBest(cand, ncand, nsim, hits));
+            lastrem = qrem[ii+1];
+        }
+    }
+    *ncands = ncand;
+    rem     = qrem[ii];
+    qheap->nnbrs[0] = 0;
+
+    if(ii == qsz){
+        /* all query features were processed - partial similarities are exact */
+        for(i=0; i < ncand; i++){
+            marker[cand[i].key] = -1;
+            if(cand[i].val >= eps)
+                da_knnheap_Insert(qheap, 0, cand[i].key, cand[i].val);
+        }
+        nver = ncand;
+    } else {
+        /* scatter the remaining query features */
+        for(nleft=ii; ii < qsz; ii++)
+            qvec[qord[ii].key] = qord[ii].val;
+
+        /* keep only candidates that could still reach the threshold */
+        if(ncand >= nsim)
+            thr = da_max(thr, ij_kthBest(cand, ncand, nsim, hits));
+        for(k=0, i=0; i < ncand; i++){
+            marker[cand[i].key] = -1;
+            if(cand[i].val + rem >= thr)
+                cand[k++] = cand[i];
+        }
+        da_ivkvsortd(k, cand);
+
+        /* complete candidates in decreasing upper bound order */
+        for(nver=0, i=0; i < k; i++){
+            if(cand[i].val + rem < thr)
+                break;
+            y = cand[i].key;
+            for(s=cand[i].val, j=rowptr[y]; j < rowptr[y+1]; j++)
+                s += qvec[rowind[j]] * rowval[j];
+            nver++;
+            if(s >= eps && da_knnheap_Insert(qheap, 0, y, s) && qheap->nnbrs[0] == nsim)
+                thr = da_max(thr, da_knnheap_Min(qheap, 0));
+        }
+
+        /* clear the query */
+        for(ii=nleft; ii < qsz; ii++)
+            qvec[qord[ii].key] = 0.0;
+    }
+    *nverif = nver;
+
+    /* sort output in decreasing order of similarity */
+    da_knnheap_Sort(qheap, 0);
+    for(k=0; k < qheap->nnbrs[0]; k++)
+        hits[k] = qheap->heap[k];
+
+    return k;
+}
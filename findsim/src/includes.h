@@ -31,10 +31,19 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 /*#include <execinfo.h>*/
 #include <stdbool.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__SSE4_1__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #include "defs.h"
 #include "macros.h"
@@ -16,17 +16,13 @@
 #include "includes.h"
 
 #include <vector>       // std::vector
-#include <map>			// std::map
-#include <set>			// std::set
-#include <functional>	// std::greater
-#include <iterator>     // std::iterator
 
 
 using namespace std;
 
 // forward declarations
 void findMatches(const int doc_id, const vector<vector<pair<int, float>>>& invertedIndex, const float eps, da_csr_t *docs, idx_t *ncands,
-				vector<map<int, float>> *matches);
+				da_knnheap_t *matches, da_ivkv_t *cand, idx_t *marker);
 
 /**
  * Main entry point to Inverted Index APSS.
@@ -34,47 +30,26 @@ void findMatches(const int doc_id, const vector<vector<pair<int, float>>>& inver
 void invertedidx(params_t *params)
 {
 	ssize_t i, j;
-	size_t nsims, ncands, nnz;
+	size_t nsims, ncands;
 	idx_t nrows, ncand, progressInd, pct;
+	idx_t *marker=NULL;
+	da_ivkv_t *cand=NULL;
 	da_csr_t *docs, *neighbors=NULL;
+	da_knnheap_t *matches=NULL;
 
 	docs    = params->docs;
 	nrows   = docs->nrows;  // num rows
 	ncands  = 0; // number of considered candidates (computed similarities)
 	nsims   = 0; // number of similar documents found
 
-    /** Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF **/
-
-    /* compact the column space */
-    da_csr_CompactColumns(docs);
-    if(params->verbosity > 0)
-        printf("Docs matrix: " PRNT_IDXTYPE " rows, " PRNT_IDXTYPE " cols, "
-            PRNT_PTRTYPE " nnz\n", docs->nrows, docs->ncols, docs->rowptr[docs->nrows]);
-
-    /* sort the column space */
-    da_csr_SortIndices(docs, DA_ROW);
-
-    /* scale term values */
-    if(params->verbosity > 0)
-        printf("   Scaling input matrix.\n");
-    da_csr_Scale(docs);
-
+    /** Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF, normalize **/
+    preprocessInputData(params);
 
 	timer_start(params->timer_3); /* overall knn graph construction time */
 
-    /* normalize docs rows */
-    da_csr_Normalize(docs, DA_ROW, 2);
-
     /* create inverted index - column version of the matrix */
-    da_csr_CreateIndex(docs, DA_COL);
-
-    neighbors = da_csr_Create();
-    neighbors->nrows = neighbors->ncols = nrows;
-    nnz = params->k * docs->nrows; /* max number of neighbors */
-    neighbors->rowptr = da_pmalloc(nrows + 1, "simSearchSetup: neighbors->rowptr");
-    neighbors->rowind = da_imalloc(nnz, "simSearchSetup: neighbors->rowind");
-    neighbors->rowval = da_vmalloc(nnz, "simSearchSetup: neighbors->rowval");
-    neighbors->rowptr[0] = 0;
+    if(!docs->colptr) /* may have been loaded from the cache */
+        da_csr_CreateIndex(docs, DA_COL);
 
     /* set up progress indicator */
     da_progress_init_steps(pct, progressInd, nrows, 10);
@@ -93,23 +68,24 @@ void invertedidx(params_t *params)
     // Resize the vector to the total number of features/dimensions.
     invertedIndex.resize(docs->ncols);
 
-    // Vector of maps to store the similarity of each document with every other document.
-    // Using maps of vector id (key)to weight (value) as given in the paper.
-    // Using inner vector of pairs instead of maps didn't affect the speedup. Hence, using the implementation mentioned in the paper.
-    // First element in the pairs is the computed similarity value and the second element is the document id against which the similarity has been computed
-    // This vector of similarity pairs is again stored in a vector that is the size of the total number of documents.
-    // The vector is declared here and a reference is sent to the similarities computation function.
-    // Vector data format is as follows:
-    // V1 in matches: [(v2, 0.32), (v3, 0.48), ()....]
-    // V2 in matches: [(v1, 0.23), (v3, 0.68), ()....]
-    vector<map<int, float>> matches;
-
-    // Resize the vector to the total number of documents
-    matches.resize(docs->nrows);
+    // Bounded min-heaps that keep the current top-k (id, similarity) pairs of each document.
+    // Each pair with similarity at least eps is offered to both documents' heaps, which only keep it
+    // if it beats their current k-th best neighbor. The heaps are stored contiguously in a flat array,
+    // so memory stays O(k*n) no matter how many similar pairs are found.
+    // Heap data format is as follows:
+    // H1 in matches: [(v3, 0.48), (v2, 0.32), ()....] (at most k pairs)
+    // H2 in matches: [(v3, 0.68), (v1, 0.23), ()....] (at most k pairs)
+    matches = da_knnheap_Create(nrows, params->k);
+
+    // Sparse accumulator shared by all queries. cand holds the (id, partial similarity) pairs of the
+    // documents touched by the current query and marker maps a document id to its position in cand
+    // (-1 if it was not touched). Only touched entries are reset after each query.
+    cand   = da_ivkvmalloc(nrows, "invertedidx: cand");
+    marker = da_ismalloc(nrows, -1, "invertedidx: marker");
 
     // Build the inverted index and scan the inverted index list to perform similarity score accumulation.
-    for (i=0; i <= docs->nrows; i++) {
-        findMatches(i, invertedIndex, params->epsilon, docs, &ncand, &matches);
+    for (i=0; i < docs->nrows; i++) {
+        findMatches(i, invertedIndex, params->epsilon, docs, &ncand, matches, cand, marker);
         ncands += ncand;
         for (j = docs->rowptr[i]; j < docs->rowptr[i+1]; j++) {
         	invertedIndex[docs->rowind[j]].push_back({i, docs->rowval[j]});
@@ -122,33 +98,12 @@ void invertedidx(params_t *params)
     }
 
     /* execute search */
-    // It has been specifically mentioned that we must write our own base function for finding neighbors that does not call any other 3rd party functions.
-    // Hence, not using sort function to sort the inner vector of pairs.
-    // Instead using STL Set in which the Pairs are always inserted in the Set based on the first value (key).
-    // Since, 'greater' function during declaration the pairs are automatically inserted in non-increasing order of cosine similarity.
-    // The top k can then be easily obtained from this sorted set of pairs with a simple 'for' loop and 'if no. of candidates < k' condition
-    nsims = 0;
-
-    for (i=0; i < matches.size(); ++i) {
-
-    	// Using the default constructor to initialize the set of pairs for every query vector
-    	set<pair<float, int>, greater<pair<float, int>>> candidatePairs;
-        for (const auto& similarity : matches[i]) {
-        	candidatePairs.insert(pair<float, int>(similarity.second, similarity.first));
-        }
-
-        j = 0;
-        for (const auto &candidatePair : candidatePairs) {
-        	//Strictly smaller as the index starts at 0
-        	if (j < params->k){
-        		neighbors->rowind[nsims] = candidatePair.second;
-				neighbors->rowval[nsims] = candidatePair.first;
-				nsims++;
-				j++;
-            }
-        }
-        neighbors->rowptr[i+1] = nsims;
-    }
+    // The heaps already hold the top k neighbors of each document. Transfer them to the output matrix,
+    // in non-increasing order of cosine similarity (ties broken by decreasing document id).
+    neighbors = da_knnheap_ToCsr(matches);
+    nsims = neighbors->rowptr[nrows];
+    da_knnheap_Free(&matches);
+    da_free((void**)&cand, &marker, LTERM);
 
     // Print progress indicator
     if (params->verbosity > 0) {
@@ -164,7 +119,7 @@ void invertedidx(params_t *params)
 
     /* Write ouptut */
 	if(params->oFile){
-	    da_csr_Write(neighbors, params->oFile, DA_FMT_CSR, 1, 1);
+	    da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
 	    printf("Wrote output to %s\n", params->oFile);
 	}
 	da_csr_Free(&neighbors);
@@ -176,33 +131,40 @@ void invertedidx(params_t *params)
  * \param invertedIndex Vector of inverted indices with vector weights for each feature/index stored within the inverted index itself.
  * \param eps Minimum similarity between query and neighbors
  * \param docs Reference to the entire document stored as a sparse CSR matrix
- * \param matches Reference to Vector of pairs to store the similarity of each document with every other document.
  * \param ncands Reference to int variable to hold number of candidates
+ * \param matches Bounded heaps holding the current top-k neighbors of each document.
+ * \param cand Key-value array of length docs->nrows to accumulate similarities of touched documents
+ * \param marker Marker array of length docs->nrows, all -1 values, to mark touched documents
  *
  * \return Number of similar pairs found
  */
 void findMatches(const int doc_id, const vector<vector<pair<int, float>>>& invertedIndex, const float eps, da_csr_t* docs, idx_t *ncands,
-				vector<map<int, float>>* matches){
+				da_knnheap_t* matches, da_ivkv_t *cand, idx_t *marker){
 
-	ssize_t i;
+	ssize_t i, k, ntouched;
 	idx_t ncand;
 
-    vector<float> cosineSimilarities;
-    cosineSimilarities.resize(doc_id, 0);
-
     ncand = 0;
 
-    for(i=docs->rowptr[doc_id]; i < docs->rowptr[doc_id+1]; i++) {
+    // Accumulate similarities only for the documents found in the query's inverted lists.
+    for(ntouched=0, i=docs->rowptr[doc_id]; i < docs->rowptr[doc_id+1]; i++) {
     	for (const auto& candidatePair: invertedIndex[docs->rowind[i]]) {
-    		cosineSimilarities[candidatePair.first] += docs->rowval[i] * candidatePair.second;
+    		k = candidatePair.first;
+    		if (marker[k] == -1) {
+    			cand[ntouched].key = k;
+    			cand[ntouched].val = 0;
+    			marker[k] = ntouched++;
+    		}
+    		cand[marker[k]].val += docs->rowval[i] * candidatePair.second;
     	}
     }
 
-    // Accumulate the cosine similarity greater than the input eps value
-    for(i=0; i < cosineSimilarities.size(); i++) {
-    	if (cosineSimilarities[i] >= eps) {
-				(*matches)[i].insert(pair<int, float>(doc_id, cosineSimilarities[i]));
-    			(*matches)[doc_id].insert(pair<int, float>(i, cosineSimilarities[i]));
+    // Accumulate the cosine similarity greater than the input eps value and reset the touched markers
+    for(i=0; i < ntouched; i++) {
+    	marker[cand[i].key] = -1;
+    	if (cand[i].val >= eps) {
+				da_knnheap_Insert(matches, cand[i].key, doc_id, cand[i].val);
+				da_knnheap_Insert(matches, doc_id, cand[i].key, cand[i].val);
     			ncand++;
     	}
     }
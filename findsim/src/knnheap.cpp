@@ -0,0 +1,182 @@
+/*!
+ \file  knnheap.c
+ \brief This file contains functions for maintaining the top-$k$ neighbors of each row
+ in a set of bounded min-heaps. The heaps are stored contiguously in a flat array, with
+ row $i$'s heap starting at position $i*k$, such that memory stays in O(k*nrows) no matter
+ how many similar pairs are found.
+
+ Neighbors are ordered by decreasing similarity, with ties broken by decreasing neighbor id.
+ */
+
+#include "includes.h"
+
+/* strict ordering of neighbors: by similarity, then by id */
+#define KNN_LT(a, b) ((a).val < (b).val || ((a).val == (b).val && (a).key < (b).key))
+
+
+/*************************************************************************/
+/*! Allocate memory for a set of bounded neighbor heaps
+    \param nrows is the number of rows (heaps)
+    \param k is the maximum number of neighbors kept for each row
+    \returns the allocated structure, with all heaps empty.
+ */
+/**************************************************************************/
+da_knnheap_t* da_knnheap_Create(const idx_t nrows, const idx_t k)
+{
+    da_knnheap_t *knng;
+
+    knng = (da_knnheap_t *)da_malloc(sizeof(da_knnheap_t), "da_knnheap_Create: knng");
+    knng->nrows = nrows;
+    knng->k     = k;
+    knng->nnbrs = da_inmalloc(nrows, "da_knnheap_Create: nnbrs");
+    knng->heap  = da_ivkvmalloc((size_t)nrows * k, "da_knnheap_Create: heap");
+
+    return knng;
+}
+
+
+/*************************************************************************/
+/*! Frees the memory allocated for a set of neighbor heaps
+    \param knng is the structure to be freed.
+ */
+/**************************************************************************/
+void da_knnheap_Free(da_knnheap_t** knng)
+{
+    if (*knng == NULL)
+        return;
+    da_free((void **)&(*knng)->nnbrs, &(*knng)->heap, LTERM);
+    da_free((void **)knng, LTERM);
+}
+
+
+/*************************************************************************/
+/*! Offer a neighbor to a row's heap. The neighbor is kept if the heap is not
+    full or if it is better than the worst neighbor currently in the heap.
+    \param knng is the set of neighbor heaps
+    \param rid is the row whose heap should be updated
+    \param nid is the id of the neighbor
+    \param sim is the similarity between the row and its neighbor
+    \returns 1 if the neighbor was added to the heap, 0 otherwise.
+ */
+/**************************************************************************/
+char da_knnheap_Insert(da_knnheap_t* const knng, const idx_t rid, const idx_t nid, const val_t sim)
+{
+    ssize_t i, j, n, k;
+    da_ivkv_t *heap, item;
+
+    k    = knng->k;
+    n    = knng->nnbrs[rid];
+    heap = knng->heap + (size_t)rid * k;
+    item.key = nid;
+    item.val = sim;
+
+    if (n < k) {
+        /* sift up */
+        for (i=n; i > 0; i=j) {
+            j = (i-1) >> 1;
+            if (!KNN_LT(item, heap[j]))
+                break;
+            heap[i] = heap[j];
+        }
+        heap[i] = item;
+        knng->nnbrs[rid]++;
+        return 1;
+    }
+
+    if (!KNN_LT(heap[0], item))
+        return 0;
+
+    /* replace the root and sift down */
+    for (i=0; (j=2*i+1) < n; i=j) {
+        if (j+1 < n && KNN_LT(heap[j+1], heap[j]))
+            j++;
+        if (!KNN_LT(heap[j], item))
+            break;
+        heap[i] = heap[j];
+    }
+    heap[i] = item;
+
+    return 1;
+}
+
+
+/*************************************************************************/
+/*! Returns the smallest similarity a new neighbor must exceed in order to
+    enter a row's heap, which is -1 if the heap is not yet full.
+    \param knng is the set of neighbor heaps
+    \param rid is the row whose heap should be inspected
+ */
+/**************************************************************************/
+val_t da_knnheap_Min(const da_knnheap_t* const knng, const idx_t rid)
+{
+    if (knng->nnbrs[rid] < knng->k)
+        return -1.0;
+    return knng->heap[(size_t)rid * knng->k].val;
+}
+
+
+/*************************************************************************/
+/*! Sorts a row's heap in place, in decreasing neighbor order. The heap
+    property is destroyed in the process.
+    \param knng is the set of neighbor heaps
+    \param rid is the row whose heap should be sorted
+ */
+/**************************************************************************/
+void da_knnheap_Sort(da_knnheap_t* const knng, const idx_t rid)
+{
+    ssize_t i, j, n;
+    da_ivkv_t *heap, item;
+
+    heap = knng->heap + (size_t)rid * knng->k;
+
+    /* repeatedly move the smallest item to the end of the heap */
+    for (n=knng->nnbrs[rid]-1; n > 0; n--) {
+        item    = heap[n];
+        heap[n] = heap[0];
+        for (i=0; (j=2*i+1) < n; i=j) {
+            if (j+1 < n && KNN_LT(heap[j+1], heap[j]))
+                j++;
+            if (!KNN_LT(heap[j], item))
+                break;
+            heap[i] = heap[j];
+        }
+        heap[i] = item;
+    }
+}
+
+
+/*************************************************************************/
+/*! Transfers the neighbors in the heaps into a CSR matrix, with each row's
+    neighbors sorted in decreasing order.
+    \param knng is the set of neighbor heaps. The heaps are sorted in the process.
+    \returns the neighbors matrix.
+ */
+/**************************************************************************/
+da_csr_t* da_knnheap_ToCsr(da_knnheap_t* const knng)
+{
+    ssize_t i, j, nnz;
+    da_ivkv_t *heap;
+    da_csr_t *neighbors;
+
+    for (nnz=0, i=0; i < knng->nrows; i++)
+        nnz += knng->nnbrs[i];
+
+    neighbors = da_csr_Create();
+    neighbors->nrows = neighbors->ncols = knng->nrows;
+    neighbors->rowptr = da_pmalloc(knng->nrows + 1, "da_knnheap_ToCsr: neighbors->rowptr");
+    neighbors->rowind = da_imalloc(nnz, "da_knnheap_ToCsr: neighbors->rowind");
+    neighbors->rowval = da_vmalloc(nnz, "da_knnheap_ToCsr: neighbors->rowval");
+    neighbors->rowptr[0] = 0;
+
+    for (nnz=0, i=0; i < knng->nrows; i++) {
+        da_knnheap_Sort(knng, i);
+        heap = knng->heap + (size_t)i * knng->k;
+        for (j=0; j < knng->nnbrs[i]; j++, nnz++) {
+            neighbors->rowind[nnz] = heap[j].key;
+            neighbors->rowval[nnz] = heap[j].val;
+        }
+        neighbors->rowptr[i+1] = nnz;
+    }
+
+    return neighbors;
+}
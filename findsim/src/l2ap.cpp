@@ -0,0 +1,291 @@
+/*!
+ \file  l2ap.c
+ \brief This file contains the L2AP similarity search method. L2AP extends All-Pairs by using
+ prefix L2-norm bounds, in addition to the All-Pairs max-weight bounds, in all three stages of
+ the search:
+   1. indexing: a vector's prefix is left unindexed while both the max-weight bound and the
+      L2-norm of the prefix are below eps;
+   2. candidate generation: new candidates are only admitted while the remaining query prefix
+      could still reach eps, and candidates are pruned as soon as their accumulated score plus
+      the product of the remaining query and candidate prefix norms falls below eps;
+   3. verification: a candidate is only verified if its accumulated score plus the bound on
+      its unindexed prefix can reach eps.
+
+ Each pair of vectors is compared at most once, and similar pairs are offered to the top-$k$ heaps
+ of both vectors.
+
+ Details of the method can be found in
+ David C. Anastasiu and George Karypis. L2AP: Fast Cosine Similarity Search With Prefix L-2 Norm
+ Bounds. Proceedings of the 30th IEEE International Conference on Data Engineering (ICDE 2014).
+ */
+
+#include "includes.h"
+
+// forward declarations
+void l2ap_findMatches(da_csr_t *docs, idx_t rid, float eps, val_t *cmax, val_t *pnorms,
+        idx_t *plen, val_t *ps, ptr_t *colptr, ptr_t *colend, idx_t *colind, val_t *colval, val_t *colpn,
+        val_t *qvec, val_t *qpn, da_ivkv_t *cand, idx_t *marker, da_knnheap_t *knng,
+        size_t *ncands, size_t *nverif);
+
+/**
+ * Main entry point to L2AP.
+ */
+void l2ap(params_t *params)
+{
+    ssize_t i, j, k, rid;
+    size_t nsims, ncands, nverif, nidx;
+    idx_t nrows, ncols, mrl, progressInd, pct;
+    ptr_t *rowptr, *colptr, *colend;
+    idx_t *rowind, *colind, *plen, *marker, *order;
+    val_t *rowval, *colval, *colpn, *cmax, *rmax, *ps, *pnorms, *qvec, *qpn;
+    double b1, b3;
+    da_ivkv_t *cand, *rorder;
+    da_csr_t *docs, *neighbors=NULL;
+    da_knnheap_t *knng;
+
+    docs    = params->docs;
+    ncands  = 0; // number of candidates that accumulated some similarity
+    nverif  = 0; // number of candidates whose similarity was fully computed
+    nsims   = 0; // number of similar documents found
+
+    /** Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF, normalize **/
+    preprocessInputData(params);
+
+    timer_start(params->timer_3); /* overall knn graph construction time */
+
+    nrows  = docs->nrows;
+    ncols  = docs->ncols;
+    rowptr = docs->rowptr;
+    rowind = docs->rowind;
+    rowval = docs->rowval;
+
+    timer_start(params->timer_7); /* indexing time */
+
+    /* max weight of each feature: first value in each column, once column values are sorted */
+    if(!docs->colptr) /* may have been loaded from the cache */
+        da_csr_CreateIndex(docs, DA_COL);
+    da_csr_SortValues(docs, DA_COL, 0, DA_SORT_D);
+    cmax = da_vmalloc(ncols, "l2ap: cmax");
+    for(i=0; i < ncols; i++)
+        cmax[i] = docs->colptr[i+1] > docs->colptr[i] ? docs->colval[docs->colptr[i]] : 0.0;
+    da_csr_FreeBase(docs, DA_COL);
+
+    /* max weight of each vector and max row length */
+    rmax = da_vsmalloc(nrows, 0.0, "l2ap: rmax");
+    for(mrl=0, i=0; i < nrows; i++){
+        for(j=rowptr[i]; j < rowptr[i+1]; j++)
+            if(rowval[j] > rmax[i])
+                rmax[i] = rowval[j];
+        if(rowptr[i+1] - rowptr[i] > mrl)
+            mrl = rowptr[i+1] - rowptr[i];
+    }
+
+    /* vectors are processed in decreasing max weight order */
+    order  = da_imalloc(nrows, "l2ap: order");
+    rorder = da_ivkvmalloc(nrows, "l2ap: rorder");
+    for(i=0; i < nrows; i++){
+        rorder[i].key = i;
+        rorder[i].val = rmax[i];
+    }
+    da_ivkvsortd(nrows, rorder);
+    for(i=0; i < nrows; i++)
+        order[i] = rorder[i].key;
+    da_free((void**)&rorder, LTERM);
+
+    /* find the unindexed prefix of each vector and the bound on its similarity with
+     * future queries, along with the L2-norm of each vector's prefix before each feature */
+    plen   = da_imalloc(nrows, "l2ap: plen");
+    ps     = da_vsmalloc(nrows, 0.0, "l2ap: ps");
+    pnorms = da_vmalloc(rowptr[nrows], "l2ap: pnorms");
+    colptr = da_pnmalloc(ncols+1, "l2ap: colptr");
+    for(i=0; i < nrows; i++){
+        plen[i] = rowptr[i+1] - rowptr[i];
+        for(b1=0.0, b3=0.0, j=rowptr[i]; j < rowptr[i+1]; j++){
+            pnorms[j] = sqrt(b3);
+            b1 += da_min(cmax[rowind[j]], rmax[i]) * rowval[j];
+            b3 += rowval[j] * rowval[j];
+            if(plen[i] == rowptr[i+1] - rowptr[i]){
+                if(da_min(b1, sqrt(b3)) >= params->epsilon){
+                    plen[i] = j - rowptr[i];
+                    colptr[rowind[j]]++;
+                } else {
+                    ps[i] = da_min(b1, sqrt(b3));
+                }
+            } else {
+                colptr[rowind[j]]++;
+            }
+        }
+    }
+    CSRMAKE(i, ncols, colptr);
+    nidx = colptr[ncols];
+
+    /* inverted lists are filled incrementally, in processing order */
+    colind = da_imalloc(nidx, "l2ap: colind");
+    colval = da_vmalloc(nidx, "l2ap: colval");
+    colpn  = da_vmalloc(nidx, "l2ap: colpn");
+    colend = da_pmalloc(ncols, "l2ap: colend");
+    for(i=0; i < ncols; i++)
+        colend[i] = colptr[i];
+    timer_stop(params->timer_7); /* indexing time */
+
+    if(params->verbosity > 0)
+        printf("Indexed %zu of " PRNT_PTRTYPE " nnz (%.2f%%).\n", nidx, rowptr[nrows],
+                rowptr[nrows] > 0 ? 100.0 * nidx / rowptr[nrows] : 0.0);
+
+    /* allocate memory for the search */
+    timer_start(params->timer_5); /* memory allocation time */
+    cand   = da_ivkvmalloc(nrows, "l2ap: cand");
+    marker = da_ismalloc(nrows, -1, "l2ap: marker");
+    qvec   = da_vsmalloc(ncols, 0.0, "l2ap: qvec");
+    qpn    = da_vmalloc(mrl, "l2ap: qpn");
+    knng   = da_knnheap_Create(nrows, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nrows, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    /* execute search */
+    for(i=0; i < nrows; i++){
+        rid = order[i];
+
+        l2ap_findMatches(docs, rid, params->epsilon, cmax, pnorms, plen, ps, colptr, colend, colind,
+                colval, colpn, qvec, qpn, cand, marker, knng, &ncands, &nverif);
+
+        /* index the suffix of the vector, along with the prefix norm before each feature */
+        for(j=rowptr[rid]+plen[rid]; j < rowptr[rid+1]; j++){
+            k = rowind[j];
+            colind[colend[k]]   = rid;
+            colval[colend[k]]   = rowval[j];
+            colpn[colend[k]++]  = pnorms[j];
+        }
+
+        /* update progress indicator */
+        if ( params->verbosity > 0 && i % progressInd == 0 ){
+            da_progress_advance_steps(pct, 10);
+        }
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+    neighbors = da_knnheap_ToCsr(knng);
+    nsims = neighbors->rowptr[nrows];
+    timer_stop(params->timer_3); // find neighbors time
+
+    printf("Number of candidates: %zu\n", ncands);
+    printf("Number of computed similarities: %zu\n", nverif);
+    printf("Number of neighbors: %zu\n", nsims);
+
+    /* write ouptut */
+    if(params->oFile){
+        da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
+        printf("Wrote output to %s\n", params->oFile);
+    }
+
+    /* free memory */
+    da_csr_Free(&neighbors);
+    da_knnheap_Free(&knng);
+    da_free((void**)&cmax, &rmax, &order, &plen, &ps, &pnorms, &colptr, &colind, &colval,
+            &colpn, &colend, &cand, &marker, &qvec, &qpn, LTERM);
+}
+
+
+/**
+ * Find the neighbors of a vector among the vectors indexed so far.
+ * \param docs The pre-processed CSR matrix we're searching in
+ * \param rid Row we're looking for neighbors for
+ * \param eps Minimum similarity between query and neighbors
+ * \param cmax Max weight of each feature in the collection
+ * \param pnorms L2-norm of each vector's prefix before each of its features
+ * \param plen Length of the unindexed prefix of each vector
+ * \param ps Bound on the similarity of each vector's unindexed prefix with future queries
+ * \param colptr Start of each inverted list
+ * \param colend End of each inverted list
+ * \param colind Row ids in the inverted lists
+ * \param colval Values in the inverted lists
+ * \param colpn Prefix norms (before the indexed feature) in the inverted lists
+ * \param qvec Dense array of length docs->ncols of all 0 values, used to scatter the query
+ * \param qpn Array of length at least the query size, to store the query prefix norms
+ * \param cand Key-value array of length docs->nrows to accumulate candidate similarities
+ * \param marker Marker array of length docs->nrows, all -1 values, to mark candidates
+ * \param knng Top-k neighbor heaps for all rows
+ * \param ncands Reference to counter of candidates
+ * \param nverif Reference to counter of fully computed similarities
+ */
+void l2ap_findMatches(da_csr_t *docs, idx_t rid, float eps, val_t *cmax, val_t *pnorms,
+        idx_t *plen, val_t *ps, ptr_t *colptr, ptr_t *colend, idx_t *colind, val_t *colval, val_t *colpn,
+        val_t *qvec, val_t *qpn, da_ivkv_t *cand, idx_t *marker, da_knnheap_t *knng,
+        size_t *ncands, size_t *nverif)
+{
+    ssize_t i, ii, j, k, y, qsz, ncand;
+    ptr_t *rowptr;
+    idx_t *rowind, *qind;
+    val_t *rowval, *qval, w;
+    double rs1, rs2, s;
+
+    rowptr = docs->rowptr;
+    rowind = docs->rowind;
+    rowval = docs->rowval;
+    qsz    = rowptr[rid+1] - rowptr[rid]; /* number of values in query row */
+    qind   = rowind + rowptr[rid];        /* where indices for the query row start */
+    qval   = rowval + rowptr[rid];        /* where values for the query row start */
+
+    if(qsz == 0)
+        return;
+
+    /* scatter the query and find its max-weight remscore and prefix norms */
+    for(rs1=0.0, ii=0; ii < qsz; ii++){
+        qvec[qind[ii]] = qval[ii];
+        qpn[ii] = pnorms[rowptr[rid]+ii];
+        rs1 += qval[ii] * cmax[qind[ii]];
+    }
+
+    /* generate candidates - query features are processed in reverse indexing order */
+    for(ncand=0, ii=qsz-1; ii >= 0; ii--){
+        i   = qind[ii];
+        w   = qval[ii];
+        rs2 = sqrt(qpn[ii]*qpn[ii] + w*w); /* L2-norm of the unprocessed query prefix */
+        for(j=colptr[i]; j < colend[i]; j++){
+            y = colind[j];
+            if(marker[y] == -1){
+                /* new candidates can only be admitted if the unprocessed query prefix can reach eps */
+                if(da_min(rs1, rs2) < eps)
+                    continue;
+                cand[ncand].key = y;
+                cand[ncand].val = 0.0;
+                marker[y] = ncand++;
+            } else if(cand[marker[y]].val < 0){
+                continue; /* already pruned */
+            }
+            k = marker[y];
+            cand[k].val += w * colval[j];
+            /* prune the candidate if its remaining prefixes cannot make up the difference to eps */
+            if(cand[k].val + qpn[ii] * colpn[j] < eps)
+                cand[k].val = -1.0;
+        }
+        rs1 -= w * cmax[i];
+    }
+    *ncands += ncand;
+
+    /* verify candidates against their unindexed prefix */
+    for(k=0; k < ncand; k++){
+        y = cand[k].key;
+        marker[y] = -1;
+        if(cand[k].val < 0 || cand[k].val + ps[y] < eps)
+            continue;
+        (*nverif)++;
+        for(s=cand[k].val, j=rowptr[y]; j < rowptr[y]+plen[y]; j++)
+            s += qvec[rowind[j]] * rowval[j];
+        if(s >= eps){
+            da_knnheap_Insert(knng, rid, y, s);
+            da_knnheap_Insert(knng, y, rid, s);
+        }
+    }
+
+    /* clear the query */
+    for(ii=0; ii < qsz; ii++)
+        qvec[qind[ii]] = 0.0;
+}
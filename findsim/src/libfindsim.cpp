@@ -0,0 +1,388 @@
+/*!
+ \file  libfindsim.c
+ \brief This file contains the implementation of the libfindsim interface (see findsim.h), and
+ the search of a single query vector shared with the serve mode.
+
+ Library calls that allocate memory install a jump buffer in da_errjmp, so that the errors raised
+ by da_errexit, e.g., failed allocations, return to the call, which then returns an error code.
+ Memory is only allocated in the calling thread, never in parallel regions.
+ */
+
+#include "includes.h"
+#include "findsim.h"
+
+struct fs_ctx_t {
+    da_csr_t *docs;               /* preprocessed matrix, with its column index */
+    idx_t incols;                 /* number of columns before compaction */
+    idx_t *colmap;                /* compacted id of each column, -1 if empty */
+    double *cscale;               /* IDF of each compacted column */
+    int32_t nthreads;             /* threads used by fs_search_all */
+};
+
+struct fs_ws_t {
+    idx_t nrows, incols;          /* size of the context the workspace was created for */
+    idx_t *qind;                  /* column ids of a prepared query */
+    val_t *qval;                  /* values of a prepared query */
+    da_ivkv_t *cand;              /* candidates of a query */
+    idx_t *marker;                /* position of each row in cand, -1 if not a candidate */
+    char *seen;                   /* flags of the column ids of a query, all 0 */
+};
+
+
+/**
+ * Check whether a query lists a column more than once. Its values would otherwise be scaled
+ * and normalized as those of distinct columns, yielding similarities above 1.
+ * \param nnz Number of non-zeros in the query
+ * \param ind Column ids of the query; ids outside [0, ncols) are ignored
+ * \param ncols Number of columns
+ * \param seen Space for ncols flags, all 0, and left so
+ *
+ * \return 1 if a column id repeats, 0 otherwise
+ */
+char da_hasRepeats(idx_t nnz, const idx_t *ind, idx_t ncols, char *seen)
+{
+    ssize_t i, j;
+
+    for(i=0; i < nnz; i++){
+        if(ind[i] < 0 || ind[i] >= ncols)
+            continue;
+        if(seen[ind[i]])
+            break;
+        seen[ind[i]] = 1;
+    }
+    for(j=0; j < i; j++)
+        if(ind[j] >= 0 && ind[j] < ncols)
+            seen[ind[j]] = 0;
+
+    return (i < nnz);
+}
+
+
+/**
+ * Prepare a query as the rows of a matrix preprocessed by preprocessInputData: map its columns
+ * to the compacted column space, dropping the columns no row has, scale it by IDF, and
+ * normalize it. The output arrays may be the input arrays.
+ * \param nnz Number of non-zeros in the query
+ * \param ind Column ids of the query, in the column space before compaction
+ * \param val Values of the query
+ * \param incols Number of columns before compaction
+ * \param colmap Compacted id of each column, -1 if empty
+ * \param cscale IDF of each compacted column
+ * \param qind Set to the compacted column ids of the query
+ * \param qval Set to the values of the query
+ *
+ * \return Number of non-zeros of the prepared query, 0 if it has no non-zero value left
+ */
+idx_t da_prepareQuery(idx_t nnz, const idx_t *ind, const val_t *val, idx_t incols,
+        const idx_t *colmap, const double *cscale, idx_t *qind, val_t *qval)
+{
+    ssize_t i;
+    idx_t c, qnnz;
+    double norm;
+
+    for(norm=0.0, qnnz=0, i=0; i < nnz; i++){
+        if(ind[i] < 0 || ind[i] >= incols || (c = colmap[ind[i]]) < 0)
+            continue;
+        qind[qnnz] = c;
+        qval[qnnz] = val[i] * cscale[c];
+        norm += qval[qnnz] * qval[qnnz];
+        qnnz++;
+    }
+    if(norm == 0.0)
+        return 0;
+
+    norm = 1.0/sqrt(norm);
+    for(i=0; i < qnnz; i++)
+        qval[i] *= norm;
+
+    return qnnz;
+}
+
+
+/**
+ * Find the top-k rows of a matrix with at least eps similarity to a prepared query, by
+ * accumulating its similarities via the column index of the matrix, as in IdxJoin.
+ * \param docs Preprocessed matrix, with a column index
+ * \param nnz Number of non-zeros in the query
+ * \param qind Column ids of the query
+ * \param qval Values of the query
+ * \param self Row of docs that is not a candidate, e.g., the query itself, or -1
+ * \param k Number of neighbors
+ * \param eps Minimum similarity of the neighbors
+ * \param cand Space for docs->nrows candidates; set to the neighbors, in decreasing
+ *      similarity order
+ * \param marker Space for docs->nrows positions, all -1, and left so
+ *
+ * \return Number of neighbors
+ */
+idx_t da_topkRow(const da_csr_t *docs, idx_t nnz, const idx_t *qind, const val_t *qval,
+        idx_t self, idx_t k, val_t eps, da_ivkv_t *cand, idx_t *marker)
+{
+    ssize_t ii, j;
+    idx_t r, ncand, nsim;
+    ptr_t *colptr;
+    idx_t *colind;
+    val_t *colval;
+
+    colptr = docs->colptr;
+    colind = docs->colind;
+    colval = docs->colval;
+
+    for(ncand=0, ii=0; ii < nnz; ii++){
+        for(j=colptr[qind[ii]]; j < colptr[qind[ii]+1]; j++){
+            r = colind[j];
+            if(r == self)
+                continue;
+            if(marker[r] == -1){
+                cand[ncand].key = r;
+                cand[ncand].val = 0;
+                marker[r]       = ncand++;
+            }
+            cand[marker[r]].val += colval[j] * qval[ii];
+        }
+    }
+
+    /* keep the top-k candidates with at least eps similarity */
+    for(nsim=0, j=0; j < ncand; j++){
+        marker[cand[j].key] = -1;
+        if(cand[j].val >= eps)
+            cand[nsim++] = cand[j];
+    }
+    nsim = da_ivkvkselectd(nsim, k, cand);
+    da_ivkvsortd(nsim, cand);
+
+    return nsim;
+}
+
+
+/**
+ * Allocate a workspace for a context; errors are raised via da_errexit. The workspace is set
+ * before its arrays are allocated, so that fs_ws_free releases a partially allocated one.
+ */
+static void fs_ws_alloc(const fs_ctx_t *ctx, fs_ws_t **r_ws)
+{
+    fs_ws_t *ws;
+
+    ws = *r_ws = (fs_ws_t*)da_malloc(sizeof(fs_ws_t), "fs_ws_alloc: ws");
+    memset(ws, 0, sizeof(fs_ws_t));
+    ws->nrows  = ctx->docs->nrows;
+    ws->incols = ctx->incols;
+    ws->qind   = da_imalloc(da_max(ctx->incols, 1), "fs_ws_alloc: qind");
+    ws->qval   = da_vmalloc(da_max(ctx->incols, 1), "fs_ws_alloc: qval");
+    ws->cand   = da_ivkvmalloc(da_max(ws->nrows, 1), "fs_ws_alloc: cand");
+    ws->marker = da_ismalloc(da_max(ws->nrows, 1), -1, "fs_ws_alloc: marker");
+    ws->seen   = da_csmalloc(da_max(ctx->incols, 1), 0, "fs_ws_alloc: seen");
+}
+
+
+int fs_build(fs_ctx_t **ctx, int32_t nrows, int32_t ncols, const int64_t *rowptr,
+        const int32_t *rowind, const float *rowval, int32_t nthreads)
+{
+    ssize_t i;
+    jmp_buf jb, *prev;
+    fs_ctx_t * volatile c = NULL;
+    char * volatile seen = NULL;
+    char rep;
+    da_csr_t *docs;
+
+    if(!ctx || nrows < 0 || ncols < 0 || nthreads < 1 || !rowptr || rowptr[0] != 0)
+        return FS_EINVAL;
+    for(i=0; i < nrows; i++)
+        if(rowptr[i+1] < rowptr[i])
+            return FS_EINVAL;
+    if(rowptr[nrows] > 0 && (!rowind || !rowval))
+        return FS_EINVAL;
+    for(i=0; i < rowptr[nrows]; i++)
+        if(rowind[i] < 0 || rowind[i] >= ncols)
+            return FS_EINVAL;
+    *ctx = NULL;
+
+    /* the callees set each array they allocate in c before allocating the next, such that all
+       memory allocated before a failure is freed with c */
+    prev = da_errjmp;
+    if(setjmp(jb)){
+        da_errjmp = prev;
+        da_free((void**)&seen, LTERM);
+        fs_free((fs_ctx_t**)&c);
+        return FS_ENOMEM;
+    }
+    da_errjmp = &jb;
+
+    /* a row listing a column more than once would have similarities above 1 */
+    seen = da_csmalloc(da_max(ncols, 1), 0, "fs_build: seen");
+    for(rep=0, i=0; i < nrows && !rep; i++)
+        rep = da_hasRepeats(rowptr[i+1] - rowptr[i], rowind + rowptr[i], ncols, seen);
+    da_free((void**)&seen, LTERM);
+    if(rep){
+        da_errjmp = prev;
+        return FS_EINVAL;
+    }
+
+    c = (fs_ctx_t*)da_malloc(sizeof(fs_ctx_t), "fs_build: ctx");
+    memset(c, 0, sizeof(fs_ctx_t));
+    c->incols   = ncols;
+    c->nthreads = nthreads;
+    c->docs     = docs = da_csr_Create();
+    da_csr_Alloc(docs, nrows, ncols, rowptr[nrows], DA_ROW, 1);
+    memcpy(docs->rowptr, rowptr, (nrows+1) * sizeof(ptr_t));
+    memcpy(docs->rowind, rowind, rowptr[nrows] * sizeof(idx_t));
+    memcpy(docs->rowval, rowval, rowptr[nrows] * sizeof(val_t));
+
+    /* preprocess as preprocessInputData does, keeping the column map and IDF for queries */
+    da_csr_CompactColumns(docs, &c->colmap, &c->cscale);
+    da_csr_SortIndices(docs, DA_ROW);
+    da_csr_ScaleNormalize(docs, c->cscale);
+    da_csr_CreateIndex(docs, DA_COL);
+
+    da_errjmp = prev;
+    *ctx = c;
+
+    return FS_OK;
+}
+
+
+void fs_free(fs_ctx_t **ctx)
+{
+    if(!ctx || !*ctx)
+        return;
+    da_csr_Free(&(*ctx)->docs);
+    da_free((void**)&(*ctx)->colmap, &(*ctx)->cscale, ctx, LTERM);
+}
+
+
+int fs_ws_create(const fs_ctx_t *ctx, fs_ws_t **ws)
+{
+    jmp_buf jb, *prev;
+
+    if(!ctx || !ws)
+        return FS_EINVAL;
+    *ws = NULL;
+
+    prev = da_errjmp;
+    if(setjmp(jb)){
+        da_errjmp = prev;
+        fs_ws_free(ws);
+        return FS_ENOMEM;
+    }
+    da_errjmp = &jb;
+    fs_ws_alloc(ctx, ws);
+    da_errjmp = prev;
+
+    return FS_OK;
+}
+
+
+void fs_ws_free(fs_ws_t **ws)
+{
+    if(!ws || !*ws)
+        return;
+    da_free((void**)&(*ws)->qind, &(*ws)->qval, &(*ws)->cand, &(*ws)->marker, &(*ws)->seen, ws,
+            LTERM);
+}
+
+
+int fs_search_row(const fs_ctx_t *ctx, fs_ws_t *ws, int32_t nnz, const int32_t *ind,
+        const float *val, int32_t k, float eps, int32_t *ids, float *sims, int32_t *n)
+{
+    ssize_t i;
+    idx_t qnnz, nsim;
+
+    if(!ctx || !ws || ws->nrows != ctx->docs->nrows || ws->incols != ctx->incols || k < 1 ||
+            !(eps >= 0) || nnz < 0 || nnz > ctx->incols || (nnz > 0 && (!ind || !val)) ||
+            !ids || !sims || !n)
+        return FS_EINVAL;
+    for(i=0; i < nnz; i++)
+        if(ind[i] < 0 || ind[i] >= ctx->incols)
+            return FS_EINVAL;
+    if(da_hasRepeats(nnz, ind, ctx->incols, ws->seen))
+        return FS_EINVAL;
+
+    qnnz = da_prepareQuery(nnz, ind, val, ctx->incols, ctx->colmap, ctx->cscale, ws->qind,
+            ws->qval);
+    nsim = da_topkRow(ctx->docs, qnnz, ws->qind, ws->qval, -1, k, eps, ws->cand, ws->marker);
+    for(i=0; i < nsim; i++){
+        ids[i]  = ws->cand[i].key;
+        sims[i] = ws->cand[i].val;
+    }
+    *n = nsim;
+
+    return FS_OK;
+}
+
+
+int fs_search_all(const fs_ctx_t *ctx, int32_t k, float eps, int32_t *ids, float *sims,
+        int32_t *n)
+{
+    ssize_t t, nthreads;
+    jmp_buf jb, *prev;
+    fs_ws_t ** volatile ws = NULL;
+    da_csr_t *docs;
+
+    if(!ctx || k < 1 || !(eps >= 0) || !ids || !sims || !n)
+        return FS_EINVAL;
+    docs     = ctx->docs;
+    nthreads = ctx->nthreads;
+
+    /* a workspace per thread */
+    prev = da_errjmp;
+    if(setjmp(jb)){
+        da_errjmp = prev;
+        if(ws)
+            for(t=0; t < nthreads; t++)
+                fs_ws_free(&ws[t]);
+        da_free((void**)&ws, LTERM);
+        return FS_ENOMEM;
+    }
+    da_errjmp = &jb;
+    ws = (fs_ws_t**)da_malloc(nthreads * sizeof(fs_ws_t*), "fs_search_all: ws");
+    memset(ws, 0, nthreads * sizeof(fs_ws_t*));
+    for(t=0; t < nthreads; t++)
+        fs_ws_alloc(ctx, &ws[t]);
+    da_errjmp = prev;
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+        ssize_t i, j;
+        idx_t nsim;
+        fs_ws_t *w;
+
+#ifdef _OPENMP
+        w = ws[omp_get_thread_num()];
+#else
+        w = ws[0];
+#endif
+
+        #pragma omp for schedule(dynamic, IJ_BLOCKSIZE)
+        for(i=0; i < docs->nrows; i++){
+            nsim = da_topkRow(docs, docs->rowptr[i+1] - docs->rowptr[i],
+                    docs->rowind + docs->rowptr[i], docs->rowval + docs->rowptr[i], i, k, eps,
+                    w->cand, w->marker);
+            for(j=0; j < nsim; j++){
+                ids[i*k+j]  = w->cand[j].key;
+                sims[i*k+j] = w->cand[j].val;
+            }
+            n[i] = nsim;
+        }
+    }
+
+    for(t=0; t < nthreads; t++)
+        fs_ws_free(&ws[t]);
+    da_free((void**)&ws, LTERM);
+
+    return FS_OK;
+}
+
+
+const char *fs_strerror(int code)
+{
+    switch(code){
+    case FS_OK:
+        return "success";
+    case FS_EINVAL:
+        return "invalid argument";
+    case FS_ENOMEM:
+        return "memory allocation failed";
+    default:
+        return "unknown error";
+    }
+}
@@ -129,4 +129,27 @@
 
 
 
+/*-------------------------------------------------------------
+ * SIMD kernels for sparse index intersection (see da_sdot)
+ *-------------------------------------------------------------*/
+#if defined(__AVX512F__)
+    #define DA_SDOT_WIDTH 16
+    #define DA_SDOT_VEC __m512i
+    #define DA_SDOT_LOAD(p) _mm512_loadu_si512((const void *)(p))
+    #define DA_SDOT_CMPEQ(v, x) ((unsigned int)_mm512_cmpeq_epi32_mask((v), _mm512_set1_epi32(x)))
+#elif defined(__AVX2__)
+    #define DA_SDOT_WIDTH 8
+    #define DA_SDOT_VEC __m256i
+    #define DA_SDOT_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+    #define DA_SDOT_CMPEQ(v, x) \
+        ((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32((v), _mm256_set1_epi32(x)))))
+#elif defined(__SSE4_1__)
+    #define DA_SDOT_WIDTH 4
+    #define DA_SDOT_VEC __m128i
+    #define DA_SDOT_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+    #define DA_SDOT_CMPEQ(v, x) \
+        ((unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32((v), _mm_set1_epi32(x)))))
+#endif
+
+
 #endif /* MACROS_H_ */
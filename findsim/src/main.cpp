@@ -38,7 +38,7 @@ int main(int argc, char *argv[]) {
         if(params->mode == MODE_TESTEQUAL) {
             printf("fldelta: %g", params->fldelta);
         }
-        printf("k: %d, eps: %.2f", params->k, params->epsilon);
+        printf("k: %d, eps: %.2f, nthreads: %d", params->k, params->epsilon, params->nthreads);
         printf("\n********************************************************************************\n");
         fflush(stdout);
     }
@@ -51,6 +51,10 @@ int main(int argc, char *argv[]) {
     switch(params->mode){
 
     case MODE_IDXJOIN:
+    case MODE_IDXJOINK:
+    case MODE_IDXJOINSYM:
+    case MODE_IDXJOINTILE:
+    case MODE_IDXJOINBATCH:
         idxjoin(params);
         break;
 
@@ -58,6 +62,15 @@ int main(int argc, char *argv[]) {
         invertedidx(params);
         break;
 
+    case MODE_ALLPAIRS1:
+    case MODE_ALLPAIRS2:
+        allpairs(params);
+        break;
+
+    case MODE_L2AP:
+        l2ap(params);
+        break;
+
     case MODE_TESTEQUAL:
         da_testMatricesEqual(params);
         break;
@@ -74,6 +87,22 @@ int main(int argc, char *argv[]) {
         da_testRecall(params);
         break;
 
+    case MODE_SHARD:
+        da_matrixShard(params);
+        break;
+
+    case MODE_MERGE:
+        da_mergeNeighbors(params);
+        break;
+
+    case MODE_UPDATE:
+        knnupdate(params);
+        break;
+
+    case MODE_SERVE:
+        knnserve(params);
+        break;
+
     default:
         da_errexit("Invalid mode.");
         break;
@@ -102,22 +131,134 @@ int main(int argc, char *argv[]) {
 void readInputData(params_t *params){
     da_csr_t *docs;
 
-    if(!params->iFile){
+    /* the input of the merge mode is a list of files */
+    if(!params->iFile || params->mode == MODE_MERGE){
         return;
     }
 
     params->fmtRead = da_getFileFormat(params->iFile, params->fmtRead);
     if(params->fmtRead < 1)
         da_errexit("Invalid input format.\n");
+
+    /* look for a preprocessed version of the input; utility modes work on the raw input, and
+       queries must be aligned with the raw input */
+    if(params->cacheDir && !params->qFile && params->mode < MODE_SERVE){
+        uint64_t key;
+        char *fname;
+
+        /* the read options seed the hash of the file contents */
+        key = (14695981039346656037ULL ^ (DA_CACHE_VERSION | params->fmtRead << 8 |
+                params->readVals << 16 | params->readNum << 24)) * 1099511628211ULL;
+        key = da_fhash(params->iFile, key);
+        fname = da_getfilename(params->iFile);
+        params->cacheFile = da_cmalloc(strlen(params->cacheDir) + strlen(fname) + 24,
+                "readInputData: cacheFile");
+        sprintf(params->cacheFile, "%s/%s.%016" PRIx64 ".binc", params->cacheDir, fname, key);
+        da_free((void**)&fname, LTERM);
+
+        if(da_fexists(params->cacheFile)){
+            params->docs = da_csr_Read(params->cacheFile, DA_FMT_BINCOL, 1, 0);
+            params->preprocessed = 1;
+            return;
+        }
+    }
+
     docs = da_csr_Read(params->iFile, params->fmtRead, params->readVals, params->readNum);
     assert(docs->rowptr || docs->colptr);
     params->docs = docs;
+
+    if(params->qFile){
+        params->queries = da_csr_Read(params->qFile, da_getFileFormat(params->qFile, 0),
+                params->readVals, params->readNum);
+        if(!params->queries->rowptr)
+            da_csr_CreateIndex(params->queries, DA_ROW);
+    }
 }
 
 /**
- * Test two matrices are equal. Values tested up to params->fldelta precision.
+ * Pre-process input matrix: remove empty columns, ensure sorted column ids, scale by IDF,
+ * and normalize rows. When caching is enabled, the column index is created as well and
+ * the result is saved to params->cacheFile. Matrices loaded from the cache are left as is.
+ * Query rows, if any, are mapped to the column space of the input matrix, scaled by its
+ * IDF, and normalized. In serve mode, the column map and IDF are kept in params for
+ * preparing the queries received later.
+ */
+void preprocessInputData(params_t *params){
+    da_csr_t *docs = params->docs, *queries = params->queries;
+    idx_t ncols, *colmap=NULL;
+    double *cscale;
+    char *tmpfile;
+
+    if(params->preprocessed){
+        if(params->verbosity > 0)
+            printf("Docs matrix: " PRNT_IDXTYPE " rows, " PRNT_IDXTYPE " cols, "
+                PRNT_PTRTYPE " nnz, preprocessed, loaded from %s\n", docs->nrows, docs->ncols,
+                docs->rowptr[docs->nrows], params->cacheFile);
+        return;
+    }
+
+    /* a column index read with the input would not reflect the changes below */
+    if(docs->colptr)
+        da_csr_FreeBase(docs, DA_COL);
+
+    /* compact the column space - columns are ordered in decreasing frequency */
+    ncols = docs->ncols;
+    da_csr_CompactColumns(docs, (queries || params->mode == MODE_SERVE ? &colmap : NULL), &cscale);
+    if(params->verbosity > 0)
+        printf("Docs matrix: " PRNT_IDXTYPE " rows, " PRNT_IDXTYPE " cols, "
+            PRNT_PTRTYPE " nnz\n", docs->nrows, docs->ncols, docs->rowptr[docs->nrows]);
+
+    /* sort the column space */
+    da_csr_SortIndices(docs, DA_ROW);
+
+    /* scale term values by the IDF found while compacting and normalize docs rows */
+    if(params->verbosity > 0)
+        printf("   Scaling input matrix.\n");
+    da_csr_ScaleNormalize(docs, cscale);
+    params->preprocessed = docs->preprocessed = 1;
+
+    if(queries){
+        /* features that no input row has cannot contribute to similarities */
+        da_csr_MapColumns(queries, colmap, ncols, docs->ncols);
+        if(params->verbosity > 0)
+            printf("Query matrix: " PRNT_IDXTYPE " rows, " PRNT_IDXTYPE " cols, "
+                PRNT_PTRTYPE " nnz in the input column space\n", queries->nrows, queries->ncols,
+                queries->rowptr[queries->nrows]);
+        da_csr_SortIndices(queries, DA_ROW);
+        da_csr_ScaleNormalize(queries, cscale);
+    }
+    if(params->mode == MODE_SERVE){
+        params->incols = ncols;
+        params->colmap = colmap;
+        params->cscale = cscale;
+        colmap = NULL;
+        cscale = NULL;
+    }
+    da_free((void**)&cscale, &colmap, LTERM);
+
+    if(!params->cacheFile)
+        return;
+
+    /* save the matrix and its inverted index; write then rename, so concurrent runs
+       never map a partially written file */
+    da_csr_CreateIndex(docs, DA_COL);
+    tmpfile = da_cmalloc(strlen(params->cacheFile) + 24, "preprocessInputData: tmpfile");
+    sprintf(tmpfile, "%s.%d.tmp", params->cacheFile, (int)getpid());
+    da_csr_Write(docs, tmpfile, DA_FMT_BINCOL, 1, 1);
+    if(rename(tmpfile, params->cacheFile) != 0){
+        printf("Warning: could not save preprocessed matrix to %s.\n", params->cacheFile);
+        unlink(tmpfile);
+    } else if(params->verbosity > 0)
+        printf("   Saved preprocessed matrix to %s.\n", params->cacheFile);
+    da_free((void**)&tmpfile, LTERM);
+}
+
+/**
+ * Test two matrices are equal. Values tested up to params->fldelta precision, plus the
+ * precision of values stored as fp16.
  */
 void da_testMatricesEqual(params_t *params){
+    double rtol;
     da_csr_t *docs=NULL, *docs2=NULL;
 
     docs = params->docs;
@@ -129,7 +270,9 @@ void da_testMatricesEqual(params_t *params){
             "%s (B[" PRNT_IDXTYPE "," PRNT_IDXTYPE "," PRNT_PTRTYPE "]).\n\n",
             params->iFile, docs->nrows, docs->ncols, docs->rowptr[docs->nrows],
             params->oFile, docs2->nrows, docs2->ncols, docs2->rowptr[docs2->nrows]);
-    da_csrCompare(docs, docs2, params->fldelta, 1, 1);
+    rtol = da_getValPrec(params->iFile, params->fmtRead) +
+            da_getValPrec(params->oFile, da_getFileFormat(params->oFile, params->fmtWrite));
+    da_csrCompare(docs, docs2, params->fldelta, rtol, 1, 1);
     da_csr_Free(&docs2);
     freeParams(&params);
     exit(EXIT_SUCCESS);
@@ -141,6 +284,7 @@ void da_testMatricesEqual(params_t *params){
  * Test recall of knng solution.
  */
 void da_testRecall(params_t *params){
+    double rtol;
     da_csr_t *docs=NULL, *docs2=NULL;
 
     docs = params->docs;
@@ -156,7 +300,10 @@ void da_testRecall(params_t *params){
             "Test result matrix: %s (B[" PRNT_IDXTYPE "," PRNT_IDXTYPE "," PRNT_PTRTYPE "]).\n\n",
             params->iFile, docs->nrows, docs->ncols, docs->rowptr[docs->nrows],
             params->oFile, docs2->nrows, docs2->ncols, docs2->rowptr[docs2->nrows]);
-    verify_knng_results(docs2, docs, params->k, params->verbosity);
+    /* similarities stored as fp16 are only compared up to their precision */
+    rtol = da_getValPrec(params->iFile, params->fmtRead) +
+            da_getValPrec(params->oFile, da_getFileFormat(params->oFile, params->fmtWrite));
+    verify_knng_results(docs2, docs, params->k, params->verbosity, rtol);
     da_csr_Free(&docs2);
     freeParams(&params);
     exit(EXIT_SUCCESS);
@@ -175,7 +322,7 @@ void da_matrixInfo(params_t *params){
             docs->rowptr[docs->nrows] / ((double) docs->nrows * docs->ncols)
     );
 
-    da_csr_CompactColumns(docs);
+    da_csr_CompactColumns(docs, NULL, NULL);
     printf(PRNT_IDXTYPE " non-empty cols.\n", docs->ncols);
 
     if(params->stats){
@@ -248,13 +395,128 @@ void da_matrixIo(params_t *params){
 }
 
 
+/**
+ * Pre-process the input matrix and split its rows into params->nshards ranges with about the
+ * same number of non-zeros. The pre-processed matrix is saved to the output file in the binr
+ * (default) or binc format, which flag it as pre-processed, and the ranges to
+ * <output-file>.shards, one "start end" pair per line. Tiles of
+ * the neighbor graph can then be computed from the output file by independent ij processes
+ * with -queryrange and -indexrange, and combined with the merge mode.
+ */
+void da_matrixShard(params_t *params){
+    ssize_t i, p;
+    idx_t nrows, *sstart;
+    ptr_t nnz;
+    char *fname;
+    FILE *fpout;
+    da_csr_t *docs;
+
+    if(!params->oFile)
+        da_errexit("Output file required for mode shard!\n");
+    if(params->fmtWrite < 1)
+        params->fmtWrite = DA_FMT_BINROW;
+    if(params->fmtWrite != DA_FMT_BINROW && params->fmtWrite != DA_FMT_BINCOL)
+        da_errexit("The shard mode writes the binr or binc format, which ranged ij requires.\n");
+
+    /* IDF and norms are computed over the whole matrix, so all shards are consistent */
+    preprocessInputData(params);
+    docs  = params->docs;
+    nrows = docs->nrows;
+    nnz   = docs->rowptr[nrows];
+
+    /* shard p starts at the first row starting at or past p/nshards of the non-zeros */
+    sstart = da_imalloc(params->nshards + 1, "da_matrixShard: sstart");
+    for(sstart[0]=0, i=0, p=1; p < params->nshards; p++){
+        while(i < nrows && docs->rowptr[i] < p * nnz / params->nshards)
+            i++;
+        sstart[p] = i;
+    }
+    sstart[params->nshards] = nrows;
+
+    da_csr_Write(docs, params->oFile, params->fmtWrite, 1, 1);
+    printf("Wrote pre-processed matrix to %s\n", params->oFile);
+
+    fname = da_cmalloc(strlen(params->oFile) + 8, "da_matrixShard: fname");
+    sprintf(fname, "%s.shards", params->oFile);
+    fpout = da_fopen(fname, "w", "da_matrixShard: fpout");
+    for(p=0; p < params->nshards; p++){
+        fprintf(fpout, PRNT_IDXTYPE " " PRNT_IDXTYPE "\n", sstart[p], sstart[p+1]);
+        if(params->verbosity > 0)
+            printf("   Shard %zd: rows [" PRNT_IDXTYPE ", " PRNT_IDXTYPE "), " PRNT_PTRTYPE " nnz\n",
+                    p, sstart[p], sstart[p+1], docs->rowptr[sstart[p+1]] - docs->rowptr[sstart[p]]);
+    }
+    da_fclose(fpout);
+    printf("Wrote %d shard row ranges to %s\n", params->nshards, fname);
+
+    da_free((void**)&sstart, &fname, LTERM);
+    freeParams(&params);
+    exit(EXIT_SUCCESS);
+}
+
+
+/**
+ * Combine partial neighbor graphs, e.g., tiles computed by ij with -queryrange and -indexrange,
+ * into the top-k neighbors of each row with at least eps similarity. The input file lists the
+ * partial graphs, one file name per line; they must have the same rows and not share pairs.
+ */
+void da_mergeNeighbors(params_t *params){
+    ssize_t i, j, f;
+    size_t nfiles;
+    idx_t nrows;
+    char **files;
+    da_csr_t *part, *neighbors;
+    da_knnheap_t *knng=NULL;
+
+    if(!params->oFile)
+        da_errexit("Output file required for mode merge!\n");
+    files = da_readfile(params->iFile, &nfiles);
+    nrows = 0;
+
+    for(f=0; f < (ssize_t)nfiles; f++){
+        if(strlen(files[f]) == 0)
+            continue;
+        part = da_csr_Read(files[f], da_getFileFormat(files[f], 0), 1, 1);
+        if(!knng){
+            nrows = part->nrows;
+            knng  = da_knnheap_Create(nrows, params->k);
+        } else if(part->nrows > nrows)
+            da_errexit("Partial graph %s has " PRNT_IDXTYPE " rows, more than the " PRNT_IDXTYPE
+                    " rows of the first partial graph.\n", files[f], part->nrows, nrows);
+        for(i=0; i < part->nrows; i++)
+            for(j=part->rowptr[i]; j < part->rowptr[i+1]; j++)
+                if(part->rowval[j] >= params->epsilon)
+                    da_knnheap_Insert(knng, i, part->rowind[j], part->rowval[j]);
+        if(params->verbosity > 0)
+            printf("   Merged %s (" PRNT_IDXTYPE " rows, " PRNT_PTRTYPE " nnz)\n", files[f],
+                    part->nrows, part->rowptr[part->nrows]);
+        da_csr_Free(&part);
+    }
+    if(!knng)
+        da_errexit("No partial graphs listed in %s.\n", params->iFile);
+
+    neighbors = da_knnheap_ToCsr(knng);
+    printf("Number of neighbors: " PRNT_PTRTYPE "\n", neighbors->rowptr[nrows]);
+    da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
+    printf("Wrote output to %s\n", params->oFile);
+
+    for(f=0; f < (ssize_t)nfiles; f++)
+        da_free((void**)&files[f], LTERM);
+    da_free((void**)&files, LTERM);
+    da_knnheap_Free(&knng);
+    da_csr_Free(&neighbors);
+    freeParams(&params);
+    exit(EXIT_SUCCESS);
+}
+
+
 /**
  * Free memory from the params structure
  */
 void freeParams(params_t** params){
-    da_csr_FreeAll(&(*params)->docs, &(*params)->neighbors, LTERM);
-    da_free((void**)&(*params)->iFile, &(*params)->oFile, &(*params)->vFile,
-            &(*params)->filename, LTERM);
+    da_csr_FreeAll(&(*params)->docs, &(*params)->queries, &(*params)->neighbors, LTERM);
+    da_free((void**)&(*params)->iFile, &(*params)->oFile, &(*params)->vFile, &(*params)->qFile,
+            &(*params)->gFile, &(*params)->aFile, &(*params)->sFile, &(*params)->colmap,
+            &(*params)->cscale, &(*params)->cacheDir, &(*params)->cacheFile, &(*params)->filename, LTERM);
 
     da_free((void**)params, LTERM);
 }
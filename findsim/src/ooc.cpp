@@ -0,0 +1,366 @@
+/*!
+ \file  ooc.c
+ \brief This file contains the out-of-core version of IdxJoin, used when a memory budget is
+ given via -memlimit. Only the top-$k$ heaps of all rows must fit in memory. It also contains
+ the search of a single tile (a range of query rows against a range of index rows) of a matrix
+ split by the shard mode.
+
+ The rows of the input are partitioned into blocks whose size is chosen such that two blocks,
+ their column indexes, and the search accumulators fit in the memory budget, next to the heaps.
+ Each block is preprocessed (scaled by the IDF of the whole input and normalized), indexed, and
+ written to a temporary file in the binc format. The blocks are then taken in turn as the index
+ block: the other blocks are streamed through its column index, and the similarities of their
+ rows with the rows of the index block are offered to the top-$k$ heaps of the query rows. After
+ all passes, the heaps hold the exact Min-epsilon K-Nearest Neighbor graph.
+
+ Block files are memory-mapped when read, so only the pages being searched need to be resident.
+ The input matrix is only read, so a memory-mapped input (binr or binc format) is never loaded
+ in full. The block files are removed when the search ends, or is stopped by an error (which
+ raises SIGTERM) or SIGINT.
+ */
+
+#include "includes.h"
+
+/* temporary directory of the block files, removed when the search ends or is stopped */
+static char *ooc_dir = NULL, *ooc_fname = NULL;
+static ssize_t ooc_nblocks = 0;
+
+static void ooc_removeBlocks(void)
+{
+    ssize_t b;
+
+    for(b=0; b < ooc_nblocks; b++){
+        sprintf(ooc_fname, "%s/%zd.binc", ooc_dir, b);
+        unlink(ooc_fname);
+    }
+    rmdir(ooc_dir);
+}
+
+static void ooc_stop(int sig)
+{
+    ooc_removeBlocks();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * Main entry point to out-of-core IdxJoin.
+ */
+void idxjoin_ooc(params_t *params)
+{
+    ssize_t i, a, b, nblocks;
+    size_t ncands, nsims, avail, need, rowcost, nnzcost, bsz;
+    idx_t nrows, ncols, progressInd, pct;
+    idx_t *bstart;
+    double *cscale=NULL;
+    char *tmpdir, *dir, *fname;
+    da_csr_t *docs, *iblk, *qblk, *neighbors=NULL;
+    da_knnheap_t *knng;
+
+    docs    = params->docs;
+    nrows   = docs->nrows;
+    ncols   = docs->ncols;
+    ncands  = 0; // number of considered candidates (computed similarities)
+    nsims   = 0; // number of similar documents found
+
+    timer_start(params->timer_3); /* overall knn graph construction time */
+
+    /* memory left for blocks next to the heaps and the output matrix created from them; each
+       nonzero is stored in row and column form in the index block and in row form in the query
+       block, and each row of the index block needs a marker and a candidate slot in each thread */
+    need    = (size_t)nrows * (2 * params->k * sizeof(da_ivkv_t) + 2 * sizeof(idx_t) + sizeof(ptr_t))
+            + ncols * (sizeof(double) + sizeof(idx_t) + sizeof(ptr_t));
+    rowcost = 2 * sizeof(ptr_t) + params->nthreads * (sizeof(idx_t) + sizeof(da_ivkv_t));
+    nnzcost = 3 * (sizeof(idx_t) + sizeof(val_t));
+    if(params->memlimit <= need + rowcost + nnzcost)
+        da_errexit("The -memlimit budget must exceed %.1f MB to hold the neighbor heaps.\n",
+                (need + rowcost + nnzcost) / 1048576.0);
+    avail   = params->memlimit - need;
+
+    /* partition the rows into blocks that fit in the budget */
+    bstart  = da_imalloc(nrows + 1, "idxjoin_ooc: bstart");
+    for(nblocks=0, bstart[0]=0, bsz=0, i=0; i < nrows; i++){
+        size_t rsz = rowcost + (docs->rowptr[i+1] - docs->rowptr[i]) * nnzcost;
+        if(bsz > 0 && bsz + rsz > avail){
+            bstart[++nblocks] = i;
+            bsz = 0;
+        }
+        bsz += rsz;
+    }
+    bstart[++nblocks] = nrows;
+
+    /* IDF of the whole input */
+    if(!params->preprocessed)
+        cscale = da_csr_GetIdf(docs);
+
+    /* write the blocks to a temporary directory */
+    tmpdir = getenv("TMPDIR");
+    dir    = da_cmalloc(strlen(tmpdir ? tmpdir : "/tmp") + 24, "idxjoin_ooc: dir");
+    sprintf(dir, "%s/findsim.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    if(!mkdtemp(dir))
+        da_errexit("Could not create a temporary directory in %s.\n", tmpdir ? tmpdir : "/tmp");
+    fname  = da_cmalloc(strlen(dir) + 32, "idxjoin_ooc: fname");
+    ooc_dir     = dir;
+    ooc_fname   = da_cmalloc(strlen(dir) + 32, "idxjoin_ooc: ooc_fname");
+    ooc_nblocks = nblocks;
+    signal(SIGINT, ooc_stop);
+    signal(SIGTERM, ooc_stop);
+    if(params->verbosity > 0)
+        printf("Out-of-core search: %zd blocks of at most %.1f MB in %s.\n", nblocks,
+                avail / 1048576.0, dir);
+
+    timer_start(params->timer_7); /* indexing time */
+    for(b=0; b < nblocks; b++){
+        iblk = ooc_makeBlock(docs, bstart[b], bstart[b+1], cscale, 1);
+        sprintf(fname, "%s/%zd.binc", dir, b);
+        da_csr_Write(iblk, fname, DA_FMT_BINCOL, 1, 1);
+        da_csr_Free(&iblk);
+    }
+    timer_stop(params->timer_7); /* indexing time */
+
+    /* the input is no longer needed */
+    da_csr_Free(&params->docs);
+    da_free((void**)&cscale, LTERM);
+
+    timer_start(params->timer_5); /* memory allocation time */
+    knng = da_knnheap_Create(nrows, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+
+    /* set up progress indicator */
+    da_progress_init_steps(pct, progressInd, nblocks*nblocks, 10);
+    if(params->verbosity > 0)
+        printf("Progress Indicator: ");
+
+    /* stream all blocks through the column index of each block */
+    for(b=0; b < nblocks; b++){
+        sprintf(fname, "%s/%zd.binc", dir, b);
+        iblk = da_csr_Read(fname, DA_FMT_BINCOL, 1, 0);
+        for(a=0; a < nblocks; a++){
+            if(a == b)
+                qblk = iblk;
+            else {
+                sprintf(fname, "%s/%zd.binc", dir, a);
+                qblk = da_csr_Read(fname, DA_FMT_BINCOL, 1, 0);
+            }
+            ncands += ooc_searchBlock(params, qblk, bstart[a], iblk, bstart[b], knng, 0);
+            if(qblk != iblk)
+                da_csr_Free(&qblk);
+
+            /* update progress indicator */
+            if ( params->verbosity > 0 && (b*nblocks + a) % progressInd == 0 ){
+                da_progress_advance_steps(pct, 10);
+            }
+        }
+        da_csr_Free(&iblk);
+    }
+    if(params->verbosity > 0){
+        da_progress_finalize_steps(pct, 10);
+        printf("\n");
+    }
+
+    neighbors = da_knnheap_ToCsr(knng);
+    nsims     = neighbors->rowptr[nrows];
+    da_knnheap_Free(&knng);
+
+    timer_stop(params->timer_3); // find neighbors time
+
+    printf("Number of computed similarities: %zu\n", ncands);
+    printf("Number of neighbors: %zu\n", nsims);
+
+    /* write ouptut */
+    if(params->oFile){
+        da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
+        printf("Wrote output to %s\n", params->oFile);
+    }
+
+    /* remove the blocks */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    ooc_removeBlocks();
+    ooc_dir = NULL;
+
+    /* free memory */
+    da_csr_Free(&neighbors);
+    da_free((void**)&bstart, &dir, &fname, &ooc_fname, LTERM);
+}
+
+
+/**
+ * Create a block of rows of the input matrix, preprocessed and optionally with a column index.
+ * \param docs Input matrix, which is not modified
+ * \param r0 First row of the block
+ * \param r1 Row past the last row of the block
+ * \param cscale IDF of each column, or NULL if docs has already been preprocessed
+ * \param index Whether to create the column index of the block
+ *
+ * \return The block
+ */
+da_csr_t *ooc_makeBlock(da_csr_t *docs, idx_t r0, idx_t r1, double *cscale, char index)
+{
+    ssize_t i, j;
+    ptr_t off;
+    da_csr_t *blk;
+
+    off = docs->rowptr[r0];
+    blk = da_csr_Create();
+    da_csr_Alloc(blk, r1 - r0, docs->ncols, docs->rowptr[r1] - off, DA_ROW, 1);
+    for(i=r0; i <= r1; i++)
+        blk->rowptr[i-r0] = docs->rowptr[i] - off;
+    memcpy(blk->rowind, docs->rowind + off, (docs->rowptr[r1] - off) * sizeof(idx_t));
+    memcpy(blk->rowval, docs->rowval + off, (docs->rowptr[r1] - off) * sizeof(val_t));
+
+    if(cscale){
+        /* sort, scale by IDF, and normalize, as preprocessInputData does */
+        da_csr_SortIndices(blk, DA_ROW);
+        da_csr_ScaleNormalize(blk, cscale);
+    }
+    if(index)
+        da_csr_CreateIndex(blk, DA_COL);
+
+    return blk;
+}
+
+
+/**
+ * Compare the rows of a query block against the rows of an index block, and offer the
+ * similarities of at least eps to the heaps of the query rows. Each query row is handled by
+ * a single thread, so the heaps need no locking.
+ * \param params Program parameters
+ * \param qblk Query block
+ * \param qstart Id of the first row of the query block
+ * \param iblk Index block, with a column index
+ * \param istart Id of the first row of the index block
+ * \param knng Top-k heaps of the query rows
+ * \param hstart Id of the row of the first heap in knng
+ *
+ * \return Number of computed similarities
+ */
+size_t ooc_searchBlock(params_t *params, da_csr_t *qblk, idx_t qstart, da_csr_t *iblk,
+        idx_t istart, da_knnheap_t *knng, idx_t hstart)
+{
+    ssize_t i;
+    size_t ncands;
+    idx_t nrows;
+
+    nrows  = iblk->nrows;
+    ncands = 0;
+
+    #pragma omp parallel private(i) reduction(+:ncands)
+    {
+        ssize_t ii, j, k, qsz;
+        idx_t ncand, *qind, *marker, *colind;
+        ptr_t *colptr;
+        val_t *qval, *colval;
+        da_ivkv_t *cand;
+
+        colptr = iblk->colptr;
+        colind = iblk->colind;
+        colval = iblk->colval;
+        cand   = da_ivkvmalloc(nrows, "ooc_searchBlock: cand");
+        marker = da_ismalloc(nrows, -1, "ooc_searchBlock: marker");
+
+        #pragma omp for schedule(dynamic, IJ_BLOCKSIZE)
+        for(i=0; i < qblk->nrows; i++){
+            qsz  = qblk->rowptr[i+1] - qblk->rowptr[i];
+            qind = qblk->rowind + qblk->rowptr[i];
+            qval = qblk->rowval + qblk->rowptr[i];
+
+            for(ncand=0, ii=0; ii < qsz; ii++){
+                for(j=colptr[qind[ii]]; j < colptr[qind[ii]+1]; j++){
+                    k = colind[j];
+                    if(k + istart == i + qstart)
+                        continue;
+                    if(marker[k] == -1){
+                        cand[ncand].key = k;
+                        cand[ncand].val = 0;
+                        marker[k]       = ncand++;
+                    }
+                    cand[marker[k]].val += colval[j] * qval[ii];
+                }
+            }
+            ncands += ncand;
+
+            for(j=0; j < ncand; j++){
+                marker[cand[j].key] = -1;
+                if(cand[j].val >= params->epsilon)
+                    da_knnheap_Insert(knng, i + qstart - hstart, cand[j].key + istart, cand[j].val);
+            }
+        }
+
+        da_free((void**)&cand, &marker, LTERM);
+    }
+
+    return ncands;
+}
+
+
+/**
+ * Compute one tile of the neighbor graph of a matrix preprocessed by the shard mode: the rows
+ * in params->qrange are compared against the rows in params->irange. The output has the
+ * rows of the whole matrix, with neighbors only in the query rows, such that the tiles can be
+ * combined by the merge mode.
+ */
+void idxjoin_range(params_t *params)
+{
+    ssize_t i, j;
+    size_t ncands, nsims;
+    idx_t nrows, qs, qe, is, ie;
+    ptr_t *rowptr;
+    da_csr_t *docs, *qblk, *iblk, *neighbors;
+    da_knnheap_t *knng;
+
+    docs   = params->docs;
+    nrows  = docs->nrows;
+    qs     = params->qrange[0];
+    qe     = (params->qrange[1] < 0 ? nrows : params->qrange[1]);
+    is     = params->irange[0];
+    ie     = (params->irange[1] < 0 ? nrows : params->irange[1]);
+    if(!docs->preprocessed)
+        da_errexit("The -queryrange and -indexrange parameters require an input pre-processed by the "
+                "shard mode, which %s is not.\n", params->iFile);
+    if(qs > qe || qe > nrows || is > ie || ie > nrows)
+        da_errexit("The query and index ranges must be within the " PRNT_IDXTYPE " rows of the input.\n",
+                nrows);
+    if(params->verbosity > 0)
+        printf("Docs matrix: " PRNT_IDXTYPE " rows, " PRNT_IDXTYPE " cols, " PRNT_PTRTYPE " nnz, "
+                "queries [" PRNT_IDXTYPE ", " PRNT_IDXTYPE "), index [" PRNT_IDXTYPE ", " PRNT_IDXTYPE ")\n",
+                nrows, docs->ncols, docs->rowptr[nrows], qs, qe, is, ie);
+
+    timer_start(params->timer_3); /* overall knn graph construction time */
+
+    timer_start(params->timer_7); /* indexing time */
+    iblk = ooc_makeBlock(docs, is, ie, NULL, 1);
+    qblk = ooc_makeBlock(docs, qs, qe, NULL, 0);
+    timer_stop(params->timer_7); /* indexing time */
+
+    knng   = da_knnheap_Create(qe - qs, params->k);
+    ncands = ooc_searchBlock(params, qblk, qs, iblk, is, knng, qs);
+    da_csr_Free(&qblk);
+    da_csr_Free(&iblk);
+
+    /* place the neighbors of the query rows in the row space of the input */
+    neighbors = da_knnheap_ToCsr(knng);
+    da_knnheap_Free(&knng);
+    nsims  = neighbors->rowptr[qe - qs];
+    rowptr = da_pmalloc(nrows + 1, "idxjoin_range: rowptr");
+    for(i=0; i <= nrows; i++){
+        j = da_min(da_max(i, qs), qe) - qs;
+        rowptr[i] = neighbors->rowptr[j];
+    }
+    da_free((void**)&neighbors->rowptr, LTERM);
+    neighbors->rowptr = rowptr;
+    neighbors->nrows  = neighbors->ncols = nrows;
+
+    timer_stop(params->timer_3); // find neighbors time
+
+    printf("Number of computed similarities: %zu\n", ncands);
+    printf("Number of neighbors: %zu\n", nsims);
+
+    /* write ouptut */
+    if(params->oFile){
+        da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
+        printf("Wrote output to %s\n", params->oFile);
+    }
+
+    da_csr_Free(&neighbors);
+}
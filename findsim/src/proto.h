@@ -18,10 +18,13 @@ extern "C"
 
 /* main.cc */
 void      readInputData(params_t *params);
+void      preprocessInputData(params_t *params);
 void      da_testMatricesEqual(params_t *params);
 void      da_testRecall(params_t *params);
 void      da_matrixInfo(params_t *params);
 void      da_matrixIo(params_t *params);
+void      da_matrixShard(params_t *params);
+void      da_mergeNeighbors(params_t *params);
 void      freeParams(params_t** params);
 
 
@@ -31,11 +34,47 @@ void      idxjoin(params_t *params);
 /* invertedidx.cc */
 void      invertedidx(params_t *params);
 
+/* allpairs.cc */
+void      allpairs(params_t *params);
+
+/* l2ap.cc */
+void      l2ap(params_t *params);
+
+/* ooc.cc */
+void      idxjoin_ooc(params_t *params);
+void      idxjoin_range(params_t *params);
+da_csr_t* ooc_makeBlock(da_csr_t *docs, idx_t r0, idx_t r1, double *cscale, char index);
+size_t    ooc_searchBlock(params_t *params, da_csr_t *qblk, idx_t qstart, da_csr_t *iblk,
+              idx_t istart, da_knnheap_t *knng, idx_t hstart);
+
+/* update.cc */
+void      knnupdate(params_t *params);
+
+/* serve.cc */
+void      knnserve(params_t *params);
+
+/* libfindsim.cc */
+char      da_hasRepeats(idx_t nnz, const idx_t *ind, idx_t ncols, char *seen);
+idx_t     da_prepareQuery(idx_t nnz, const idx_t *ind, const val_t *val, idx_t incols,
+              const idx_t *colmap, const double *cscale, idx_t *qind, val_t *qval);
+idx_t     da_topkRow(const da_csr_t *docs, idx_t nnz, const idx_t *qind, const val_t *qval,
+              idx_t self, idx_t k, val_t eps, da_ivkv_t *cand, idx_t *marker);
+
+/* knnheap.cc */
+da_knnheap_t* da_knnheap_Create(idx_t const nrows, idx_t const k);
+void      da_knnheap_Free(da_knnheap_t** knng);
+char      da_knnheap_Insert(da_knnheap_t* const knng, idx_t const rid, idx_t const nid, val_t const sim);
+val_t     da_knnheap_Min(const da_knnheap_t* const knng, idx_t const rid);
+void      da_knnheap_Sort(da_knnheap_t* const knng, idx_t const rid);
+da_csr_t* da_knnheap_ToCsr(da_knnheap_t* const knng);
+
 /* util.cc */
+extern __thread jmp_buf *da_errjmp;
 void      da_errexit(const char* const f_str,...);
 char      da_getFileFormat(char *file, char const format);
-void      da_csrCompare(da_csr_t *a, da_csr_t *b, float eps, char compInds, char compVals);
-void      verify_knng_results(da_csr_t *ngbrs1, da_csr_t *ngbrs2, idx_t nsz, char print_errors);
+double    da_getValPrec(char *file, char const format);
+void      da_csrCompare(da_csr_t *a, da_csr_t *b, float eps, double rtol, char compInds, char compVals);
+void      verify_knng_results(da_csr_t *ngbrs1, da_csr_t *ngbrs2, idx_t nsz, char print_errors, double rtol);
 
 
 /* cmdline.cc */
@@ -70,11 +109,13 @@ char*     da_getbasename(const char* const path);
 char*     da_getextname(const char* const path);
 char*     da_getfilename(const char* const path);
 char*     da_getpathname(const char* const path);
+uint64_t  da_fhash(const char* const fname, uint64_t const seed);
 int       da_mkpath(const char* const path);
 int       da_rmpath(const char* const path);
 FILE*     da_fopen(const char* const fname, const char* const mode, const char* const msg);
 void      da_fclose(FILE* stream);
 ssize_t   da_read(int const fd, void *vbuf, const size_t count);
+ssize_t   da_write(int const fd, const void *vbuf, const size_t count);
 ssize_t   da_getline(char** lineptr, size_t* n, FILE* stream);
 char**    da_readfile(const char* const fname, size_t* r_nlines);
 
@@ -89,7 +130,9 @@ void       da_csr_FreeAll(da_csr_t** ptr1, ...);
 void       da_csr_FreeBase(da_csr_t* const mat, char const type);
 void       da_csr_LoadBases(da_csr_t* const csr);
 void       da_csr_FreeContents(da_csr_t* const mat);
+void       da_csr_FreeArrays(const da_csr_t* const mat, void** ptr1, ...);
 da_csr_t*  da_csr_Copy(const da_csr_t* const mat);
+da_csr_t*  da_csr_AppendRows(const da_csr_t* const a, const da_csr_t* const b);
 void       da_csr_Grow(da_csr_t* const mat, const ptr_t newNnz);
 da_csr_t*  da_csr_Read(const char* const filename,
               char const format, char readvals, char numbering);
@@ -98,7 +141,9 @@ void       da_csr_Write(const da_csr_t* const mat, const char* const filename,
 void       da_csr_PrintInfo(const da_csr_t* const mat, const char* const name, const char* const suffix);
 void       da_csr_Print(const da_csr_t* const mat);
 char       da_csr_isClutoOrCsr(const char* const file);
-void       da_csr_CompactColumns(da_csr_t* const mat);
+void       da_csr_CompactColumns(da_csr_t* const mat, idx_t** const r_colmap, double** const r_idf);
+void       da_csr_MapColumns(da_csr_t* const mat, const idx_t* const colmap,
+                const idx_t ncols, const idx_t nncols);
 void       da_csr_CompactRows(da_csr_t* const mat);
 void       da_csr_SortIndices(da_csr_t* const mat, char const what);
 char       da_csr_CheckSortedIndex(da_csr_t* const mat, char const what);
@@ -106,8 +151,22 @@ void       da_csr_SortValues(da_csr_t * const mat, char const what, idx_t const
 void       da_csr_CreateIndex(da_csr_t * const mat, char const what);
 void       da_csr_Normalize(da_csr_t* const mat, char const what, char const norm);
 void       da_csr_Scale(da_csr_t* const mat);
+double*    da_csr_GetIdf(const da_csr_t* const mat);
+void       da_csr_ScaleColumns(da_csr_t* const mat, const double* const cscale);
+void       da_csr_ScaleNormalize(da_csr_t* const mat, const double* const cscale);
 char       da_csr_Compare(const da_csr_t* const a, const da_csr_t* const b, const double p);
 void       da_csr_Transpose(da_csr_t * const mat);
+da_cidx_t* da_cidx_Create(const da_csr_t* const mat);
+void       da_cidx_Free(da_cidx_t** const cidx);
+const unsigned char* da_cidx_Decode(const unsigned char* s, const idx_t n, idx_t* const ids);
+da_qidx_t* da_qidx_Create(const da_csr_t* const mat, const char nbits);
+void       da_qidx_Free(da_qidx_t** const qidx);
+val_t      da_sdot(const idx_t n1, const idx_t* const ind1, const val_t* const val1,
+                const idx_t n2, const idx_t* const ind2, const val_t* const val2);
+val_t      da_csr_ComputeDot(const da_csr_t* const mat, const idx_t rc1, const idx_t rc2,
+                const char what);
+val_t      da_csr_ComputeSimilarity(const da_csr_t* const mat, const idx_t rc1, const idx_t rc2,
+                const char what, const char normalized);
 
 
 /* sort.cc */
@@ -123,6 +182,9 @@ DA_MKSORT_PROTO(da_iikv, da_iikv_t)
 DA_MKSORT_PROTO(da_pikv, da_pikv_t)
 DA_MKSORT_PROTO(da_ivkv, da_ivkv_t)
 
+void     da_ivkvsortik(const size_t n, da_ivkv_t* const base);
+void     da_ivkvsortdk(const size_t n, da_ivkv_t* const base);
+
 idx_t da_ivkvkselectd(size_t n, idx_t topk, da_ivkv_t *cand);
 idx_t da_ivkvkselecti(size_t n, idx_t topk, da_ivkv_t *cand);
 
@@ -0,0 +1,204 @@
+/*!
+ \file  serve.c
+ \brief This file contains the serve mode, which answers k-NN queries over a Unix domain socket.
+
+ The input matrix is preprocessed and its column index is built once, then kept resident while
+ queries are answered, so each query only pays for its own search. A query is a raw sparse
+ vector in the column space of the input file, together with k and eps. It is prepared as the
+ rows of the input were: its columns are mapped to the compacted column space, its values are
+ scaled by the IDF of the input, and it is normalized. Its similarities with the input rows are
+ then accumulated via the column index, as in IdxJoin, and the top-k neighbors with at least eps
+ similarity are sent back. See struct.h for the layout of queries and responses.
+
+ Connections are handled by a pool of -nthreads workers, each accepting a connection and
+ answering its queries in turn until the client closes it. The server runs until it receives
+ SIGINT or SIGTERM, which removes the socket file.
+ */
+
+#include "includes.h"
+
+/* socket path, removed when the server is stopped */
+static const char *serve_path = NULL;
+
+static void serve_stop(int sig)
+{
+    unlink(serve_path);
+    _exit(EXIT_SUCCESS);
+}
+
+
+/**
+ * Read len bytes from a connection.
+ * \return 1 on success, 0 if the connection was closed or failed
+ */
+static char serve_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    char *p = (char*)buf;
+
+    while(len > 0){
+        n = read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        p   += n;
+        len -= n;
+    }
+    return 1;
+}
+
+
+/**
+ * Write len bytes to a connection.
+ * \return 1 on success, 0 if the connection failed
+ */
+static char serve_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+    const char *p = (const char*)buf;
+
+    while(len > 0){
+        n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        p   += n;
+        len -= n;
+    }
+    return 1;
+}
+
+
+/**
+ * Answer the queries sent over a connection until the client closes it or sends an invalid
+ * query header.
+ * \param params Program parameters, with the preprocessed input and its column map and IDF
+ * \param fd Connection
+ * \param qind Space for the column ids of a query (params->incols)
+ * \param qval Space for the values of a query (params->incols)
+ * \param cand Space for the candidates of a query (number of input rows)
+ * \param marker Position of each input row in cand, all -1 (number of input rows)
+ * \param seen Flags for the column ids of a query, all 0 (params->incols)
+ * \param out Space for a response (header and number of input rows neighbors)
+ */
+static void serve_connection(params_t *params, int fd, idx_t *qind, val_t *qval, da_ivkv_t *cand,
+        idx_t *marker, char *seen, char *out)
+{
+    ssize_t j;
+    idx_t nnz, nsim;
+    da_srvquery_t query;
+    da_srvresp_t *resp;
+    idx_t *rind;
+    val_t *rval;
+
+    resp   = (da_srvresp_t*)out;
+    rind   = (idx_t*)(out + sizeof(da_srvresp_t));
+
+    while(serve_read(fd, &query, sizeof(query))){
+        if(query.k < 1 || !(query.eps >= 0) || query.nnz < 0 || query.nnz > params->incols){
+            resp->status = DA_SRV_EINVAL;
+            resp->n      = 0;
+            serve_write(fd, resp, sizeof(da_srvresp_t));
+            return;
+        }
+        if(!serve_read(fd, qind, query.nnz * sizeof(idx_t)) ||
+                !serve_read(fd, qval, query.nnz * sizeof(val_t)))
+            return;
+        if(da_hasRepeats(query.nnz, qind, params->incols, seen)){
+            resp->status = DA_SRV_EINVAL;
+            resp->n      = 0;
+            serve_write(fd, resp, sizeof(da_srvresp_t));
+            return;
+        }
+
+        /* map to the compacted column space, scale by IDF, normalize, and search */
+        nnz  = da_prepareQuery(query.nnz, qind, qval, params->incols, params->colmap,
+                params->cscale, qind, qval);
+        nsim = da_topkRow(params->docs, nnz, qind, qval, -1, query.k, query.eps, cand, marker);
+
+        resp->status = DA_SRV_OK;
+        resp->n      = nsim;
+        rval = (val_t*)(rind + nsim);
+        for(j=0; j < nsim; j++){
+            rind[j] = cand[j].key;
+            rval[j] = cand[j].val;
+        }
+        if(!serve_write(fd, out, sizeof(da_srvresp_t) + nsim * (sizeof(idx_t) + sizeof(val_t))))
+            return;
+    }
+}
+
+
+/**
+ * Main entry point to the serve mode.
+ */
+void knnserve(params_t *params)
+{
+    int sfd;
+    idx_t nrows;
+    struct sockaddr_un addr;
+    da_csr_t *docs;
+
+    /* preprocess and index the input once */
+    preprocessInputData(params);
+    docs  = params->docs;
+    nrows = docs->nrows;
+    da_csr_CreateIndex(docs, DA_COL);
+
+    if(strlen(params->sFile) >= sizeof(addr.sun_path))
+        da_errexit("The socket path %s is too long.\n", params->sFile);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, params->sFile);
+
+    /* a stale socket file from a previous server would make bind fail */
+    unlink(params->sFile);
+    if((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sfd, SOMAXCONN) < 0)
+        da_errexit("Could not listen on socket %s: %s\n", params->sFile, strerror(errno));
+
+    serve_path = params->sFile;
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+    signal(SIGPIPE, SIG_IGN); /* clients that disconnect early fail the write instead */
+
+    printf("Serving " PRNT_IDXTYPE " rows on %s with %d workers.\n", nrows, params->sFile,
+            params->nthreads);
+    fflush(stdout);
+
+    #pragma omp parallel num_threads(params->nthreads)
+    {
+        int cfd;
+        idx_t *qind, *marker;
+        val_t *qval;
+        da_ivkv_t *cand;
+        char *seen, *out;
+
+        qind   = da_imalloc(params->incols, "knnserve: qind");
+        qval   = da_vmalloc(params->incols, "knnserve: qval");
+        cand   = da_ivkvmalloc(nrows, "knnserve: cand");
+        marker = da_ismalloc(nrows, -1, "knnserve: marker");
+        seen   = da_csmalloc(params->incols, 0, "knnserve: seen");
+        out    = da_cmalloc(sizeof(da_srvresp_t) + (size_t)nrows * (sizeof(idx_t) + sizeof(val_t)),
+                "knnserve: out");
+
+        while(1){
+            cfd = accept(sfd, NULL, NULL);
+            if(cfd < 0){
+                if(errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                printf("Could not accept connection: %s\n", strerror(errno));
+                break;
+            }
+            serve_connection(params, cfd, qind, qval, cand, marker, seen, out);
+            close(cfd);
+        }
+
+        da_free((void**)&qind, &qval, &cand, &marker, &seen, &out, LTERM);
+    }
+
+    close(sfd);
+    unlink(params->sFile);
+}
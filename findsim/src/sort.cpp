@@ -148,6 +148,29 @@ void da_ivkvsortd(const size_t n, da_ivkv_t* const base)
 }
 
 
+
+/*************************************************************************/
+/*! Sorts an array of da_ivkv_t in increasing order of keys */
+/*************************************************************************/
+void da_ivkvsortik(const size_t n, da_ivkv_t* const base)
+{
+#define da_ivkv_klt(a, b) ((a)->key < (b)->key)
+    DA_MKQSORT(da_ivkv_t, base, n, da_ivkv_klt);
+#undef da_ivkv_klt
+}
+
+
+/*************************************************************************/
+/*! Sorts an array of da_ivkv_t in decreasing order, ties in decreasing
+    order of keys, as da_knnheap_ToCsr orders neighbors */
+/*************************************************************************/
+void da_ivkvsortdk(const size_t n, da_ivkv_t* const base)
+{
+#define da_ivkv_gtk(a, b) ((a)->val > (b)->val || ((a)->val == (b)->val && (a)->key > (b)->key))
+    DA_MKQSORT(da_ivkv_t, base, n, da_ivkv_gtk);
+#undef da_ivkv_gtk
+}
+
 /* Byte-wise swap two items of size SIZE. */
 #define DA_QSSWAP(a, b, stmp) do { stmp = (a); (a) = (b); (b) = stmp; } while (0)
 
@@ -58,9 +58,114 @@ typedef struct da_csr_t {
 	idx_t *rowind, *colind;
 	val_t *rowval, *colval;
 	val_t *rnorms, *cnorms;
+	char *mapbase;                /* memory-mapped binary file the arrays may point into */
+	size_t mapsize;               /* size of the mapping */
+	char preprocessed;            /* rows were scaled by IDF and normalized by preprocessInputData */
 } da_csr_t;
 
 
+/*-------------------------------------------------------------
+ * Compressed row ids of a column index (PFor-style). The ids of column
+ * i are stored in blocks of DA_CIDX_BLOCK ids, starting at data+cbyte[i].
+ * A block holds its first id (uint32), the bit width b of its gaps
+ * (uint8), its number of exceptions e (uint8), the positions (uint8)
+ * and high parts (uint32, the bits above b) of the e gaps that do not
+ * fit in b bits, and the low b bits of each gap minus 1, bit-packed.
+ * Values stay in the colval array of the matrix.
+ *-------------------------------------------------------------*/
+typedef struct da_cidx_t {
+	idx_t ncols;
+	size_t *cbyte;                /* start of the blocks of each column in data */
+	unsigned char *data;          /* blocks, followed by 8 bytes of padding */
+	size_t size;                  /* bytes in data, excluding padding */
+} da_cidx_t;
+
+
+/*-------------------------------------------------------------
+ * Quantized values of a column index. Value j of column i is stored as
+ * the number of steps cstep[i] nearest to it, in nbits bits, such that
+ * it differs from the float value by at most cstep[i]/2.
+ *-------------------------------------------------------------*/
+typedef struct da_qidx_t {
+	idx_t ncols;
+	char nbits;                   /* 8 or 16 */
+	val_t *cstep;                 /* quantization step of each column */
+	uint8_t *val8;                /* values, if nbits is 8 */
+	uint16_t *val16;              /* values, if nbits is 16 */
+} da_qidx_t;
+
+
+/*-------------------------------------------------------------
+ * Header of the binary CSR format (DA_FMT_BINROW/DA_FMT_BINCOL).
+ * Arrays follow the header, each aligned to DA_BIN_ALIGN bytes.
+ * Version 1 headers end before the flags.
+ *-------------------------------------------------------------*/
+typedef struct da_csrbin_t {
+	char magic[8];                /* DA_BIN_MAGIC */
+	uint32_t version;             /* DA_BIN_VERSION */
+	uint32_t idxsize, ptrsize, valsize;  /* sizeof(idx_t), sizeof(ptr_t), sizeof(val_t) */
+	int64_t nrows, ncols, nnz;
+	uint64_t offset[6];           /* of rowptr, rowind, rowval, colptr, colind, colval; 0 if absent */
+	uint64_t size;                /* file size */
+	uint32_t flags;               /* DA_BIN_* flags */
+	uint32_t reserved;            /* 0 */
+} da_csrbin_t;
+
+
+/*-------------------------------------------------------------
+ * Header of the binary neighbor graph format (DA_FMT_BINNBR/
+ * DA_FMT_BINNBR16). It is followed by a table of the nrows+1 file
+ * offsets of the rows, and by the rows. Each row stores its length and
+ * the gaps between its ids, in increasing order, as varints, followed
+ * by the values of the ids as fp32 or fp16 numbers.
+ *-------------------------------------------------------------*/
+typedef struct da_nbrbin_t {
+	char magic[8];                /* DA_NBR_MAGIC */
+	uint32_t version;             /* DA_NBR_VERSION */
+	uint32_t valsize;             /* bytes per value: 4, 2, or 0 if no values are stored */
+	uint32_t flags;               /* DA_NBR_* flags */
+	uint32_t reserved;            /* 0 */
+	int64_t nrows, ncols, nnz;
+	uint64_t size;                /* file size */
+} da_nbrbin_t;
+
+
+/*-------------------------------------------------------------
+ * Header of a serve mode query, in native byte order. It is followed
+ * by the nnz column ids (int32, as in the input file, starting at 0)
+ * and the nnz raw values (fp32) of the query vector. A column id may
+ * appear only once; a query that repeats one is answered with
+ * DA_SRV_EINVAL, as is an invalid header, and the connection is closed.
+ *-------------------------------------------------------------*/
+typedef struct da_srvquery_t {
+	int32_t k;                    /* number of neighbors to return */
+	float eps;                    /* minimum similarity of the neighbors */
+	int32_t nnz;                  /* number of non-zeros in the query vector */
+} da_srvquery_t;
+
+
+/*-------------------------------------------------------------
+ * Header of a serve mode response. It is followed by the n row ids
+ * (int32, starting at 0) and the n similarities (fp32) of the
+ * neighbors, in decreasing similarity order.
+ *-------------------------------------------------------------*/
+typedef struct da_srvresp_t {
+	int32_t status;               /* DA_SRV_* status code */
+	int32_t n;                    /* number of neighbors */
+} da_srvresp_t;
+
+
+/*-------------------------------------------------------------
+ * The following data structure stores the current top-k
+ * neighbors of each row as a set of bounded min-heaps
+ *-------------------------------------------------------------*/
+typedef struct da_knnheap_t {
+	idx_t nrows, k;
+	idx_t *nnbrs;                 /* number of neighbors in each row's heap */
+	da_ivkv_t *heap;              /* k-sized heap for each row, stored contiguously */
+} da_knnheap_t;
+
+
 /*************************************************************************/
 /*! This data structure stores the various variables that make up the 
  * overall state of the system.                                          */
@@ -70,6 +175,7 @@ typedef struct {
 	char mode;                    /* What algorithm to execute */
     int32_t k;                    /* k in K-NN */
 	float epsilon;                /* Similarity threshold */
+	int32_t nthreads;             /* Number of threads to use in the search */
 
 	char stats;                   /* Display additional statistics for the matrix in info mode. */
 	float fldelta;                /* Float delta, for testing matrix value equality. */
@@ -84,8 +190,28 @@ typedef struct {
 	char *iFile;                  /* The filestem of the input data CSR matrix file. */
     char *oFile;                  /* The filestem of the output file. */
     char *vFile;                  /* The filestem of the verification file. */
+    char *qFile;                  /* The query matrix file, if searching for neighbors of other rows (ij mode). */
+    char *gFile;                  /* The neighbor graph of the input rows (update mode). */
+    char *aFile;                  /* The matrix file of the rows appended to the input (update mode). */
+    idx_t idfrows;                /* Number of leading input rows the IDF is computed over, 0 for all (update mode). */
+    float rebuild;                /* Fraction of rows appended since the IDF rows that triggers a rebuild (update mode). */
+    char *sFile;                  /* The Unix domain socket path (serve mode). */
+    char *cacheDir;               /* Directory holding preprocessed input matrices. */
+    char *cacheFile;              /* Cache file for the input file and preprocessing options. */
+    char preprocessed;            /* Whether docs has already been preprocessed. */
+    char cidx;                    /* Whether to compress the column index (ij mode). */
+    char qbits;                   /* Bits of the quantized column index values, 0 for none (ij mode). */
+    size_t memlimit;              /* Memory budget in bytes for out-of-core search, 0 for none (ij mode). */
+    int32_t nshards;              /* Number of row shards (shard mode). */
+    char ranged;                  /* Whether a query or index row range was given (ij mode). */
+    idx_t qrange[2];              /* Query rows [start, end), end -1 for all rows (ij mode). */
+    idx_t irange[2];              /* Indexed rows [start, end), end -1 for all rows (ij mode). */
 	char *filename;               /* temp space for creating output file names */
     da_csr_t  *docs;              /* Documents structure */
+    da_csr_t  *queries;           /* Query rows structure, if qFile is given */
+    idx_t incols;                 /* Number of input columns before compaction (serve mode). */
+    idx_t *colmap;                /* Compacted id of each input column, -1 if empty (serve mode). */
+    double *cscale;               /* IDF of each compacted column (serve mode). */
 	da_csr_t  *neighbors;         /* Neighbors structure */
 
 	/* internal vars */
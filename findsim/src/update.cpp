@@ -0,0 +1,130 @@
+/*!
+ \file  update.c
+ \brief This file contains the incremental update of a neighbor graph when rows are appended
+ to its input matrix.
+
+ The IDF of the columns is frozen: it is computed over a fixed number of leading rows of the
+ input (-idfrows), and both the input rows and the appended rows are scaled by it. Similarities
+ between input rows are then unaffected by the appended rows, so the given graph stays valid, and
+ only pairs involving an appended row must be computed. The input rows and the appended rows are
+ preprocessed and indexed as two blocks, and three block searches find the similarities of input
+ rows with appended rows, of appended rows with input rows, and of appended rows with each other.
+ They are offered to top-$k$ heaps seeded with the given graph, so an input row gains an appended
+ row as neighbor only if it beats its current $k$-th similarity. The result is the graph that ij
+ computes over all rows with the same frozen IDF.
+
+ As rows accumulate, the frozen IDF drifts from the IDF of the whole matrix. Once the rows added
+ since the IDF rows exceed a fraction (-rebuild) of them, the graph is rebuilt from scratch by
+ the ij mode, with the IDF of all rows.
+ */
+
+#include "includes.h"
+
+/**
+ * Main entry point to the update mode.
+ */
+void knnupdate(params_t *params)
+{
+    ssize_t i, j;
+    size_t ncands, npatched;
+    idx_t nrows, nnew, nidf, *colmap;
+    double drift, *cscale;
+    da_csr_t *docs, *rows, *graph, basis, *oblk, *nblk, *neighbors;
+    da_knnheap_t *knng;
+
+    docs  = params->docs;
+    nrows = docs->nrows;
+
+    /* read the graph of the input rows and the appended rows */
+    graph = da_csr_Read(params->gFile, da_getFileFormat(params->gFile, 0), 1, 1);
+    if(graph->nrows != nrows)
+        da_errexit("The graph in %s has " PRNT_IDXTYPE " rows, but the input has " PRNT_IDXTYPE
+                " rows.\n", params->gFile, graph->nrows, nrows);
+    rows = da_csr_Read(params->aFile, da_getFileFormat(params->aFile, 0), params->readVals,
+            params->readNum);
+    if(!rows->rowptr)
+        da_csr_CreateIndex(rows, DA_ROW);
+    nnew = rows->nrows;
+
+    nidf = (params->idfrows > 0 ? params->idfrows : nrows);
+    if(nidf > nrows)
+        da_errexit("The -idfrows value " PRNT_IDXTYPE " exceeds the " PRNT_IDXTYPE
+                " input rows.\n", nidf, nrows);
+    drift = (double)(nrows + nnew - nidf) / nidf;
+    if(params->verbosity > 0)
+        printf("Appending " PRNT_IDXTYPE " rows to " PRNT_IDXTYPE " rows, IDF over "
+                PRNT_IDXTYPE " rows, %.2f%% rows added since.\n", nnew, nrows, nidf, 100.0*drift);
+
+    /* rebuild the graph once the frozen IDF has drifted too far */
+    if(drift > params->rebuild){
+        printf("Rows added since the IDF rows exceed -rebuild %.2f%%; rebuilding the graph. "
+                "Use -idfrows " PRNT_IDXTYPE " in subsequent updates.\n",
+                100.0*params->rebuild, nrows + nnew);
+        params->docs = da_csr_AppendRows(docs, rows);
+        da_csr_FreeAll(&docs, &rows, &graph, LTERM);
+        params->mode = MODE_IDXJOIN;
+        idxjoin(params);
+        return;
+    }
+
+    timer_start(params->timer_3); /* overall knn graph construction time */
+
+    /* frozen IDF, over the leading nidf input rows; appended rows lose the columns the input
+       does not have, whose IDF is unknown */
+    basis = *docs;
+    basis.nrows = nidf;
+    cscale = da_csr_GetIdf(&basis);
+    if(rows->ncols > docs->ncols){
+        colmap = da_imalloc(rows->ncols, "knnupdate: colmap");
+        for(i=0; i < rows->ncols; i++)
+            colmap[i] = (i < docs->ncols ? i : -1);
+        da_csr_MapColumns(rows, colmap, rows->ncols, docs->ncols);
+        da_free((void**)&colmap, LTERM);
+    } else
+        rows->ncols = docs->ncols;
+
+    timer_start(params->timer_7); /* indexing time */
+    oblk = ooc_makeBlock(docs, 0, nrows, cscale, 1);
+    nblk = ooc_makeBlock(rows, 0, nnew, cscale, 1);
+    timer_stop(params->timer_7); /* indexing time */
+    da_csr_FreeAll(&params->docs, &rows, LTERM);
+    da_free((void**)&cscale, LTERM);
+
+    /* seed the heaps of the input rows with their current neighbors */
+    timer_start(params->timer_5); /* memory allocation time */
+    knng = da_knnheap_Create(nrows + nnew, params->k);
+    timer_stop(params->timer_5); /* memory allocation time */
+    for(i=0; i < nrows; i++)
+        for(j=graph->rowptr[i]; j < graph->rowptr[i+1]; j++)
+            if(graph->rowval[j] >= params->epsilon)
+                da_knnheap_Insert(knng, i, graph->rowind[j], graph->rowval[j]);
+    da_csr_Free(&graph);
+
+    /* each pair of an input and an appended row is computed from both sides, so that each
+       heap is only updated by the thread searching for its row */
+    ncands  = ooc_searchBlock(params, oblk, 0, nblk, nrows, knng, 0);
+    ncands += ooc_searchBlock(params, nblk, nrows, oblk, 0, knng, 0);
+    ncands += ooc_searchBlock(params, nblk, nrows, nblk, nrows, knng, 0);
+
+    neighbors = da_knnheap_ToCsr(knng);
+    neighbors->ncols = nrows + nnew;
+    da_knnheap_Free(&knng);
+    timer_stop(params->timer_3); // find neighbors time
+
+    /* input rows that gained an appended row as neighbor */
+    for(npatched=0, i=0; i < nrows; i++)
+        for(j=neighbors->rowptr[i]; j < neighbors->rowptr[i+1]; j++)
+            if(neighbors->rowind[j] >= nrows){
+                npatched++;
+                break;
+            }
+
+    printf("Number of computed similarities: %zu\n", ncands);
+    printf("Number of updated input rows: %zu\n", npatched);
+    printf("Number of neighbors: " PRNT_PTRTYPE "\n", neighbors->rowptr[nrows + nnew]);
+
+    da_csr_Write(neighbors, params->oFile, (params->fmtWrite > 0 ? params->fmtWrite : DA_FMT_CSR), 1, 1);
+    printf("Wrote output to %s\n", params->oFile);
+
+    da_csr_FreeAll(&neighbors, &oblk, &nblk, LTERM);
+}
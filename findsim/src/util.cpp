@@ -7,15 +7,36 @@
 
 #include "includes.h"
 
+/* jump buffer of the library call in progress in this thread, if any (see libfindsim.cpp) */
+__thread jmp_buf *da_errjmp = NULL;
+
+/* file formats, by name or extension (see da_getFileFormat) */
+const da_StringMap_t fmt_options[] = {
+  {"clu",               DA_FMT_CLUTO},
+  {"csr",               DA_FMT_CSR},
+  {"met",               DA_FMT_METIS},
+  {"ijv",               DA_FMT_IJV},
+  {"binr",              DA_FMT_BINROW},
+  {"binc",              DA_FMT_BINCOL},
+  {"bin",               DA_FMT_BINROW},
+  {"nbr",               DA_FMT_BINNBR},
+  {"nbr16",             DA_FMT_BINNBR16},
+  {NULL,                 0}
+};
+
 
 /*************************************************************************/
-/*! This function prints an error message and raises a signum signal
+/*! This function prints an error message and raises a signum signal.
+    Within a library call, it returns to the call instead.
  */
 /*************************************************************************/
 void da_errexit(const char* const f_str,...)
 {
     va_list argp;
 
+    if (da_errjmp)
+        longjmp(*da_errjmp, 1);
+
     va_start(argp, f_str);
     vfprintf(stderr, f_str, argp);
     va_end(argp);
@@ -49,7 +70,16 @@ char da_getFileFormat(char *file, const char format)
 		for (p=ext ; *p; ++p) *p = tolower(*p);
 		if ((fmt = da_getStringID(fmt_options, ext)) > -1)
 			return fmt;
-	} else if(da_fexists(file)){ // assume some sort of CSR. Can we guess?
+	} else if(da_fexists(file)){ // binary files start with a magic string
+		char magic[8];
+		FILE *fp = da_fopen(file, "r", "da_getFileFormat: fp");
+		fmt = (fread(magic, 1, 8, fp) == 8);
+		da_fclose(fp);
+		if(fmt && memcmp(magic, DA_BIN_MAGIC, 8) == 0)
+			return DA_FMT_BINROW;
+		if(fmt && memcmp(magic, DA_NBR_MAGIC, 8) == 0)
+			return DA_FMT_BINNBR;
+		// assume some sort of CSR. Can we guess?
 		da_getfilestats(file, NULL, &nnz, NULL, NULL);
 		return (nnz%2 == 1) ? DA_FMT_CLUTO : DA_FMT_CSR;
 	}
@@ -57,6 +87,29 @@ char da_getFileFormat(char *file, const char format)
 }
 
 
+/*************************************************************************/
+/*! Gets the relative precision of the values stored in a matrix file, i.e.,
+ *  the largest relative error of a value read from it.
+    \param file is the matrix file to be checked.
+    \param format is the format of the file, as returned by da_getFileFormat.
+    \return 2^-11 for binary neighbor files with fp16 values, 0 otherwise.
+ */
+/*************************************************************************/
+double da_getValPrec(char *file, const char format)
+{
+	size_t nread;
+	da_nbrbin_t hdr;
+	FILE *fp;
+
+	if(format != DA_FMT_BINNBR && format != DA_FMT_BINNBR16)
+		return 0.0;
+	fp = da_fopen(file, "r", "da_getValPrec: fp");
+	nread = fread(&hdr, sizeof(da_nbrbin_t), 1, fp);
+	da_fclose(fp);
+	return (nread == 1 && hdr.valsize == 2 ? 1.0/2048 : 0.0);
+}
+
+
 
 #define COMPERRPRINT(ar, ac, av, br, bc, bv, rc, fr) \
 	printf("%sa[" PRNT_IDXTYPE "," PRNT_IDXTYPE "," PRNT_VALTYPE \
@@ -77,9 +130,10 @@ char da_getFileFormat(char *file, const char format)
  * 	\param doc1 first matrix to compare
  * 	\param doc2 second matrix to compare
  * 	\param eps Float max delta for value comparison
+ * 	\param rtol Float max delta relative to the values, e.g., their precision (see da_getValPrec)
  * 	\param compVals Whether values should be compared
  */
-void da_csrCompare(da_csr_t* doc1, da_csr_t* doc2, float eps, char compInds, char compVals){
+void da_csrCompare(da_csr_t* doc1, da_csr_t* doc2, float eps, double rtol, char compInds, char compVals){
 	ssize_t j, k, ndiff = 0;
 	idx_t i, l, fr;
 	da_csr_t *a = NULL, *b = NULL;
@@ -163,7 +217,7 @@ void da_csrCompare(da_csr_t* doc1, da_csr_t* doc2, float eps, char compInds, cha
             fr=0;
             for(j=ptr1[i], k=ptr2[i]; j < ptr1[i+1] && k < ptr2[i+1]; ){
                 if(ind1[j] == ind2[k]){
-                    if(compVals && da_abs(val1[j] - val2[k]) > eps){
+                    if(compVals && da_abs(val1[j] - val2[k]) > eps + rtol*da_abs(val2[k])){
                         COMPERRPRINT(i+1, ind1[j]+1, val1[j], i+1, ind2[k]+1, val2[k], rc, fr);
                         ndiff++;
                     }
@@ -220,8 +274,9 @@ void da_csrCompare(da_csr_t* doc1, da_csr_t* doc2, float eps, char compInds, cha
  * \param ngbrs2 True Neighbors found for each row in the input matrix
  * \param nsz Check only first nsz neighbors
  * \param print_errors Print any errors encountered
+ * \param rtol Max delta of similarities relative to their value, besides 1e-4 (see da_getValPrec)
  */
-void verify_knng_results(da_csr_t *ngbrs1, da_csr_t *ngbrs2, idx_t nsz, char print_errors)
+void verify_knng_results(da_csr_t *ngbrs1, da_csr_t *ngbrs2, idx_t nsz, char print_errors, double rtol)
 {
     float v, lv, lv2;
     double recall, crecall;
@@ -265,14 +320,14 @@ void verify_knng_results(da_csr_t *ngbrs1, da_csr_t *ngbrs2, idx_t nsz, char pri
             v = val2[j];
             if(row[cid] > -1){
                 c++;
-                if(da_abs(row[cid] - v) < 1e-4){
+                if(da_abs(row[cid] - v) < 1e-4 + rtol*da_abs(v)){
                     cc++;
                 } else if(print_errors > 0){  /* show neighbors we found who's sim may be incorrectly computed */
                     printf("[%zu %zu %f %f] ", i+1, cid+1, v, row[cid]);
                     err++;
                 }
                 row[cid] = 1;
-            } else if(da_abs(lv - v) < 1e-4){
+            } else if(da_abs(lv - v) < 1e-4 + rtol*da_abs(v)){
                 cc++;
                 if(print_errors > 1){ /* show neighbors we did not find within the min values */
                     printf("[%zu *%zu %f] ", i+1, cid+1, v);